@@ -34,10 +34,28 @@
 
 #include <sys/errno.h>
 #include <sys/param.h>
+#include <sys/bus.h>
+#include <sys/cpu.h>
+#include <sys/eventhandler.h>
+#include <sys/fcntl.h>
+#include <sys/cpuset.h>
+#include <sys/firmware.h>
 #include <sys/kernel.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/mman.h>
 #include <sys/module.h>
+#include <sys/mutex.h>
+#include <sys/callout.h>
+#include <sys/conf.h>
+#include <sys/power.h>
+#include <sys/proc.h>
+#include <sys/resource.h>
+#include <sys/sbuf.h>
+#include <sys/sched.h>
 #include <sys/systm.h>
 #include <sys/sysctl.h>
+#include <sys/taskqueue.h>
 
 #if __FreeBSD_version >= 502000
 #include <sys/smp.h>
@@ -49,729 +67,4660 @@
 #include <sys/timetc.h>
 #endif
 
-#if __FreeBSD_version < 500023
-#include <sys/proc.h>
+#if __FreeBSD_version >= 500023
+#include <sys/pcpu.h>
+#endif
+
+#include <vm/vm.h>
+#include <vm/pmap.h>
+
+#include <machine/atomic.h>
+#include <machine/clock.h>
+#include <machine/md_var.h>
+#include <machine/specialreg.h>
+
+/* Names and numbers from IA-32 System Programming Guide */
+#define MSR_PERF_STATUS		0x198
+#define MSR_PERF_CTL		0x199
+#define MSR_FSB_FREQ		0xcd	/* Core Solo/Duo and later */
+
+/* Specifies a frequency, and how to get it. */
+typedef struct {
+	uint16_t MHz;
+	uint16_t ID;
+} freq_info;
+
+/* Core voltage of a PERF ID, from its VID. */
+#define	EST_VID_MV(ID16)	(700 + 16 * ((ID16) & 0xff))
+
+/*
+ * Identifying characteristics of a processor, and where its operating
+ * points live in est_pstates[].  The tables themselves are generated
+ * from estprocs by estprocs2h.awk.
+ */
+typedef struct {
+	const char * name;
+	uint32_t ID;			/* MSR_PERF_STATUS[63:32] */
+	uint16_t BUSCLK;
+	uint8_t vendor;			/* index into est_vendors[] */
+	uint16_t first;			/* index into est_pstates[] */
+	uint8_t nstates;
+} est_proc;
+
+#include "estprocs.h"
+#include "est_PM.h"
+
+#include "cpufreq_if.h"
+
+char GenuineIntel[12] = "GenuineIntel";
+
+/* Bus clocks quoted as 133 or 166 MHz are really 133 1/3 and 166 2/3. */
+static int
+est_busclk_khz(int BUSCLK)
+{
+	int kHz;
+
+	kHz = BUSCLK * 1000;
+	if (BUSCLK % 100 == 33)
+		kHz += 333;
+	else if (BUSCLK % 100 == 66)
+		kHz += 667;
+	return (kHz);
+}
+
+static int
+est_ratio_mhz(int ratio, int BUSCLK)
+{
+
+	return ((ratio * est_busclk_khz(BUSCLK) + 500) / 1000);
+}
+
+static int est_verbose = 0;
+SYSCTL_INT(_hw, OID_AUTO, est_verbose, CTLFLAG_RW, &est_verbose,
+	   0, "Log CPU frequency changes");
+
+SYSCTL_NODE(_hw, OID_AUTO, est, CTLFLAG_RD, 0, "Enhanced SpeedStep");
+
+/*
+ * Residency and transition statistics, exported under hw.est.stats.
+ * They are kept in freq_list order and updated with est_mtx held by
+ * whoever changes the setpoint, so the cost on the transition path is
+ * one getbinuptime() and a few increments.
+ */
+#define	EST_LAT_BUCKETS	12		/* <1us, <2us, ... <1024us, more */
+
+struct est_stats {
+	uint64_t	residency[EST_MAX_STATES];	/* us */
+	uint32_t	trans[EST_MAX_STATES][EST_MAX_STATES];
+	uint32_t	latency[EST_LAT_BUCKETS];
+	uint32_t	count;
+	uint64_t	since;		/* when we entered cur, us */
+	int		cur;
+};
+
+/* What est_calibrate() measured at one setpoint. */
+struct est_calib {
+	uint32_t	mhz;		/* TSC rate while spinning */
+	uint32_t	rate;		/* loop iterations per ms */
+	uint32_t	trans_us;	/* time taken to switch to it */
+	int		flags;
+};
+
+#define	EST_CAL_MHZ	0x01		/* mhz is off the table */
+#define	EST_CAL_RATE	0x02		/* little work done for mhz */
+
+/*
+ * Per-CPU state.  Every CPU gets its own table, since nothing stops a
+ * dual-socket board from carrying two different steppings.  CPUs in
+ * the same package share a voltage plane and therefore a setpoint:
+ * they form a domain, named after its lowest-numbered CPU (the
+ * leader), which holds the statistics and runs the governor, and all
+ * members' MSR_PERF_CTL are always written together.
+ */
+struct est_cpu {
+	int		cpu;
+	int		leader;		/* cpuid of our domain's leader */
+	freq_info *	freq_list;	/* NULL if EST is disabled */
+	freq_info	freqtab[EST_MAX_STATES + 1];
+	freq_info	origtab[EST_MAX_STATES + 1];	/* before overrides */
+	int		overridden;
+	int		nstates;
+	int		busclk;
+	uint32_t	synth_id;	/* PERF_STATUS[63:32] if synthesized */
+	uint64_t	load_status;	/* MSR_PERF_STATUS when we found it */
+	int		pkg;		/* see est_package_id() */
+	uint8_t		ratio_idx[256];
+	uint8_t		floor_idx[256];
+	uint8_t		ceil_idx[256];
+	char		freqs[EST_MAX_STATES * 6 + 1];
+	struct est_stats stats;
+	int		state;		/* leader: EST_SS_*, see est_shared_update() */
+	struct callout	gov_callout;
+	long		gov_cp_time[CPUSTATES];	/* this CPU's, last period */
+	int		gov_quiet;
+	int		prof_fast;	/* range the power profile allows */
+	int		prof_slow;
+	int		want;		/* index asked for, before limits */
+	int		async_want;	/* index queued for est_async_task */
+	int		boot_idx;	/* index the boot policy asked for */
+	int		resume_idx;	/* index at suspend */
+	struct callout	qos_callout;
+	int		therm_ceil;	/* fastest index allowed */
+	int		therm_cool;	/* cool samples in a row */
+	struct callout	therm_callout;
+	struct callout	shared_callout;
+	struct est_calib calib[EST_MAX_STATES];	/* leader, if calibrated */
+	int		calibrated;
+	struct sysctl_ctx_list sysctl_ctx;
+};
+
+static MALLOC_DEFINE(M_EST, "est_PM", "Enhanced SpeedStep driver");
+
+static struct est_cpu * est_cpus = NULL;	/* mp_maxid + 1 entries */
+
+#define	EST_CPU(n)		(&est_cpus[(n)])
+#define	EST_LEADER(ec)		(&est_cpus[(ec)->leader])
+#define	EST_FOREACH(ec)						\
+	for ((ec) = est_cpus; est_cpus != NULL &&			\
+	    (ec) <= &est_cpus[mp_maxid]; (ec)++)			\
+		if ((ec)->freq_list != NULL)
+#define	EST_FOREACH_LEADER(ec)						\
+	EST_FOREACH(ec)							\
+		if ((ec)->leader == (ec)->cpu)
+#define	EST_FOREACH_MEMBER(ec, m)					\
+	EST_FOREACH(m)							\
+		if ((m)->leader == (ec)->leader)
+
+/* Serializes P-state transitions between the sysctls and the governor. */
+static struct mtx est_mtx;
+MTX_SYSINIT(est_mtx, &est_mtx, "est_PM", MTX_DEF);
+
+/*
+ * The MSRs are per CPU, so est_rdmsr() and est_wrmsr() must run on
+ * the CPU they are about: either from a callout bound to it, from a
+ * rendezvous, or between est_bind() and est_unbind().
+ */
+#ifdef EST_SIM
+static uint64_t	est_sim_rdmsr(u_int msr);
+static void	est_sim_wrmsr(u_int msr, uint64_t val);
+static void	est_sim_cp_time(int cpu, long *cp);
+static uint64_t	est_sim_rdtsc(void);
+static uint64_t	est_sim_clock(void);
+static void	est_sim_spin(u_int n);
+#define	est_rdmsr(msr)		est_sim_rdmsr(msr)
+#define	est_wrmsr(msr, val)	est_sim_wrmsr(msr, val)
+#define	est_read_cp_time(cpu, cp)	est_sim_cp_time(cpu, cp)
+#define	est_rdtsc()		est_sim_rdtsc()
+#define	est_calib_ns()		est_sim_clock()
+#define	est_calib_spin(n)	est_sim_spin(n)
+#else
+#define	est_rdtsc()		rdtsc()
+#define	est_rdmsr(msr)		rdmsr(msr)
+#define	est_wrmsr(msr, val)	wrmsr(msr, val)
+#define	est_read_cp_time(cpu, cp)					\
+	bcopy(pcpu_find(cpu)->pc_cp_time, (cp), sizeof(long) * CPUSTATES)
+#endif
+
+static void
+est_bind(int cpu)
+{
+
+	thread_lock(curthread);
+	sched_bind(curthread, cpu);
+	thread_unlock(curthread);
+}
+
+static void
+est_unbind(void)
+{
+
+	thread_lock(curthread);
+	sched_unbind(curthread);
+	thread_unlock(curthread);
+}
+
+/*
+ * As est_bind(), for callers whose thread may already be bound, such
+ * as the suspend and resume methods, which acpi_EnterSleepState()
+ * calls bound to CPU 0 and expecting to stay there.  Returns the CPU
+ * to hand to est_rebind() afterwards, or -1 if the thread was free.
+ */
+static int
+est_bind_save(int cpu)
+{
+	int old;
+
+	thread_lock(curthread);
+	old = sched_is_bound(curthread) ? curcpu : -1;
+	sched_bind(curthread, cpu);
+	thread_unlock(curthread);
+	return (old);
+}
+
+static void
+est_rebind(int old)
+{
+
+	thread_lock(curthread);
+	if (old >= 0)
+		sched_bind(curthread, old);
+	else
+		sched_unbind(curthread);
+	thread_unlock(curthread);
+}
+
+/*
+ * Direct-indexed maps from a bus ratio (the high byte of a PERF ID)
+ * to a freq_list index, or EST_NOSTATE.  ratio_idx has the entry
+ * running at exactly that ratio; floor_idx the fastest entry at or
+ * below it, and ceil_idx the slowest entry at or above it.  Since the
+ * ratio alone identifies an entry, reading MSR_PERF_STATUS back to a
+ * setpoint and looking up a requested frequency are both O(1).
+ */
+#define	EST_NOSTATE	0xff
+
+/* Rebuild the maps above after ec->freq_list changes. */
+static void
+est_index_build(struct est_cpu * ec, int BUSCLK)
+{
+	freq_info * fl;
+	int i, r;
+
+	fl = ec->freq_list;
+	memset(ec->ratio_idx, EST_NOSTATE, sizeof(ec->ratio_idx));
+	for (i = 0; fl[i].ID != 0; i++)
+		ec->ratio_idx[fl[i].ID >> 8] = i;
+	ec->nstates = i;
+	ec->busclk = BUSCLK;
+
+	i = EST_NOSTATE;
+	for (r = 0; r < 256; r++) {
+		if (ec->ratio_idx[r] != EST_NOSTATE)
+			i = ec->ratio_idx[r];
+		ec->floor_idx[r] = i;
+	}
+	i = EST_NOSTATE;
+	for (r = 255; r >= 0; r--) {
+		if (ec->ratio_idx[r] != EST_NOSTATE)
+			i = ec->ratio_idx[r];
+		ec->ceil_idx[r] = i;
+	}
+}
+
+/* Return the freq_list index of PERF ID ID16, or -1. */
+static int
+est_id_index(struct est_cpu * ec, uint16_t ID16)
+{
+	int i;
+
+	i = ec->ratio_idx[ID16 >> 8];
+	if (i == EST_NOSTATE || ec->freq_list[i].ID != ID16)
+		return (-1);
+	return (i);
+}
+
+/* Ways of mapping a requested frequency onto freq_list. */
+#define	EST_ROUND_EXACT		0	/* must be on the table */
+#define	EST_ROUND_NEAREST	1
+#define	EST_ROUND_DOWN		2	/* fastest entry <= MHz */
+#define	EST_ROUND_UP		3	/* slowest entry >= MHz */
+
+static int est_round = EST_ROUND_EXACT;
+SYSCTL_INT(_hw_est, OID_AUTO, round, CTLFLAG_RWTUN, &est_round, 0,
+    "Writes to est_curfreq: 0 exact, 1 nearest, 2 round down, 3 round up");
+
+/*
+ * Return the freq_list index for MHz according to mode, or -1 if there
+ * is no such entry.  Requests beyond either end of the table round to
+ * that end, except in EST_ROUND_EXACT mode.
+ */
+static int
+est_mhz_index(struct est_cpu * ec, int MHz, int mode)
+{
+	int kHz, r, lo, hi, i;
+
+	if (MHz <= 0)
+		return (-1);
+	kHz = est_busclk_khz(ec->busclk);
+	/* 64 bits, since MHz comes straight from sysctl writes. */
+	r = (int)MIN(((int64_t)MHz * 1000 + kHz / 2) / kHz, 255);
+	if (est_ratio_mhz(r, ec->busclk) == MHz &&
+	    (i = ec->ratio_idx[r]) != EST_NOSTATE)
+		return (i);
+	if (mode == EST_ROUND_EXACT)
+		return (-1);
+
+	/* lo is the index of the entry below MHz, hi the one above. */
+	if (est_ratio_mhz(r, ec->busclk) > MHz && r > 0)
+		r--;
+	lo = ec->floor_idx[r];
+	hi = r < 255 ? ec->ceil_idx[r + 1] : EST_NOSTATE;
+	if (lo == EST_NOSTATE)
+		return (hi == EST_NOSTATE ? -1 : hi);
+	if (hi == EST_NOSTATE)
+		return (lo);
+
+	switch (mode) {
+	case EST_ROUND_DOWN:
+		return (lo);
+	case EST_ROUND_UP:
+		return (hi);
+	default:
+		return (ec->freq_list[hi].MHz - MHz <
+		    MHz - ec->freq_list[lo].MHz ? hi : lo);
+	}
+}
+
+static uint64_t
+est_uptime_us(void)
+{
+	struct bintime bt;
+
+	getbinuptime(&bt);
+	return ((uint64_t)bt.sec * 1000000 +
+	    (((bt.frac >> 32) * 1000000) >> 32));
+}
+
+/* Microseconds since *bt0, as binuptime() tells. */
+static int
+est_us_since(const struct bintime * bt0)
+{
+	struct bintime bt;
+
+	binuptime(&bt);
+	return ((int)((bt.sec - bt0->sec) * 1000000 +
+	    (int64_t)(((bt.frac >> 32) * 1000000) >> 32) -
+	    (int64_t)(((bt0->frac >> 32) * 1000000) >> 32)));
+}
+
+/* Forget everything, and start counting with the CPU at index cur. */
+static void
+est_stats_reset(struct est_stats * st, int cur)
+{
+
+	bzero(st, sizeof(*st));
+	st->cur = cur;
+	st->since = est_uptime_us();
+}
+
+/*
+ * Account for a move of ec's domain to freq_list[to].  latency is how
+ * long the transition took in us, or -1 if we only noticed it after
+ * the fact.
+ */
+static void
+est_stats_switch(struct est_cpu * ec, int to, int latency)
+{
+	struct est_stats * st;
+	uint64_t now;
+	int b;
+
+	mtx_assert(&est_mtx, MA_OWNED);
+
+	st = &EST_LEADER(ec)->stats;
+	now = est_uptime_us();
+	st->residency[st->cur] += now - st->since;
+	st->since = now;
+	if (to == st->cur)
+		return;
+
+	st->trans[st->cur][to]++;
+	st->count++;
+	st->cur = to;
+	if (latency >= 0) {
+		for (b = 0; b < EST_LAT_BUCKETS - 1 && latency >= (1 << b); b++)
+			;
+		st->latency[b]++;
+	}
+}
+
+/*
+ * The Pentium M TSC ticks at the core clock, so every transition
+ * changes its rate.  Rather than refusing to change frequency while
+ * the TSC is the timecounter, we rescale tsc_freq and the TSC
+ * timecounter's tc_frequency from the values calibrated at load time
+ * after each transition.  This only works if every CPU runs at the
+ * same frequency, i.e. there is a single domain; otherwise the TSC
+ * keeps blocking changes.
+ *
+ * The timehands only pick up a new tc_frequency at a windup, so we
+ * force one as soon as we have rescaled (see est_tsc_windup()).  What
+ * the TSC counted between the processor reaching its new setpoint and
+ * our noticing is still converted at the old rate, and est_set_state()
+ * may take up to hw.est.timeout_us to notice, so each transition from
+ * f to f' puts the clock out by at most timeout_us * |f' / f - 1|: up
+ * to 1.25 ms on a 600-2100 MHz part with the default 500 us.  That is
+ * harmless now and then, but the governor can make a transition every
+ * period, so while it runs we only allow changes if the worst case
+ * over a period stays within hw.est.tsc.max_drift_ppm (see
+ * est_tsc_gov_ppm()); with the default 2000 ppm that takes a period
+ * of at least 625 ms on such a part.  Time stays monotonic either way.
+ */
+static int est_tsc_compensate = 1;
+static int est_tsc_check_period = 10;
+static int est_tsc_max_drift_ppm = 2000;
+static int est_tsc_drift_ppm = 0;
+static u_int est_tsc_nfallbacks = 0;
+
+static int est_ndomains = 0;
+static uint64_t est_tsc_base = 0;	/* tsc_freq at est_tsc_mhz */
+static int est_tsc_mhz = 0;
+static int est_tsc_idx = 0;		/* freq_list index of est_tsc_mhz */
+static struct timecounter * est_tsc_tc = NULL;
+static uint64_t est_tsc_tc_base = 0;	/* its tc_frequency at est_tsc_mhz */
+static struct callout est_tsc_callout;
+static struct timecounter * est_tsc_ref = NULL;	/* to check against */
+static struct bintime est_tsc_bt;	/* uptime at the window's start */
+static u_int est_tsc_ref_count;		/* est_tsc_ref's count then */
+static int est_tsc_sampled = 0;		/* in a window? */
+
+static int	est_tsc_gov_ppm(void);
+
+static int
+est_tsc_is_timecounter(void)
+{
+
+	return (strcmp(timecounter->tc_name, "TSC") == 0);
+}
+
+/* Are we allowed to rescale the TSC? */
+static int
+est_tsc_active(void)
+{
+
+	return (est_tsc_compensate && est_ndomains == 1 && est_tsc_base != 0);
+}
+
+/*
+ * Return EBUSY if changing frequency now would upset the timecounter.
+ */
+static int
+est_tsc_busy(void)
+{
+
+	if (est_tsc_is_timecounter() && (!est_tsc_active() ||
+	    est_tsc_gov_ppm() > est_tsc_max_drift_ppm))
+		return (EBUSY);
+	return (0);
+}
+
+/*
+ * Make the timehands take up the TSC's new tc_frequency now rather
+ * than at the next windup.  tc_windup() is private to kern_tc.c, but
+ * tc_setclock() winds up on its way to setting the time of day, which
+ * we set to what it just was.
+ */
+static void
+est_tsc_windup(void)
+{
+	struct timespec ts;
+
+	nanotime(&ts);
+	tc_setclock(&ts);
+}
+
+/* Rescale the TSC for a CPU running at MHz. */
+static void
+est_tsc_scale(int MHz)
+{
+	uint64_t freq;
+
+	mtx_assert(&est_mtx, MA_OWNED);
+
+	tsc_freq = est_tsc_base * MHz / est_tsc_mhz;
+	if (est_tsc_tc == NULL && est_tsc_is_timecounter()) {
+		/* Nobody else touches it, so it's still calibrated. */
+		est_tsc_tc = timecounter;
+		est_tsc_tc_base = est_tsc_tc->tc_frequency;
+	}
+	if (est_tsc_tc == NULL)
+		return;
+	freq = est_tsc_tc_base * MHz / est_tsc_mhz;
+	if (est_tsc_tc->tc_frequency != freq) {
+		est_tsc_tc->tc_frequency = freq;
+		if (est_tsc_tc == timecounter)
+			est_tsc_windup();
+	}
+}
+
+/* ec's domain has moved to freq_list[i]. */
+static void
+est_tsc_switch(struct est_cpu * ec, int i)
+{
+
+	if (est_tsc_active())
+		est_tsc_scale(ec->freq_list[i].MHz);
+}
+
+/*
+ * Transition trace, exported through /dev/est_trace (see est_PM.h).
+ * Each CPU has its own ring, which gets the transitions made through
+ * its est_cpu.  Writers are serialized by est_mtx, which every
+ * transition holds anyway, so a ring never has two producers and
+ * doesn't depend on which CPU the writer runs on; only the readers,
+ * which map the rings, go without a lock, relying on etr_head and the
+ * order in which we update it.
+ * The buffer is allocated when the device is first opened, and
+ * nothing is recorded unless it is open, which costs the transition
+ * path a single test.
+ */
+#define	EST_TC_FAILED	0x80		/* with an EST_TC_*, not in et_cause */
+
+static int est_trace_entries = 1024;
+static int est_trace_consumers = 0;
+static u_int est_trace_nrecorded = 0;
+static char * est_trace_buf = NULL;
+static size_t est_trace_size = 0;
+static int est_trace_mapped = 0;	/* if so, never freed */
+static struct cdev * est_trace_dev = NULL;
+
+#define	EST_TRACE_HDR()							\
+	((struct est_trace_header *)est_trace_buf)
+#define	EST_TRACE_RING(cpu)						\
+	((struct est_trace_ring *)(est_trace_buf +			\
+	    EST_TRACE_HDR()->eth_ring_offset +				\
+	    (cpu) * EST_TRACE_HDR()->eth_ring_size))
+
+/*
+ * Record that ec's domain went from its current index to index to,
+ * settle us after it was asked to (-1: unknown); call before
+ * est_stats_switch().
+ */
+static void
+est_trace_record(struct est_cpu * ec, int to, int settle, int cause)
+{
+	struct est_trace_ring * r;
+	struct est_trace_event * ev;
+	struct bintime bt;
+	uint32_t head;
+	int from;
+
+	if (est_trace_consumers == 0)
+		return;
+	mtx_assert(&est_mtx, MA_OWNED);
+	from = EST_LEADER(ec)->stats.cur;
+	if (to == from && (cause & EST_TC_FAILED) == 0)
+		return;
+
+	r = EST_TRACE_RING(ec->cpu);
+	head = r->etr_head;
+	ev = &r->etr_ev[head & (EST_TRACE_HDR()->eth_nentries - 1)];
+	binuptime(&bt);
+	ev->et_time = (uint64_t)bt.sec * 1000000000 +
+	    (((bt.frac >> 32) * 1000000000) >> 32);
+	ev->et_settle = settle >= 0 ? (uint32_t)settle : EST_TRACE_UNKNOWN;
+	ev->et_from = ec->freq_list[from].ID;
+	ev->et_to = ec->freq_list[to].ID;
+	ev->et_cpu = ec->leader;
+	ev->et_cause = cause & ~EST_TC_FAILED;
+	ev->et_flags = (cause & EST_TC_FAILED) ? EST_TF_FAILED : 0;
+	atomic_store_rel_32(&r->etr_head, head + 1);
+	est_trace_nrecorded++;
+}
+
+static void
+est_trace_dtor(void * data)
+{
+
+	mtx_lock(&est_mtx);
+	est_trace_consumers--;
+	mtx_unlock(&est_mtx);
+}
+
+static int
+est_trace_open(struct cdev * dev, int oflags, int devtype,
+    struct thread * td)
+{
+	struct est_trace_header * eth;
+	char * buf;
+	size_t ring, size;
+	int n, err;
+
+	if (oflags & FWRITE)
+		return (EPERM);
+
+	buf = NULL;
+	if (est_trace_buf == NULL) {
+		for (n = 16; n < est_trace_entries && n < 65536; n <<= 1)
+			;
+		ring = sizeof(struct est_trace_ring) +
+		    n * sizeof(struct est_trace_event);
+		size = round_page(64 + (mp_maxid + 1) * ring);
+		buf = contigmalloc(size, M_EST, M_WAITOK | M_ZERO, 0,
+		    ~(vm_paddr_t)0, PAGE_SIZE, 0);
+		if (buf == NULL)
+			return (ENOMEM);
+		eth = (struct est_trace_header *)buf;
+		eth->eth_magic = EST_TRACE_MAGIC;
+		eth->eth_version = EST_TRACE_VERSION;
+		eth->eth_ncpu = mp_maxid + 1;
+		eth->eth_nentries = n;
+		eth->eth_ring_offset = 64;
+		eth->eth_ring_size = ring;
+	}
+
+	mtx_lock(&est_mtx);
+	if (buf != NULL && est_trace_buf == NULL) {
+		est_trace_buf = buf;
+		est_trace_size = size;
+		buf = NULL;
+	}
+	est_trace_consumers++;
+	mtx_unlock(&est_mtx);
+	if (buf != NULL)
+		contigfree(buf, size, M_EST);
+
+	if ((err = devfs_set_cdevpriv(est_trace_buf, est_trace_dtor)) != 0)
+		est_trace_dtor(NULL);
+	return (err);
+}
+
+static int
+est_trace_mmap(struct cdev * dev, vm_ooffset_t offset, vm_paddr_t * paddr,
+    int nprot, vm_memattr_t * memattr)
+{
+
+	if ((nprot & (PROT_WRITE | PROT_EXEC)) != 0)
+		return (EPERM);
+	if (est_trace_buf == NULL || offset >= est_trace_size)
+		return (EINVAL);
+	*paddr = vtophys(est_trace_buf + offset);
+	est_trace_mapped = 1;
+	return (0);
+}
+
+static struct cdevsw est_trace_cdevsw = {
+	.d_version =	D_VERSION,
+	.d_open =	est_trace_open,
+	.d_mmap =	est_trace_mmap,
+	.d_name =	"est_trace",
+};
+
+static SYSCTL_NODE(_hw_est, OID_AUTO, trace, CTLFLAG_RD, 0,
+    "Transition trace (/dev/est_trace)");
+SYSCTL_INT(_hw_est_trace, OID_AUTO, entries, CTLFLAG_RDTUN,
+    &est_trace_entries, 0, "Events per CPU (rounded up to a power of 2)");
+SYSCTL_INT(_hw_est_trace, OID_AUTO, consumers, CTLFLAG_RD,
+    &est_trace_consumers, 0, "Open files on /dev/est_trace");
+SYSCTL_UINT(_hw_est_trace, OID_AUTO, recorded, CTLFLAG_RD,
+    &est_trace_nrecorded, 0, "Events recorded");
+
+/*
+ * The state page, /dev/est_state, from which userland can read the
+ * current setpoint of every CPU with a few loads instead of a sysctl
+ * and an rdmsr.  Whoever moves a domain updates the entries of its
+ * members with est_mtx held, right after est_stats_switch().  Every
+ * hw.est.shared.verify_ms, each domain's entries are also checked
+ * against MSR_PERF_STATUS by est_shared_tick(), so that a change made
+ * behind our back (e.g. by the BIOS) shows up there as well.  The page
+ * is allocated at load time, before the CPUs are attached, and if it
+ * has ever been mapped, never freed.
+ *
+ * The page is also where the driver's own readers look: est_current()
+ * never takes est_mtx or touches freq_list, which a writer may set to
+ * NULL at any time, so reading the frequency doesn't wait behind a
+ * transition in progress, and can't see a table being torn down.  The
+ * leader's state tells readers what its domain is doing: OFF once
+ * EST has been disabled on it, SWITCHING from est_set_state()'s first
+ * write of MSR_PERF_CTL until the CPU has settled, and IDLE otherwise.
+ */
+static int est_shared_verify_ms = 1000;
+static u_int est_shared_nverified = 0;
+static u_int est_shared_ncorrected = 0;
+static char * est_shared_buf = NULL;
+static size_t est_shared_size = 0;
+static int est_shared_mapped = 0;
+static struct cdev * est_shared_dev = NULL;
+
+#define	EST_SHARED_CPU(cpu)						\
+	((struct est_state_cpu *)(est_shared_buf + 64 +			\
+	    (cpu) * sizeof(struct est_state_cpu)))
+
+static int
+est_shared_init(void)
+{
+	struct est_state_header * esh;
+
+	est_shared_size = round_page(64 +
+	    (mp_maxid + 1) * sizeof(struct est_state_cpu));
+	est_shared_buf = contigmalloc(est_shared_size, M_EST,
+	    M_WAITOK | M_ZERO, 0, ~(vm_paddr_t)0, PAGE_SIZE, 0);
+	if (est_shared_buf == NULL)
+		return (ENOMEM);
+	esh = (struct est_state_header *)est_shared_buf;
+	esh->esh_magic = EST_STATE_MAGIC;
+	esh->esh_version = EST_STATE_VERSION;
+	esh->esh_ncpu = mp_maxid + 1;
+	esh->esh_cpu_offset = 64;
+	esh->esh_cpu_size = sizeof(struct est_state_cpu);
+	return (0);
+}
+
+/*
+ * Publish where ec's domain is now, and if verified is set, that we
+ * just checked.
+ */
+static void
+est_shared_update(struct est_cpu * ec, int verified)
+{
+	struct est_state_cpu * esc;
+	struct est_stats * st;
+	struct est_cpu * m;
+	freq_info * f;
+	uint64_t now;
+	uint32_t seq;
+
+	if (est_shared_buf == NULL)
+		return;
+	mtx_assert(&est_mtx, MA_OWNED);
+	st = &EST_LEADER(ec)->stats;
+	now = est_uptime_us();
+	/* Don't leave readers spinning on an odd esc_seq if preempted. */
+	critical_enter();
+	EST_FOREACH_MEMBER(ec, m) {
+		esc = EST_SHARED_CPU(m->cpu);
+		f = &m->freq_list[st->cur];
+		seq = esc->esc_seq;
+		esc->esc_seq = seq + 1;
+		atomic_thread_fence_rel();
+		if (esc->esc_id != f->ID)
+			esc->esc_since = now;
+		esc->esc_domain = m->leader;
+		esc->esc_mhz = f->MHz;
+		esc->esc_id = f->ID;
+		esc->esc_index = st->cur;
+		esc->esc_nstates = m->nstates;
+		esc->esc_count = st->count;
+		esc->esc_state = EST_LEADER(ec)->state;
+		if (verified)
+			esc->esc_verified = now;
+		atomic_store_rel_32(&esc->esc_seq, seq + 2);
+	}
+	critical_exit();
+}
+
+/*
+ * Mark the entry of cpu as off, once EST has been disabled on it:
+ * est_shared_update() only sees CPUs which still have a freq_list.
+ */
+static void
+est_shared_off(int cpu)
+{
+	struct est_state_cpu * esc;
+	uint32_t seq;
+
+	if (est_shared_buf == NULL)
+		return;
+	mtx_assert(&est_mtx, MA_OWNED);
+	esc = EST_SHARED_CPU(cpu);
+	critical_enter();
+	seq = esc->esc_seq;
+	esc->esc_seq = seq + 1;
+	atomic_thread_fence_rel();
+	esc->esc_since = est_uptime_us();
+	esc->esc_domain = cpu;
+	esc->esc_mhz = 0;
+	esc->esc_id = 0;
+	esc->esc_index = 0;
+	esc->esc_nstates = 0;
+	esc->esc_state = EST_SS_OFF;
+	atomic_store_rel_32(&esc->esc_seq, seq + 2);
+	critical_exit();
+}
+
+static int
+est_shared_open(struct cdev * dev, int oflags, int devtype,
+    struct thread * td)
+{
+
+	return ((oflags & FWRITE) ? EPERM : 0);
+}
+
+static int
+est_shared_mmap(struct cdev * dev, vm_ooffset_t offset, vm_paddr_t * paddr,
+    int nprot, vm_memattr_t * memattr)
+{
+
+	if ((nprot & (PROT_WRITE | PROT_EXEC)) != 0)
+		return (EPERM);
+	if (est_shared_buf == NULL || offset >= est_shared_size)
+		return (EINVAL);
+	*paddr = vtophys(est_shared_buf + offset);
+	est_shared_mapped = 1;
+	return (0);
+}
+
+static struct cdevsw est_shared_cdevsw = {
+	.d_version =	D_VERSION,
+	.d_open =	est_shared_open,
+	.d_mmap =	est_shared_mmap,
+	.d_name =	"est_state",
+};
+
+/*
+ * Return the freq_list entry matching MSR_PERF_STATUS; we must be
+ * running on ec's CPU.  If the CPU reports a setpoint which isn't on
+ * our table, disable EST on its domain and return NULL.
+ */
+static freq_info *
+est_get_state(struct est_cpu * ec)
+{
+	struct est_cpu * m;
+	uint64_t msr;
+	int i;
+
+	mtx_assert(&est_mtx, MA_OWNED);
+
+	msr = est_rdmsr(MSR_PERF_STATUS) & 0xffff;
+	if ((i = est_id_index(ec, msr)) >= 0) {
+		/* Someone else (e.g. the BIOS) may have moved us. */
+		if (i != EST_LEADER(ec)->stats.cur) {
+			est_trace_record(ec, i, -1, EST_TC_EXTERNAL);
+			est_stats_switch(ec, i, -1);
+			est_shared_update(ec, 0);
+			est_tsc_switch(ec, i);
+		}
+		return (&ec->freq_list[i]);
+	}
+
+	printf("cpu%d: MSR_PERF_STATUS reports clock ratio (%d) "
+	    "not in freq_list.  Disabling EST.\n",
+	    ec->cpu, (int)(msr >> 8));
+	EST_LEADER(ec)->state = EST_SS_OFF;
+	EST_FOREACH_MEMBER(ec, m)
+		if (m != ec) {
+			m->freq_list = NULL;
+			est_shared_off(m->cpu);
+		}
+	ec->freq_list = NULL;
+	est_shared_off(ec->cpu);
+	return (NULL);
+}
+
+static int
+est_shared_ticks(void)
+{
+	int t;
+
+	t = (int)((int64_t)est_shared_verify_ms * hz / 1000);
+	return (t > 0 ? t : 1);
+}
+
+/* Check the state page entries of the domain arg against the MSR. */
+static void
+est_shared_tick(void * arg)
+{
+	struct est_cpu * ec;
+	int cur;
+
+	ec = arg;
+	mtx_assert(&est_mtx, MA_OWNED);
+	if (est_shared_verify_ms <= 0 || ec->freq_list == NULL)
+		return;
+	cur = ec->stats.cur;
+	if (est_get_state(ec) == NULL)
+		return;
+	if (ec->stats.cur != cur)
+		est_shared_ncorrected++;
+	est_shared_nverified++;
+	est_shared_update(ec, 1);
+	callout_reset_on(&ec->shared_callout, est_shared_ticks(),
+	    est_shared_tick, ec, ec->cpu);
+}
+
+static void
+est_shared_start(void)
+{
+	struct est_cpu * ec;
+
+	mtx_assert(&est_mtx, MA_OWNED);
+	if (est_shared_verify_ms <= 0)
+		return;
+	EST_FOREACH_LEADER(ec)
+		if (ec->freq_list != NULL)
+			callout_reset_on(&ec->shared_callout,
+			    est_shared_ticks(), est_shared_tick, ec, ec->cpu);
+}
+
+static int
+est_sysctl_shared_verify(SYSCTL_HANDLER_ARGS)
+{
+	int val, old, err;
+
+	val = est_shared_verify_ms;
+	err = sysctl_handle_int(oidp, &val, 0, req);
+	if (err || req->newptr == NULL)
+		return (err);
+
+	mtx_lock(&est_mtx);
+	old = est_shared_verify_ms;
+	est_shared_verify_ms = val;
+	if (val > 0 && old <= 0 && est_cpus != NULL)
+		est_shared_start();
+	mtx_unlock(&est_mtx);
+	return (0);
+}
+
+static SYSCTL_NODE(_hw_est, OID_AUTO, shared, CTLFLAG_RD, 0,
+    "Shared state page (/dev/est_state)");
+SYSCTL_PROC(_hw_est_shared, OID_AUTO, verify_ms, CTLTYPE_INT | CTLFLAG_RWTUN,
+    0, 0, &est_sysctl_shared_verify, "I",
+    "Interval between checks of the page against the MSR (ms, 0: never)");
+SYSCTL_UINT(_hw_est_shared, OID_AUTO, verified, CTLFLAG_RD,
+    &est_shared_nverified, 0, "Checks made");
+SYSCTL_UINT(_hw_est_shared, OID_AUTO, corrected, CTLFLAG_RD,
+    &est_shared_ncorrected, 0,
+    "Checks which found the CPU somewhere else");
+
+/*
+ * Transitions complete in microseconds, so instead of sleeping for a
+ * tick after writing MSR_PERF_CTL we poll MSR_PERF_STATUS until it
+ * reports the new setpoint.  If it hasn't got there within timeout us
+ * we write MSR_PERF_CTL again, up to retries times, and then give up
+ * and stay wherever the CPU ended up.
+ */
+static int est_poll_us = 5;
+static int est_timeout_us = 500;
+static int est_retries = 2;
+static int est_slow_us = 100;
+static u_int est_nslow = 0;
+static u_int est_nretried = 0;
+static u_int est_nfailed = 0;
+
+SYSCTL_INT(_hw_est, OID_AUTO, poll_us, CTLFLAG_RWTUN, &est_poll_us, 0,
+    "Interval between MSR_PERF_STATUS polls during a transition (us)");
+SYSCTL_INT(_hw_est, OID_AUTO, timeout_us, CTLFLAG_RWTUN, &est_timeout_us,
+    0, "Time allowed for a transition before retrying it (us)");
+SYSCTL_INT(_hw_est, OID_AUTO, retries, CTLFLAG_RWTUN, &est_retries, 0,
+    "Times to retry a transition which did not complete");
+SYSCTL_INT(_hw_est, OID_AUTO, slow_us, CTLFLAG_RWTUN, &est_slow_us, 0,
+    "Transitions taking longer than this are counted as slow (us)");
+SYSCTL_UINT(_hw_est, OID_AUTO, slow, CTLFLAG_RD, &est_nslow, 0,
+    "Transitions which took longer than slow_us");
+SYSCTL_UINT(_hw_est, OID_AUTO, retried, CTLFLAG_RD, &est_nretried, 0,
+    "Transitions which had to be retried");
+SYSCTL_UINT(_hw_est, OID_AUTO, failed, CTLFLAG_RD, &est_nfailed, 0,
+    "Transitions which never reached the requested setpoint");
+
+static void
+est_rv_write_ctl(void * arg)
+{
+	uint64_t msr;
+
+	msr = est_rdmsr(MSR_PERF_CTL);
+	msr = (msr & ~(uint64_t)(0xffff)) | *(uint16_t *)arg;
+	est_wrmsr(MSR_PERF_CTL, msr);
+}
+
+/*
+ * Point MSR_PERF_CTL of every CPU in ec's domain at ID16.  A package
+ * runs at the fastest setpoint any of its cores asks for, so writing
+ * only our own would not be enough to slow it down.
+ */
+static void
+est_write_ctl(struct est_cpu * ec, uint16_t ID16)
+{
+	struct est_cpu * m;
+	cpuset_t map;
+	int others;
+
+	CPU_ZERO(&map);
+	others = 0;
+	EST_FOREACH_MEMBER(ec, m) {
+		CPU_SET(m->cpu, &map);
+		if (m != ec)
+			others = 1;
+	}
+	if (others)
+		smp_rendezvous_cpus(map, smp_no_rendezvous_barrier,
+		    est_rv_write_ctl, smp_no_rendezvous_barrier, &ID16);
+	else
+		est_rv_write_ctl(&ID16);
+}
+
+/*
+ * Ask ec's domain to switch to the setpoint described by f, and wait
+ * for it to get there; we must be running on ec's CPU.  Returns
+ * ETIMEDOUT if it never did.  The polling budget counts DELAY()
+ * steps, but the settle time we report is timed with binuptime(), so
+ * that it includes the MSR writes and a first poll which already
+ * finds the CPU there.
+ */
+static int
+est_set_state(struct est_cpu * ec, freq_info * f, int cause)
+{
+	struct bintime start;
+	uint64_t msr;
+	int step, t, tries, i, us;
+
+	mtx_assert(&est_mtx, MA_OWNED);
+
+	EST_LEADER(ec)->state = EST_SS_SWITCHING;
+	est_shared_update(ec, 0);
+	step = est_poll_us > 0 ? est_poll_us : 1;
+	binuptime(&start);
+	for (tries = 0; tries <= est_retries; tries++) {
+		est_write_ctl(ec, f->ID);
+
+		for (t = 0; t <= est_timeout_us; t += step) {
+			if ((est_rdmsr(MSR_PERF_STATUS) & 0xffff) == f->ID) {
+				us = est_us_since(&start);
+				if (tries > 0)
+					est_nretried++;
+				if (us > est_slow_us)
+					est_nslow++;
+				est_trace_record(ec, f - ec->freq_list, us,
+				    cause);
+				est_stats_switch(ec, f - ec->freq_list, us);
+				EST_LEADER(ec)->state = EST_SS_IDLE;
+				est_shared_update(ec, 0);
+				est_tsc_switch(ec, f - ec->freq_list);
+				return (0);
+			}
+			DELAY(step);
+		}
+	}
+
+	/*
+	 * Fall back to whatever setpoint the CPU did settle on, so
+	 * that MSR_PERF_CTL doesn't keep asking for one it can't reach.
+	 */
+	est_nfailed++;
+	EST_LEADER(ec)->state = EST_SS_IDLE;
+	us = est_us_since(&start);
+	msr = est_rdmsr(MSR_PERF_STATUS) & 0xffff;
+	if ((i = est_id_index(ec, msr)) >= 0) {
+		est_write_ctl(ec, msr);
+		est_trace_record(ec, i, us, cause | EST_TC_FAILED);
+		est_stats_switch(ec, i, us);
+		est_tsc_switch(ec, i);
+	}
+	est_shared_update(ec, 0);
+	if (est_verbose)
+		printf("cpu%d: CPU did not reach %d MHz after %d us.\n",
+		    ec->cpu, f->MHz, us);
+	return (ETIMEDOUT);
+}
+
+/*
+ * Limits on what the sysctls and the governor ask for (recorded in the
+ * leader's want): the range of setpoints the active power profile
+ * allows, the minimum frequency requested through /dev/est, in MHz or
+ * 0, and the thermal ceiling of the domain, as the index of the
+ * fastest setpoint allowed.  See the profile, QoS and thermal sections
+ * below.  A QoS request may take us beyond the profile's range, and if
+ * it conflicts with the ceiling, the ceiling wins.
+ */
+static int est_qos_mhz = 0;
+
+static int
+est_clamp(struct est_cpu * ec, int i)
+{
+	int j;
+
+	if (i < ec->prof_fast)
+		i = ec->prof_fast;
+	if (i > ec->prof_slow)
+		i = ec->prof_slow;
+	if (est_qos_mhz != 0 && ec->freq_list[i].MHz < est_qos_mhz) {
+		j = est_mhz_index(ec, est_qos_mhz, EST_ROUND_UP);
+		i = j >= 0 ? j : 0;
+	}
+	if (i < ec->therm_ceil)
+		i = ec->therm_ceil;
+	return (i);
+}
+
+/*
+ * Move ec's domain to what was last asked for, within the current
+ * limits, after they changed.  If nothing was asked for since the
+ * table was installed, start from where we are.  We must be running
+ * on ec's CPU.
+ */
+static int
+est_apply_limits(struct est_cpu * ec, int cause)
+{
+	freq_info * f;
+	int err, i;
+
+	mtx_assert(&est_mtx, MA_OWNED);
+	if (ec->freq_list == NULL)
+		return (EOPNOTSUPP);
+	if ((f = est_get_state(ec)) == NULL)
+		return (EINVAL);
+	i = est_clamp(ec, ec->want >= 0 ? ec->want :
+	    (int)(f - ec->freq_list));
+	if (&ec->freq_list[i] == f)
+		return (0);
+	if ((err = est_tsc_busy()) != 0)
+		return (err);
+	if (est_verbose)
+		printf("cpu%d: limits changed, changing CPU frequency from "
+		    "%d MHz to %d MHz.\n", ec->cpu, f->MHz,
+		    ec->freq_list[i].MHz);
+	return (est_set_state(ec, &ec->freq_list[i], cause));
+}
+
+/*
+ * Common back end of the frequency-setting sysctls: switch the domain
+ * of ec to index i of its table on behalf of userland.  If index is
+ * NULL, i is a frequency in MHz rather than an index; if step is set,
+ * i is relative to the current setpoint, positive meaning faster.
+ * A synchronous request supersedes whatever est_async_run() has yet
+ * to apply; the task itself passes sync = 0 so as not to wipe out a
+ * newer request queued while it runs.  Runs on ec's leader with
+ * est_mtx held.
+ */
+#define	EST_CHANGE_INDEX	0
+#define	EST_CHANGE_MHZ		1
+#define	EST_CHANGE_STEP		2
+
+static int
+est_change_locked(struct est_cpu * ec, int how, int val, int sync)
+{
+	freq_info * f;
+	int i;
+
+	mtx_assert(&est_mtx, MA_OWNED);
+	if (ec->freq_list == NULL)
+		return (EOPNOTSUPP);
+
+	/*
+	 * Check that we can keep the TSC right if it is being used as
+	 * a timecounter.  If not, then return EBUSY and refuse to
+	 * change the clock speed.
+	 */
+	if (est_tsc_busy() != 0)
+		return (EBUSY);
+	if ((f = est_get_state(ec)) == NULL)
+		return (EINVAL);
+
+	switch (how) {
+	case EST_CHANGE_MHZ:
+		i = est_mhz_index(ec, val, est_round);
+		if (i < 0)
+			return (EOPNOTSUPP);
+		break;
+	case EST_CHANGE_STEP:
+		i = (f - ec->freq_list) - val;
+		if (i < 0)
+			i = 0;
+		if (i >= ec->nstates)
+			i = ec->nstates - 1;
+		break;
+	default:
+		i = val;
+		if (i < 0 || i >= ec->nstates)
+			return (EINVAL);
+		break;
+	}
+	ec->want = i;
+	if (sync)
+		ec->async_want = -1;	/* superseded */
+	ec->boot_idx = -1;		/* userland has taken over */
+	i = est_clamp(ec, i);
+	if (&ec->freq_list[i] == f)
+		return (0);
+
+	if (est_verbose)
+		printf("cpu%d: Changing CPU frequency from %d MHz "
+		    "to %d MHz.\n", ec->cpu, f->MHz, ec->freq_list[i].MHz);
+	return (est_set_state(ec, &ec->freq_list[i], EST_TC_USER));
+}
+
+static int
+est_change(struct est_cpu * ec, int how, int val)
+{
+	int err;
+
+	ec = EST_LEADER(ec);
+	est_bind(ec->cpu);
+	mtx_lock(&est_mtx);
+	err = est_change_locked(ec, how, val, 1);
+	mtx_unlock(&est_mtx);
+	est_unbind();
+
+	return (err);
+}
+
+/*
+ * Asynchronous setting.  With hw.est.async set, the frequency sysctls
+ * only check the request and record the resulting index as the
+ * domain's async_want, then queue est_async_task to apply it, so the
+ * writer never waits for the CPU.  Requests which arrive before the
+ * task gets to run replace each other: a control loop writing several
+ * targets in a row only pays for the transition to the last one.
+ *
+ * est_async_requested counts the requests, and est_async_completed
+ * is the count as of the last run of the task that applied all of
+ * them, successfully or not.  A caller which needs to know that its
+ * request has taken effect reads hw.est.async.wait, which sleeps
+ * until everything requested so far is done.
+ */
+static int est_async = 0;
+static u_int est_async_requested = 0;
+static u_int est_async_completed = 0;
+static u_int est_async_ncoalesced = 0;
+static int est_async_error = 0;
+static struct taskqueue * est_tq = NULL;
+static struct task est_async_task;
+
+/* Record a request for ec's domain, as est_change() takes it. */
+static int
+est_change_async(struct est_cpu * ec, int how, int val)
+{
+	int err, i;
+
+	ec = EST_LEADER(ec);
+	mtx_lock(&est_mtx);
+	err = 0;
+	if (ec->freq_list == NULL || est_tq == NULL) {
+		err = EOPNOTSUPP;
+		goto out;
+	}
+	if ((err = est_tsc_busy()) != 0)
+		goto out;
+
+	switch (how) {
+	case EST_CHANGE_MHZ:
+		i = est_mhz_index(ec, val, est_round);
+		if (i < 0)
+			err = EOPNOTSUPP;
+		break;
+	case EST_CHANGE_STEP:
+		i = (ec->async_want >= 0 ? ec->async_want : ec->stats.cur) -
+		    val;
+		if (i < 0)
+			i = 0;
+		if (i >= ec->nstates)
+			i = ec->nstates - 1;
+		break;
+	default:
+		i = val;
+		if (i < 0 || i >= ec->nstates)
+			err = EINVAL;
+		break;
+	}
+	if (err != 0)
+		goto out;
+	if (ec->async_want >= 0)
+		est_async_ncoalesced++;
+	ec->async_want = i;
+	est_async_requested++;
+	taskqueue_enqueue(est_tq, &est_async_task);
+out:
+	mtx_unlock(&est_mtx);
+	return (err);
+}
+
+static void
+est_async_run(void * arg, int pending)
+{
+	struct est_cpu * ec;
+	u_int done;
+	int err, i;
+
+	mtx_lock(&est_mtx);
+	done = est_async_requested;
+	mtx_unlock(&est_mtx);
+
+	/*
+	 * Take each request and apply it without dropping est_mtx, so
+	 * that one queued meanwhile is left for the next run.
+	 */
+	EST_FOREACH_LEADER(ec) {
+		est_bind(ec->cpu);
+		mtx_lock(&est_mtx);
+		i = ec->async_want;
+		ec->async_want = -1;
+		if (i >= 0 && (err = est_change_locked(ec, EST_CHANGE_INDEX,
+		    i, 0)) != 0)
+			est_async_error = err;
+		mtx_unlock(&est_mtx);
+		est_unbind();
+	}
+
+	mtx_lock(&est_mtx);
+	est_async_completed = done;
+	wakeup(&est_async_completed);
+	mtx_unlock(&est_mtx);
+}
+
+/* Set ec's domain from a sysctl: est_change(), or queue it if async. */
+static int
+est_request(struct est_cpu * ec, int how, int val)
+{
+
+	if (est_async)
+		return (est_change_async(ec, how, val));
+	return (est_change(ec, how, val));
+}
+
+/*
+ * Read: wait until every request made so far is done.  Write n: wait
+ * until est_async_completed reaches n.  Either way, return
+ * est_async_completed.
+ */
+static int
+est_sysctl_async_wait(SYSCTL_HANDLER_ARGS)
+{
+	u_int gen;
+	int err;
+
+	if (req->newptr != NULL &&
+	    (err = SYSCTL_IN(req, &gen, sizeof(gen))) != 0)
+		return (err);
+
+	mtx_lock(&est_mtx);
+	if (req->newptr == NULL)
+		gen = est_async_requested;
+	else if ((int)(gen - est_async_requested) > 0) {
+		mtx_unlock(&est_mtx);
+		return (EINVAL);
+	}
+	err = 0;
+	while ((int)(est_async_completed - gen) < 0 && err == 0)
+		err = msleep(&est_async_completed, &est_mtx, PCATCH,
+		    "estasync", 0);
+	gen = est_async_completed;
+	mtx_unlock(&est_mtx);
+	if (err != 0)
+		return (err);
+	return (SYSCTL_OUT(req, &gen, sizeof(gen)));
+}
+
+static SYSCTL_NODE(_hw_est, OID_AUTO, async, CTLFLAG_RD, 0,
+    "Asynchronous frequency setting");
+SYSCTL_INT(_hw_est_async, OID_AUTO, enable, CTLFLAG_RWTUN, &est_async, 0,
+    "Apply frequency writes in the background, keeping only the latest");
+SYSCTL_UINT(_hw_est_async, OID_AUTO, requested, CTLFLAG_RD,
+    &est_async_requested, 0, "Requests made");
+SYSCTL_UINT(_hw_est_async, OID_AUTO, completed, CTLFLAG_RD,
+    &est_async_completed, 0, "Requests applied");
+SYSCTL_UINT(_hw_est_async, OID_AUTO, coalesced, CTLFLAG_RD,
+    &est_async_ncoalesced, 0, "Requests replaced before being applied");
+SYSCTL_INT(_hw_est_async, OID_AUTO, error, CTLFLAG_RW, &est_async_error, 0,
+    "Last error applying a request");
+SYSCTL_PROC(_hw_est_async, OID_AUTO, wait, CTLTYPE_UINT | CTLFLAG_RW, 0, 0,
+    &est_sysctl_async_wait, "IU",
+    "Wait for the requests made so far (or up to the one written)");
+
+/* Apply est_request() to every domain, returning the first error. */
+static int
+est_change_all(int how, int val)
+{
+	struct est_cpu * ec;
+	int err, err1;
+
+	err = EOPNOTSUPP;
+	EST_FOREACH_LEADER(ec) {
+		err1 = est_request(ec, how, val);
+		if (err == EOPNOTSUPP || (err == 0 && err1 != 0))
+			err = err1;
+	}
+	return (err);
+}
+
+/*
+ * Read the current setpoint of ec from the state page, as an index,
+ * or -1 if EST is off on it; if MHz isn't NULL, also return its
+ * frequency there.  This is the same lock-free read as userland's, so
+ * a transition under way shows the setpoint being left, and a change
+ * made behind our back shows up after the next est_shared_tick().
+ */
+static int
+est_current(struct est_cpu * ec, int * MHz)
+{
+	const struct est_state_cpu * esc;
+	uint32_t seq, state, mhz;
+	int i;
+
+	if (est_shared_buf == NULL)
+		return (-1);
+	esc = EST_SHARED_CPU(ec->cpu);
+	for (;;) {
+		seq = atomic_load_acq_32(&esc->esc_seq);
+		if ((seq & 1) != 0) {
+			cpu_spinwait();
+			continue;
+		}
+		state = esc->esc_state;
+		mhz = esc->esc_mhz;
+		i = esc->esc_index;
+		atomic_thread_fence_acq();
+		if (esc->esc_seq == seq)
+			break;
+	}
+	if (state == EST_SS_OFF)
+		return (-1);
+	if (MHz != NULL)
+		*MHz = mhz;
+	return (i);
+}
+
+/*
+ * hw.est_curfreq reports the frequency of CPU 0 and sets that of every
+ * CPU; dev.cpu.N.est_freq (arg1 is the est_cpu) only touches one
+ * domain.
+ */
+static int
+est_sysctl_mhz(SYSCTL_HANDLER_ARGS)
+{
+	struct est_cpu * ec;
+	int MHz, MHz_wanted, i;
+	int err = 0;
+
+	ec = arg1 != NULL ? arg1 : (est_cpus != NULL ? EST_CPU(0) : NULL);
+	if (ec == NULL || (i = est_current(ec, &MHz)) < 0)
+		return (EOPNOTSUPP);
+
+	if (req->newptr) {
+		err = SYSCTL_IN(req, &MHz_wanted, sizeof(int));
+		if (err)
+			return err;
+
+		if (arg1 != NULL)
+			err = est_request(ec, EST_CHANGE_MHZ, MHz_wanted);
+		else
+			err = est_change_all(EST_CHANGE_MHZ, MHz_wanted);
+	} else {
+		err = SYSCTL_OUT(req, &MHz, sizeof(int));
+	}
+
+	return err;
+}
+
+SYSCTL_PROC(_hw, OID_AUTO, est_curfreq, CTLTYPE_INT | CTLFLAG_RW, 0, 0,
+	    &est_sysctl_mhz, "I", "Current CPU frequency for Enhanced SpeedStep");
+
+/*
+ * hw.est.pstate reads and writes the setpoint as an index into
+ * freq_list (0 is the fastest); hw.est.step moves the given number of
+ * entries from the current one, positive meaning faster, stopping at
+ * either end of the table.  Like hw.est_curfreq they read CPU 0 and
+ * write every CPU.
+ */
+static int
+est_sysctl_pstate(SYSCTL_HANDLER_ARGS)
+{
+	int cur, val, err;
+
+	if (est_cpus == NULL || (cur = est_current(EST_CPU(0), NULL)) < 0)
+		return (EOPNOTSUPP);
+
+	val = arg2 ? 0 : cur;
+	err = sysctl_handle_int(oidp, &val, 0, req);
+	if (err || req->newptr == NULL)
+		return (err);
+
+	return (est_change_all(arg2 ? EST_CHANGE_STEP : EST_CHANGE_INDEX,
+	    val));
+}
+
+SYSCTL_PROC(_hw_est, OID_AUTO, pstate, CTLTYPE_INT | CTLFLAG_RW, 0, 0,
+    &est_sysctl_pstate, "I", "Current setpoint, as an index into est_freqs "
+    "from the fastest");
+SYSCTL_PROC(_hw_est, OID_AUTO, step, CTLTYPE_INT | CTLFLAG_RW, 0, 1,
+    &est_sysctl_pstate, "I", "Move this many setpoints faster (negative: "
+    "slower)");
+
+static SYSCTL_NODE(_hw_est, OID_AUTO, stats, CTLFLAG_RD, 0,
+    "Setpoint residency and transition statistics");
+
+/*
+ * Energy estimates.  Dynamic power goes as V^2 f, and every PERF ID
+ * carries the setpoint's voltage in its VID, so the power at each
+ * setpoint relative to the fastest one follows from the table alone;
+ * est_tdp_mw puts a figure on the fastest.  Leakage and the idle
+ * states are ignored, and both omissions flatter the slow setpoints:
+ * leakage goes on for longer when the same work takes longer, and
+ * time left idle after a fast setpoint has raced through the work
+ * costs far less than the full dynamic power charged for it here.
+ * That is still good enough to compare one policy's energy with
+ * another's, as long as the comparison allows for it.
+ * The energy at a setpoint is its power times its residency, so it
+ * is always as current as the residency.
+ */
+static int est_tdp_mw = 21000;
+SYSCTL_INT(_hw_est, OID_AUTO, tdp_mw, CTLFLAG_RWTUN, &est_tdp_mw, 0,
+    "Power at the fastest setpoint, for energy estimates and cpufreq(4) "
+    "(mW)");
+
+/* Power at index i of fl, or -1 if the table makes no sense. */
+static int
+est_power_mw(const freq_info * fl, int i)
+{
+	int64_t p, p0;
+	int mV, mV0;
+
+	mV = EST_VID_MV(fl[i].ID);
+	mV0 = EST_VID_MV(fl[0].ID);
+	p = (int64_t)mV * mV * fl[i].MHz;
+	p0 = (int64_t)mV0 * mV0 * fl[0].MHz;
+	return (p0 > 0 ? (int)(est_tdp_mw * p / p0) : -1);
+}
+
+/* Energy spent at index i of fl, according to st, in uJ. */
+static uint64_t
+est_energy_uj(const struct est_stats * st, const freq_info * fl, int i)
+{
+	int mW;
+
+	mW = est_power_mw(fl, i);
+	return (mW > 0 ? st->residency[i] * mW / 1000 : 0);
+}
+
+/*
+ * Copy the statistics and table of ec's domain, bringing the residency
+ * of the current setpoint up to date.  Returns the number of
+ * setpoints, or 0 if EST is disabled.
+ */
+static int
+est_stats_snapshot(struct est_cpu * ec, struct est_stats * st,
+    freq_info * tab)
+{
+	int n;
+
+	mtx_lock(&est_mtx);
+	ec = EST_LEADER(ec);
+	n = ec->freq_list != NULL ? ec->nstates : 0;
+	if (n != 0) {
+		est_stats_switch(ec, ec->stats.cur, -1);
+		*st = ec->stats;
+		bcopy(ec->freqtab, tab, sizeof(ec->freqtab));
+	}
+	mtx_unlock(&est_mtx);
+	return (n);
+}
+
+/*
+ * arg1 is the est_cpu to report on (CPU 0 if NULL), and arg2 selects
+ * the report: 0 residency per setpoint ("MHz:ms", in the same order as
+ * est_freqs), 1 the from/to transition count matrix, one row per
+ * source setpoint, 2 the transition latency histogram ("<us:count"),
+ * 3 the energy per setpoint ("MHz:mJ"), 4 the power per setpoint
+ * ("MHz:mW") and 5 the work per energy ("MHz:MHz/W").
+ */
+static int
+est_sysctl_stats(SYSCTL_HANDLER_ARGS)
+{
+	struct est_cpu * ec;
+	struct est_stats * st;
+	struct sbuf sb;
+	freq_info fl[EST_MAX_STATES + 1];
+	int n, i, j, err;
+
+	if (est_cpus == NULL)
+		return (EOPNOTSUPP);
+	ec = arg1 != NULL ? arg1 : EST_CPU(0);
+	st = malloc(sizeof(*st), M_TEMP, M_WAITOK);
+	n = est_stats_snapshot(ec, st, fl);
+	sbuf_new_for_sysctl(&sb, NULL, 128, req);
+	switch (arg2) {
+	case 0:
+		for (i = n - 1; i >= 0; i--)
+			sbuf_printf(&sb, "%s%d:%ju", i == n - 1 ? "" : " ",
+			    fl[i].MHz, (uintmax_t)(st->residency[i] / 1000));
+		break;
+	case 1:
+		for (i = n - 1; i >= 0; i--) {
+			sbuf_printf(&sb, "\n%5d:", fl[i].MHz);
+			for (j = n - 1; j >= 0; j--)
+				sbuf_printf(&sb, " %u", st->trans[i][j]);
+		}
+		break;
+	case 2:
+		for (i = 0; n != 0 && i < EST_LAT_BUCKETS; i++)
+			sbuf_printf(&sb, "%s%s%d:%u", i == 0 ? "" : " ",
+			    i == EST_LAT_BUCKETS - 1 ? ">=" : "<",
+			    1 << (i == EST_LAT_BUCKETS - 1 ? i - 1 : i),
+			    st->latency[i]);
+		break;
+	case 3:
+		for (i = n - 1; i >= 0; i--)
+			sbuf_printf(&sb, "%s%d:%ju", i == n - 1 ? "" : " ",
+			    fl[i].MHz, (uintmax_t)(est_energy_uj(st, fl, i) /
+			    1000));
+		break;
+	case 4:
+	case 5:
+		for (i = n - 1; i >= 0; i--) {
+			j = est_power_mw(fl, i);
+			if (arg2 == 5)
+				j = j > 0 ? fl[i].MHz * 1000 / j : 0;
+			sbuf_printf(&sb, "%s%d:%d", i == n - 1 ? "" : " ",
+			    fl[i].MHz, j);
+		}
+		break;
+	}
+	err = sbuf_finish(&sb);
+	sbuf_delete(&sb);
+	free(st, M_TEMP);
+	return (err);
+}
+
+static int
+est_sysctl_stats_count(SYSCTL_HANDLER_ARGS)
+{
+	u_int val;
+
+	val = 0;
+	if (est_cpus != NULL && EST_CPU(0)->freq_list != NULL)
+		val = EST_LEADER(EST_CPU(0))->stats.count;
+	return (sysctl_handle_int(oidp, &val, 0, req));
+}
+
+/*
+ * Energy of CPU 0's domain since the statistics were reset: arg2 0
+ * for the total in mJ, 1 for the mean power in mW.
+ */
+static int
+est_sysctl_stats_energy(SYSCTL_HANDLER_ARGS)
+{
+	struct est_stats * st;
+	freq_info fl[EST_MAX_STATES + 1];
+	uint64_t val, us;
+	int n, i;
+
+	if (est_cpus == NULL)
+		return (EOPNOTSUPP);
+	st = malloc(sizeof(*st), M_TEMP, M_WAITOK);
+	n = est_stats_snapshot(EST_CPU(0), st, fl);
+	val = us = 0;
+	for (i = 0; i < n; i++) {
+		val += est_energy_uj(st, fl, i);
+		us += st->residency[i];
+	}
+	free(st, M_TEMP);
+	if (arg2 == 0)
+		val /= 1000;
+	else
+		val = us > 0 ? val * 1000 / us : 0;
+	return (sysctl_handle_64(oidp, &val, 0, req));
+}
+
+static int
+est_sysctl_stats_reset(SYSCTL_HANDLER_ARGS)
+{
+	struct est_cpu * ec;
+	int val, err;
+
+	val = 0;
+	err = sysctl_handle_int(oidp, &val, 0, req);
+	if (err || req->newptr == NULL || val == 0)
+		return (err);
+
+	mtx_lock(&est_mtx);
+	EST_FOREACH_LEADER(ec) {
+		est_stats_reset(&ec->stats, ec->stats.cur);
+		est_shared_update(ec, 0);
+	}
+	mtx_unlock(&est_mtx);
+	return (0);
+}
+
+SYSCTL_PROC(_hw_est_stats, OID_AUTO, residency,
+    CTLTYPE_STRING | CTLFLAG_RD, 0, 0, &est_sysctl_stats, "A",
+    "Time spent at each frequency (MHz:ms)");
+SYSCTL_PROC(_hw_est_stats, OID_AUTO, transitions,
+    CTLTYPE_STRING | CTLFLAG_RD, 0, 1, &est_sysctl_stats, "A",
+    "Transition counts, one row per source frequency");
+SYSCTL_PROC(_hw_est_stats, OID_AUTO, latency,
+    CTLTYPE_STRING | CTLFLAG_RD, 0, 2, &est_sysctl_stats, "A",
+    "Transition latency histogram (us:count)");
+SYSCTL_PROC(_hw_est_stats, OID_AUTO, energy_levels,
+    CTLTYPE_STRING | CTLFLAG_RD, 0, 3, &est_sysctl_stats, "A",
+    "Estimated energy spent at each frequency (MHz:mJ)");
+SYSCTL_PROC(_hw_est_stats, OID_AUTO, power_levels,
+    CTLTYPE_STRING | CTLFLAG_RD, 0, 4, &est_sysctl_stats, "A",
+    "Estimated power at each frequency (MHz:mW)");
+SYSCTL_PROC(_hw_est_stats, OID_AUTO, efficiency,
+    CTLTYPE_STRING | CTLFLAG_RD, 0, 5, &est_sysctl_stats, "A",
+    "Estimated clock cycles per energy at each frequency (MHz:MHz/W)");
+SYSCTL_PROC(_hw_est_stats, OID_AUTO, energy, CTLTYPE_U64 | CTLFLAG_RD,
+    0, 0, &est_sysctl_stats_energy, "QU", "Estimated energy spent (mJ)");
+SYSCTL_PROC(_hw_est_stats, OID_AUTO, power, CTLTYPE_U64 | CTLFLAG_RD,
+    0, 1, &est_sysctl_stats_energy, "QU", "Estimated mean power (mW)");
+SYSCTL_PROC(_hw_est_stats, OID_AUTO, count, CTLTYPE_UINT | CTLFLAG_RD,
+    0, 0, &est_sysctl_stats_count, "IU", "Number of frequency transitions");
+SYSCTL_PROC(_hw_est_stats, OID_AUTO, reset, CTLTYPE_INT | CTLFLAG_RW, 0, 0,
+    &est_sysctl_stats_reset, "I", "Write 1 to clear the statistics");
+
+/*
+ * Binary forms of the above for monitoring tools, described in
+ * est_PM.h: hw.est.table is the table of CPU 0 with the current
+ * setpoint flagged, and hw.est.snapshot adds the statistics, all
+ * taken under est_mtx in one go.  arg1 is the est_cpu, or NULL for
+ * CPU 0.
+ */
+CTASSERT(EST_MAX_STATES <= EST_ABI_MAXSTATES);
+
+static void
+est_fill_table(struct est_cpu * ec, int cur, struct est_pstate * ep)
+{
+	int i;
+
+	for (i = 0; i < ec->nstates; i++) {
+		ep[i].ep_mhz = ec->freq_list[i].MHz;
+		ep[i].ep_mv = EST_VID_MV(ec->freq_list[i].ID);
+		ep[i].ep_id = ec->freq_list[i].ID;
+		ep[i].ep_flags = (i == cur) ? EST_PS_CURRENT : 0;
+	}
+}
+
+/*
+ * Fill in es for ec; the table and statistics are those of ec's
+ * domain as of now.  Returns 0 or an errno.
+ */
+static int
+est_snapshot_take(struct est_cpu * ec, struct est_snapshot * es)
+{
+	struct est_cpu * l;
+	freq_info * f;
+	int i, err;
+
+	bzero(es, sizeof(*es));
+	es->es_version = EST_ABI_VERSION;
+	es->es_size = sizeof(*es);
+	es->es_cpu = ec->cpu;
+	es->es_domain = ec->leader;
+
+	err = 0;
+	est_bind(ec->cpu);
+	mtx_lock(&est_mtx);
+	if (ec->freq_list == NULL || (f = est_get_state(ec)) == NULL) {
+		err = EOPNOTSUPP;
+		goto out;
+	}
+	l = EST_LEADER(ec);
+	est_stats_switch(ec, l->stats.cur, -1);
+	es->es_nstates = ec->nstates;
+	es->es_cur = f - ec->freq_list;
+	es->es_count = l->stats.count;
+	es->es_slow = est_nslow;
+	es->es_retried = est_nretried;
+	es->es_failed = est_nfailed;
+	es->es_uptime = l->stats.since;
+	bcopy(l->stats.residency, es->es_residency,
+	    sizeof(l->stats.residency));
+	est_fill_table(ec, es->es_cur, es->es_table);
+	for (i = 0; i < ec->nstates; i++) {
+		es->es_power[i] = MAX(est_power_mw(ec->freq_list, i), 0);
+		es->es_energy[i] = est_energy_uj(&l->stats, ec->freq_list, i);
+	}
+out:
+	mtx_unlock(&est_mtx);
+	est_unbind();
+	return (err);
+}
+
+static int
+est_sysctl_table(SYSCTL_HANDLER_ARGS)
+{
+	struct est_snapshot * es;
+	struct est_cpu * ec;
+	int err;
+
+	ec = arg1 != NULL ? arg1 : (est_cpus != NULL ? EST_CPU(0) : NULL);
+	if (ec == NULL)
+		return (EOPNOTSUPP);
+	es = malloc(sizeof(*es), M_TEMP, M_WAITOK);
+	err = est_snapshot_take(ec, es);
+	if (err == 0 && arg2 == 0)
+		err = SYSCTL_OUT(req, es->es_table,
+		    es->es_nstates * sizeof(es->es_table[0]));
+	else if (err == 0)
+		err = SYSCTL_OUT(req, es, sizeof(*es));
+	free(es, M_TEMP);
+	return (err);
+}
+
+SYSCTL_PROC(_hw_est, OID_AUTO, table, CTLTYPE_OPAQUE | CTLFLAG_RD, 0, 0,
+    &est_sysctl_table, "S,est_pstate", "Setpoints (struct est_pstate[])");
+SYSCTL_PROC(_hw_est, OID_AUTO, snapshot, CTLTYPE_OPAQUE | CTLFLAG_RD, 0, 1,
+    &est_sysctl_table, "S,est_snapshot",
+    "Setpoints, current state and statistics (struct est_snapshot)");
+
+/*
+ * Utilization-driven frequency governor.  Every period ms a callout
+ * samples cp_time and picks a setpoint from freq_list: when the CPU
+ * is busier than the up threshold we jump to the fastest setpoint;
+ * once it has been below the down threshold for hysteresis samples
+ * in a row, we drop to the slowest setpoint which would still keep
+ * the same amount of work under the up threshold.  There is one
+ * callout per domain, running on its leader, and the busiest member
+ * decides.
+ */
+struct est_gov_params {
+	int	period;		/* sampling period, ms */
+	int	up;		/* % busy above which we go to full speed */
+	int	down;		/* % busy below which we consider slowing */
+	int	hysteresis;	/* quiet samples needed before slowing */
+};
+
+static struct est_gov_params est_gov = { 100, 80, 30, 3 };
+static int est_gov_enable = 0;
+
+static int
+est_gov_valid(const struct est_gov_params * gp)
+{
+
+	return (gp->period >= 10 && gp->up <= 100 && gp->down >= 0 &&
+	    gp->down < gp->up && gp->hysteresis >= 1);
+}
+
+/*
+ * The most the TSC timecounter could drift, in ppm, if the running
+ * governor moved the (single) domain between its fastest and slowest
+ * setpoints every period; 0 if the governor is off.  Each transition
+ * may be converted at the old rate for up to hw.est.timeout_us.
+ */
+static int
+est_tsc_gov_ppm(void)
+{
+	struct est_cpu * ec;
+	int fast, slow;
+
+	if (!est_gov_enable || est_ndomains != 1)
+		return (0);
+	EST_FOREACH_LEADER(ec)
+		break;
+	if (ec == NULL || ec > &est_cpus[mp_maxid])
+		return (0);
+	fast = ec->freq_list[0].MHz;
+	slow = ec->freq_list[ec->nstates - 1].MHz;
+	return ((int)((int64_t)est_timeout_us * (fast - slow) * 1000 /
+	    ((int64_t)slow * est_gov.period)));
+}
+
+/*
+ * Pick the next setpoint, as an index into tab, given the current
+ * index and the percentage of the last period the CPU was busy.
+ * *quiet counts consecutive samples below the down threshold.
+ */
+static int
+est_gov_select(const struct est_gov_params * gp, const freq_info * tab,
+    int cur, int util, int * quiet)
+{
+	int need;
+
+	if (util >= gp->up) {
+		*quiet = 0;
+		return (0);
+	}
+	if (util >= gp->down) {
+		*quiet = 0;
+		return (cur);
+	}
+	if (++*quiet < gp->hysteresis)
+		return (cur);
+	*quiet = 0;
+
+	/* Work done last period, in MHz, scaled to land under gp->up. */
+	need = tab[cur].MHz * util / gp->up;
+	while (tab[cur + 1].MHz != 0 && tab[cur + 1].MHz >= need)
+		cur++;
+	return (cur);
+}
+
+static int
+est_gov_ticks(void)
+{
+	int t;
+
+	t = (int)((int64_t)est_gov.period * hz / 1000);
+	return (t > 0 ? t : 1);
+}
+
+/* Percentage of the last period the busiest member of ec was busy. */
+static int
+est_gov_util(struct est_cpu * ec)
+{
+	struct est_cpu * m;
+	long cp[CPUSTATES];
+	long total, idle;
+	int util, busiest, i;
+
+	busiest = -1;
+	EST_FOREACH_MEMBER(ec, m) {
+		est_read_cp_time(m->cpu, cp);
+		total = 0;
+		for (i = 0; i < CPUSTATES; i++)
+			total += cp[i] - m->gov_cp_time[i];
+		idle = cp[CP_IDLE] - m->gov_cp_time[CP_IDLE];
+		bcopy(cp, m->gov_cp_time, sizeof(cp));
+		if (total <= 0)
+			continue;
+		util = (int)(100 * (total - idle) / total);
+		if (util > busiest)
+			busiest = util;
+	}
+	return (busiest);
+}
+
+static void
+est_gov_tick(void * arg)
+{
+	struct est_cpu * ec;
+	freq_info * f;
+	int cur, next, util;
+
+	ec = arg;
+	mtx_assert(&est_mtx, MA_OWNED);
+	if (ec->freq_list == NULL || !est_gov_enable)
+		return;
+
+	util = est_gov_util(ec);
+	if (util >= 0 && est_tsc_busy() == 0 &&
+	    (f = est_get_state(ec)) != NULL) {
+		cur = f - ec->freq_list;
+		next = est_gov_select(&est_gov, ec->freq_list, cur, util,
+		    &ec->gov_quiet);
+		ec->want = next;
+		next = est_clamp(ec, next);
+		if (next != cur) {
+			if (est_verbose)
+				printf("cpu%d: EST governor: %d%% busy, "
+				    "changing CPU frequency from %d MHz "
+				    "to %d MHz.\n", ec->cpu, util, f->MHz,
+				    ec->freq_list[next].MHz);
+			(void)est_set_state(ec, &ec->freq_list[next],
+			    EST_TC_GOVERNOR);
+		}
+	}
+
+	if (ec->freq_list != NULL)
+		callout_reset_on(&ec->gov_callout, est_gov_ticks(),
+		    est_gov_tick, ec, ec->cpu);
+}
+
+static void
+est_gov_start(void)
+{
+	struct est_cpu * ec, * m;
+
+	mtx_assert(&est_mtx, MA_OWNED);
+	EST_FOREACH_LEADER(ec) {
+		EST_FOREACH_MEMBER(ec, m)
+			est_read_cp_time(m->cpu, m->gov_cp_time);
+		ec->gov_quiet = 0;
+		callout_reset_on(&ec->gov_callout, est_gov_ticks(),
+		    est_gov_tick, ec, ec->cpu);
+	}
+}
+
+static void
+est_gov_stop(void)
+{
+	struct est_cpu * ec;
+
+	mtx_assert(&est_mtx, MA_OWNED);
+	EST_FOREACH_LEADER(ec)
+		callout_stop(&ec->gov_callout);
+}
+
+static int
+est_sysctl_gov_enable(SYSCTL_HANDLER_ARGS)
+{
+	int val, err;
+
+	val = est_gov_enable;
+	err = sysctl_handle_int(oidp, &val, 0, req);
+	if (err || req->newptr == NULL)
+		return (err);
+
+	mtx_lock(&est_mtx);
+	if (val && !est_gov_enable)
+		est_gov_start();
+	else if (!val && est_gov_enable)
+		est_gov_stop();
+	est_gov_enable = (val != 0);
+	mtx_unlock(&est_mtx);
+
+	return (0);
+}
+
+static int
+est_sysctl_gov_param(SYSCTL_HANDLER_ARGS)
+{
+	struct est_gov_params gp;
+	int * p;
+	int val, err;
+
+	mtx_lock(&est_mtx);
+	gp = est_gov;
+	mtx_unlock(&est_mtx);
+	p = (int *)((char *)&gp + arg2);
+	val = *p;
+	err = sysctl_handle_int(oidp, &val, 0, req);
+	if (err || req->newptr == NULL)
+		return (err);
+
+	*p = val;
+	if (!est_gov_valid(&gp))
+		return (EINVAL);
+
+	mtx_lock(&est_mtx);
+	est_gov = gp;
+	mtx_unlock(&est_mtx);
+
+	return (0);
+}
+
+static SYSCTL_NODE(_hw_est, OID_AUTO, governor, CTLFLAG_RD, 0,
+    "Utilization-driven frequency governor");
+SYSCTL_PROC(_hw_est_governor, OID_AUTO, enable,
+    CTLTYPE_INT | CTLFLAG_RWTUN, 0, 0, &est_sysctl_gov_enable, "I",
+    "Let the governor pick the CPU frequency");
+SYSCTL_PROC(_hw_est_governor, OID_AUTO, period,
+    CTLTYPE_INT | CTLFLAG_RWTUN, 0,
+    offsetof(struct est_gov_params, period), &est_sysctl_gov_param, "I",
+    "Sampling period (ms)");
+SYSCTL_PROC(_hw_est_governor, OID_AUTO, up_threshold,
+    CTLTYPE_INT | CTLFLAG_RWTUN, 0,
+    offsetof(struct est_gov_params, up), &est_sysctl_gov_param, "I",
+    "Utilization (%) above which to run at full speed");
+SYSCTL_PROC(_hw_est_governor, OID_AUTO, down_threshold,
+    CTLTYPE_INT | CTLFLAG_RWTUN, 0,
+    offsetof(struct est_gov_params, down), &est_sysctl_gov_param, "I",
+    "Utilization (%) below which to slow down");
+SYSCTL_PROC(_hw_est_governor, OID_AUTO, hysteresis,
+    CTLTYPE_INT | CTLFLAG_RWTUN, 0,
+    offsetof(struct est_gov_params, hysteresis), &est_sysctl_gov_param, "I",
+    "Samples below the down threshold before slowing down");
+
+/*
+ * Power profiles: a range of setpoints, in MHz, and the governor's
+ * thresholds for each of the kernel's power profiles (power_profile(9);
+ * acpi_acad(4) picks economy on battery and performance on mains).  We
+ * switch on power_profile_change, or to the profile named in
+ * hw.est.profile.override if there is one, in one go under est_mtx:
+ * hw.est.governor.* then show the new profile's thresholds, and each
+ * domain's range is worked out there and then and kept in its leader
+ * (prof_fast and prof_slow) for est_clamp(), before the domains are
+ * moved into it.  The thresholds in est_gov are the active profile's,
+ * and go back into it when we switch away.
+ */
+struct est_profile {
+	const char *	name;
+	int		min_mhz;	/* 0: the slowest setpoint */
+	int		max_mhz;	/* 0: the fastest */
+	struct est_gov_params gov;
+};
+
+#define	EST_PROFILE_PERFORMANCE	0
+#define	EST_PROFILE_ECONOMY	1
+#define	EST_NPROFILES		2
+
+static struct est_profile est_profiles[EST_NPROFILES] = {
+	{ "performance",	0, 0, { 100, 80, 30, 3 } },
+	{ "economy",		0, 0, { 200, 95, 50, 2 } },
+};
+static int est_profile_cur = EST_PROFILE_PERFORMANCE;
+static int est_profile_override = -1;	/* -1: follow power_profile(9) */
+static u_int est_profile_nswitches = 0;
+static eventhandler_tag est_profile_tag = NULL;
+
+/* Work out the range of ec's table the active profile allows. */
+static void
+est_profile_bounds(struct est_cpu * ec)
+{
+	const struct est_profile * p;
+	int i;
+
+	p = &est_profiles[est_profile_cur];
+	ec->prof_fast = 0;
+	ec->prof_slow = ec->nstates - 1;
+	if (p->max_mhz > 0 &&
+	    (i = est_mhz_index(ec, p->max_mhz, EST_ROUND_DOWN)) >= 0)
+		ec->prof_fast = i;
+	if (p->min_mhz > 0 &&
+	    (i = est_mhz_index(ec, p->min_mhz, EST_ROUND_UP)) >= 0)
+		ec->prof_slow = i;
+	if (ec->prof_slow < ec->prof_fast)
+		ec->prof_slow = ec->prof_fast;
+}
+
+/*
+ * Switch to the profile we should be in, or if we are in it already,
+ * apply any change made to it.
+ */
+static void
+est_profile_update(void)
+{
+	struct est_cpu * ec;
+	int i;
+
+	mtx_lock(&est_mtx);
+	if ((i = est_profile_override) < 0)
+		i = power_profile_get_state() == POWER_PROFILE_ECONOMY ?
+		    EST_PROFILE_ECONOMY : EST_PROFILE_PERFORMANCE;
+	if (i != est_profile_cur) {
+		if (est_verbose)
+			printf("EST: switching to the %s profile.\n",
+			    est_profiles[i].name);
+		est_profiles[est_profile_cur].gov = est_gov;
+		est_gov = est_profiles[i].gov;
+		est_profile_cur = i;
+		est_profile_nswitches++;
+	}
+	EST_FOREACH_LEADER(ec) {
+		est_profile_bounds(ec);
+		ec->gov_quiet = 0;
+	}
+	mtx_unlock(&est_mtx);
+
+	EST_FOREACH_LEADER(ec) {
+		est_bind(ec->cpu);
+		mtx_lock(&est_mtx);
+		(void)est_apply_limits(ec, EST_TC_PROFILE);
+		mtx_unlock(&est_mtx);
+		est_unbind();
+	}
+}
+
+static void
+est_profile_event(void * arg)
+{
+
+	if (est_cpus != NULL)
+		est_profile_update();
+}
+
+/* arg1 is the profile, arg2 the offset of the field. */
+static int
+est_sysctl_profile_param(SYSCTL_HANDLER_ARGS)
+{
+	struct est_profile * p, np;
+	int * v;
+	int val, err;
+
+	p = arg1;
+	mtx_lock(&est_mtx);
+	np = *p;
+	if (p == &est_profiles[est_profile_cur])
+		np.gov = est_gov;
+	mtx_unlock(&est_mtx);
+	v = (int *)((char *)&np + arg2);
+	val = *v;
+	err = sysctl_handle_int(oidp, &val, 0, req);
+	if (err || req->newptr == NULL)
+		return (err);
+
+	*v = val;
+	if (np.min_mhz < 0 || np.max_mhz < 0 ||
+	    (np.max_mhz != 0 && np.min_mhz > np.max_mhz) ||
+	    !est_gov_valid(&np.gov))
+		return (EINVAL);
+
+	mtx_lock(&est_mtx);
+	*p = np;
+	if (p == &est_profiles[est_profile_cur])
+		est_gov = np.gov;
+	mtx_unlock(&est_mtx);
+	if (est_cpus != NULL)
+		est_profile_update();
+	return (0);
+}
+
+static int
+est_sysctl_profile_override(SYSCTL_HANDLER_ARGS)
+{
+	char buf[16];
+	int err, i;
+
+	mtx_lock(&est_mtx);
+	strlcpy(buf, est_profile_override >= 0 ?
+	    est_profiles[est_profile_override].name : "", sizeof(buf));
+	mtx_unlock(&est_mtx);
+	err = sysctl_handle_string(oidp, buf, sizeof(buf), req);
+	if (err || req->newptr == NULL)
+		return (err);
+
+	if (buf[0] == '\0')
+		i = -1;
+	else {
+		for (i = 0; i < EST_NPROFILES; i++)
+			if (strcmp(buf, est_profiles[i].name) == 0)
+				break;
+		if (i == EST_NPROFILES)
+			return (EINVAL);
+	}
+	mtx_lock(&est_mtx);
+	est_profile_override = i;
+	mtx_unlock(&est_mtx);
+	if (est_cpus != NULL)
+		est_profile_update();
+	return (0);
+}
+
+static int
+est_sysctl_profile_active(SYSCTL_HANDLER_ARGS)
+{
+	char buf[16];
+
+	mtx_lock(&est_mtx);
+	strlcpy(buf, est_profiles[est_profile_cur].name, sizeof(buf));
+	mtx_unlock(&est_mtx);
+	return (sysctl_handle_string(oidp, buf, sizeof(buf), req));
+}
+
+static SYSCTL_NODE(_hw_est, OID_AUTO, profile, CTLFLAG_RD, 0,
+    "Power profiles");
+SYSCTL_PROC(_hw_est_profile, OID_AUTO, active, CTLTYPE_STRING | CTLFLAG_RD,
+    0, 0, &est_sysctl_profile_active, "A", "Profile in effect");
+SYSCTL_PROC(_hw_est_profile, OID_AUTO, override,
+    CTLTYPE_STRING | CTLFLAG_RWTUN, 0, 0, &est_sysctl_profile_override, "A",
+    "Profile to use regardless of the power source (empty: follow it)");
+SYSCTL_UINT(_hw_est_profile, OID_AUTO, switches, CTLFLAG_RD,
+    &est_profile_nswitches, 0, "Times the profile changed");
+
+#define	EST_PROFILE_SYSCTLS(parent, p)					\
+SYSCTL_PROC(parent, OID_AUTO, min_mhz, CTLTYPE_INT | CTLFLAG_RWTUN,	\
+    (p), offsetof(struct est_profile, min_mhz),				\
+    &est_sysctl_profile_param, "I", "Slowest setpoint allowed (MHz)");	\
+SYSCTL_PROC(parent, OID_AUTO, max_mhz, CTLTYPE_INT | CTLFLAG_RWTUN,	\
+    (p), offsetof(struct est_profile, max_mhz),				\
+    &est_sysctl_profile_param, "I", "Fastest setpoint allowed (MHz)");	\
+SYSCTL_PROC(parent, OID_AUTO, period, CTLTYPE_INT | CTLFLAG_RWTUN,	\
+    (p), offsetof(struct est_profile, gov.period),			\
+    &est_sysctl_profile_param, "I", "Governor sampling period (ms)");	\
+SYSCTL_PROC(parent, OID_AUTO, up_threshold,				\
+    CTLTYPE_INT | CTLFLAG_RWTUN, (p),					\
+    offsetof(struct est_profile, gov.up), &est_sysctl_profile_param,	\
+    "I", "Governor up threshold (%)");					\
+SYSCTL_PROC(parent, OID_AUTO, down_threshold,				\
+    CTLTYPE_INT | CTLFLAG_RWTUN, (p),					\
+    offsetof(struct est_profile, gov.down), &est_sysctl_profile_param,	\
+    "I", "Governor down threshold (%)");				\
+SYSCTL_PROC(parent, OID_AUTO, hysteresis,				\
+    CTLTYPE_INT | CTLFLAG_RWTUN, (p),					\
+    offsetof(struct est_profile, gov.hysteresis),			\
+    &est_sysctl_profile_param, "I", "Governor hysteresis (samples)")
+
+static SYSCTL_NODE(_hw_est_profile, OID_AUTO, performance, CTLFLAG_RD, 0,
+    "Profile on mains power");
+EST_PROFILE_SYSCTLS(_hw_est_profile_performance,
+    &est_profiles[EST_PROFILE_PERFORMANCE]);
+static SYSCTL_NODE(_hw_est_profile, OID_AUTO, economy, CTLFLAG_RD, 0,
+    "Profile on battery power");
+EST_PROFILE_SYSCTLS(_hw_est_profile_economy,
+    &est_profiles[EST_PROFILE_ECONOMY]);
+
+/*
+ * Every check_period seconds, compare how far the TSC timecounter
+ * advances over EST_TSC_WINDOW_MS with how far another timecounter
+ * does (HPET, ACPI-fast or i8254: see est_tsc_ref_find()).  Hardclock
+ * ticks won't do, as with one-shot event timers they are themselves
+ * scheduled by the TSC.  If the two disagree by more than
+ * max_drift_ppm our rescaling has gone wrong (perhaps the TSC doesn't
+ * track the core clock after all): stop the governor, go back to the
+ * setpoint the TSC was calibrated at, restore the calibration, and
+ * stop rescaling, which makes the TSC block frequency changes again.
+ * Without another timecounter there is nothing to check.
+ */
+#define	EST_TSC_WINDOW_MS	10
+
+/*
+ * The best timecounter other than the TSC which can't wrap twice in a
+ * window.  The list runs from the TSC to those registered before it.
+ */
+static struct timecounter *
+est_tsc_ref_find(void)
+{
+	struct timecounter * tc, * best;
+
+	best = NULL;
+	for (tc = timecounter->tc_next; tc != NULL; tc = tc->tc_next) {
+		if (strncmp(tc->tc_name, "TSC", 3) == 0 ||
+		    tc->tc_quality < 0 || tc->tc_frequency == 0 ||
+		    ((uint64_t)tc->tc_counter_mask + 1) * 1000 /
+		    tc->tc_frequency < 4 * EST_TSC_WINDOW_MS)
+			continue;
+		if (best == NULL || tc->tc_quality > best->tc_quality)
+			best = tc;
+	}
+	return (best);
+}
+
+static void
+est_tsc_check(void * arg)
+{
+	struct est_cpu * ec;
+	struct timecounter * ref;
+	struct bintime bt;
+	int64_t up, rf, wrap;
+	u_int count;
+	int t;
+
+	ec = arg;
+	mtx_assert(&est_mtx, MA_OWNED);
+	if (ec->freq_list == NULL)
+		return;
+
+	if (est_tsc_check_period <= 0 || !est_tsc_active() ||
+	    !est_tsc_is_timecounter())
+		est_tsc_sampled = 0;
+	else if (!est_tsc_sampled) {
+		/* Open a window, if there is anything to check against. */
+		if ((est_tsc_ref = est_tsc_ref_find()) != NULL) {
+			binuptime(&est_tsc_bt);
+			est_tsc_ref_count =
+			    est_tsc_ref->tc_get_timecount(est_tsc_ref);
+			est_tsc_sampled = 1;
+			t = hz * EST_TSC_WINDOW_MS / 1000;
+			callout_reset_on(&est_tsc_callout, t > 0 ? t : 1,
+			    est_tsc_check, ec, ec->cpu);
+			return;
+		}
+	} else {
+		ref = est_tsc_ref;
+		binuptime(&bt);
+		count = ref->tc_get_timecount(ref);
+		est_tsc_sampled = 0;
+		up = (bt.sec - est_tsc_bt.sec) * 1000000000 +
+		    (int64_t)(((bt.frac >> 32) * 1000000000) >> 32) -
+		    (int64_t)(((est_tsc_bt.frac >> 32) * 1000000000) >> 32);
+		rf = (int64_t)((count - est_tsc_ref_count) &
+		    ref->tc_counter_mask) * 1000000000 /
+		    (int64_t)ref->tc_frequency;
+		wrap = ((int64_t)ref->tc_counter_mask + 1) * 1000000000 /
+		    (int64_t)ref->tc_frequency;
+		/* If we ran late, ref may have wrapped: try again later. */
+		if (rf > 0 && up < wrap / 2)
+			est_tsc_drift_ppm = (up - rf) * 1000000 / rf;
+		if (rf > 0 && up < wrap / 2 &&
+		    (est_tsc_drift_ppm > est_tsc_max_drift_ppm ||
+		    -est_tsc_drift_ppm > est_tsc_max_drift_ppm)) {
+			printf("EST: TSC timecounter drifted %d ppm from %s; "
+			    "restoring %d MHz and disabling TSC "
+			    "compensation.\n", est_tsc_drift_ppm,
+			    ref->tc_name, est_tsc_mhz);
+			est_tsc_nfallbacks++;
+			if (est_gov_enable)
+				est_gov_stop();
+			est_gov_enable = 0;
+			est_tsc_compensate = 0;
+			ec->want = -1;
+			(void)est_set_state(ec, &ec->freq_list[est_tsc_idx],
+			    EST_TC_TSC);
+			est_tsc_scale(est_tsc_mhz);
+		}
+	}
+
+	callout_reset_on(&est_tsc_callout,
+	    (est_tsc_check_period > 0 ? est_tsc_check_period : 1) * hz,
+	    est_tsc_check, ec, ec->cpu);
+}
+
+/*
+ * Remember the TSC calibration, which was done at the setpoint we
+ * found the CPU at, and start checking it.
+ */
+static void
+est_tsc_start(void)
+{
+	struct est_cpu * ec;
+
+	mtx_assert(&est_mtx, MA_OWNED);
+	est_ndomains = 0;
+	EST_FOREACH_LEADER(ec)
+		est_ndomains++;
+	if (est_ndomains != 1)
+		return;
+
+	EST_FOREACH_LEADER(ec)
+		break;
+	est_tsc_base = tsc_freq;
+	est_tsc_mhz = est_ratio_mhz((ec->load_status >> 8) & 0xff,
+	    ec->busclk);
+	est_tsc_idx = est_mhz_index(ec, est_tsc_mhz, EST_ROUND_NEAREST);
+	if (est_tsc_is_timecounter()) {
+		est_tsc_tc = timecounter;
+		est_tsc_tc_base = est_tsc_tc->tc_frequency;
+	}
+	/* We may have moved since, when synthesizing a table. */
+	if (est_tsc_active())
+		est_tsc_scale(ec->freq_list[ec->stats.cur].MHz);
+	est_tsc_sampled = 0;
+	callout_reset_on(&est_tsc_callout, hz, est_tsc_check, ec, ec->cpu);
+}
+
+/*
+ * Turning compensation back on rescales the TSC for wherever we are
+ * now; changes made while it was off while the TSC wasn't the
+ * timecounter went unaccounted.
+ */
+static int
+est_sysctl_tsc_compensate(SYSCTL_HANDLER_ARGS)
+{
+	struct est_cpu * ec;
+	int val, err;
+
+	val = est_tsc_compensate;
+	err = sysctl_handle_int(oidp, &val, 0, req);
+	if (err || req->newptr == NULL)
+		return (err);
+
+	mtx_lock(&est_mtx);
+	est_tsc_compensate = (val != 0);
+	if (est_tsc_active())
+		EST_FOREACH_LEADER(ec)
+			est_tsc_switch(ec, ec->stats.cur);
+	mtx_unlock(&est_mtx);
+	return (0);
+}
+
+static SYSCTL_NODE(_hw_est, OID_AUTO, tsc, CTLFLAG_RD, 0,
+    "TSC timecounter compensation");
+SYSCTL_PROC(_hw_est_tsc, OID_AUTO, compensate,
+    CTLTYPE_INT | CTLFLAG_RWTUN, 0, 0, &est_sysctl_tsc_compensate, "I",
+    "Rescale the TSC on frequency changes instead of refusing them");
+SYSCTL_INT(_hw_est_tsc, OID_AUTO, check_period, CTLFLAG_RWTUN,
+    &est_tsc_check_period, 0, "Seconds between drift checks (0: never)");
+SYSCTL_INT(_hw_est_tsc, OID_AUTO, max_drift_ppm, CTLFLAG_RWTUN,
+    &est_tsc_max_drift_ppm, 0,
+    "Drift from another timecounter which disables compensation (ppm)");
+SYSCTL_INT(_hw_est_tsc, OID_AUTO, drift_ppm, CTLFLAG_RD,
+    &est_tsc_drift_ppm, 0, "Drift measured by the last check (ppm)");
+static int
+est_sysctl_tsc_gov_ppm(SYSCTL_HANDLER_ARGS)
+{
+	int val;
+
+	mtx_lock(&est_mtx);
+	val = est_tsc_gov_ppm();
+	mtx_unlock(&est_mtx);
+	return (sysctl_handle_int(oidp, &val, 0, req));
+}
+
+SYSCTL_UINT(_hw_est_tsc, OID_AUTO, fallbacks, CTLFLAG_RD,
+    &est_tsc_nfallbacks, 0, "Times the drift check disabled compensation");
+SYSCTL_PROC(_hw_est_tsc, OID_AUTO, gov_drift_ppm,
+    CTLTYPE_INT | CTLFLAG_RD, 0, 0, &est_sysctl_tsc_gov_ppm, "I",
+    "Worst-case drift the running governor could cause (ppm)");
+
+/*
+ * Performance QoS: processes which need a minimum frequency for a
+ * while open /dev/est and ask for it with EST_QOS_SET.  Each open
+ * file holds at most one request; the highest active request becomes
+ * est_qos_mhz, the floor every domain is kept at or above.  Requests
+ * go away when they time out, on EST_QOS_CLEAR, or when the file is
+ * closed, which includes the process exiting.  Expiry is handled by a
+ * callout per domain, so that it runs on the leader and can reach its
+ * MSRs.
+ */
+struct est_qos {
+	LIST_ENTRY(est_qos) link;
+	int		active;
+	int		MHz;
+	int		expires;	/* in ticks, if timeout */
+	int		timeout;
+};
+
+static LIST_HEAD(, est_qos) est_qos_list = LIST_HEAD_INITIALIZER(est_qos_list);
+static int est_qos_nreq = 0;
+static u_int est_qos_nexpired = 0;
+static struct cdev * est_qos_dev = NULL;
+
+/*
+ * Drop expired requests and recompute est_qos_mhz.  Returns the number
+ * of ticks until the next request expires, or 0 if none will.
+ */
+static int
+est_qos_update(void)
+{
+	struct est_qos * q, * tq;
+	int MHz, next, left;
+
+	mtx_assert(&est_mtx, MA_OWNED);
+	MHz = 0;
+	next = 0;
+	LIST_FOREACH_SAFE(q, &est_qos_list, link, tq) {
+		if (q->timeout && (left = q->expires - ticks) <= 0) {
+			LIST_REMOVE(q, link);
+			q->active = 0;
+			est_qos_nreq--;
+			est_qos_nexpired++;
+			continue;
+		}
+		if (q->timeout && (next == 0 || left < next))
+			next = left;
+		if (q->MHz > MHz)
+			MHz = q->MHz;
+	}
+	est_qos_mhz = MHz;
+	return (next);
+}
+
+static void
+est_qos_tick(void * arg)
+{
+	struct est_cpu * ec;
+	int next;
+
+	ec = arg;
+	mtx_assert(&est_mtx, MA_OWNED);
+	if (ec->freq_list == NULL)
+		return;
+	next = est_qos_update();
+	(void)est_apply_limits(ec, EST_TC_QOS);
+	if (next > 0)
+		callout_reset_on(&ec->qos_callout, next, est_qos_tick, ec,
+		    ec->cpu);
+}
+
+/*
+ * Recompute the floor after a request came or went, apply it to every
+ * domain and rearm the expiry callouts.  Returns the first error.
+ */
+static int
+est_qos_changed(void)
+{
+	struct est_cpu * ec;
+	int err, err1, next;
+
+	err = 0;
+	EST_FOREACH_LEADER(ec) {
+		est_bind(ec->cpu);
+		mtx_lock(&est_mtx);
+		next = est_qos_update();
+		err1 = est_apply_limits(ec, EST_TC_QOS);
+		if (next > 0)
+			callout_reset_on(&ec->qos_callout, next, est_qos_tick,
+			    ec, ec->cpu);
+		else
+			callout_stop(&ec->qos_callout);
+		mtx_unlock(&est_mtx);
+		est_unbind();
+		if (err == 0)
+			err = err1;
+	}
+	return (err);
+}
+
+/* Release the request of a file being closed. */
+static void
+est_qos_dtor(void * data)
+{
+	struct est_qos * q;
+	int active;
+
+	q = data;
+	mtx_lock(&est_mtx);
+	if ((active = q->active) != 0) {
+		LIST_REMOVE(q, link);
+		q->active = 0;
+		est_qos_nreq--;
+	}
+	mtx_unlock(&est_mtx);
+	free(q, M_EST);
+	if (active && est_cpus != NULL)
+		(void)est_qos_changed();
+}
+
+static int
+est_qos_open(struct cdev * dev, int oflags, int devtype, struct thread * td)
+{
+	struct est_qos * q;
+	int err;
+
+	q = malloc(sizeof(*q), M_EST, M_WAITOK | M_ZERO);
+	if ((err = devfs_set_cdevpriv(q, est_qos_dtor)) != 0)
+		free(q, M_EST);
+	return (err);
+}
+
+static int
+est_qos_ioctl(struct cdev * dev, u_long cmd, caddr_t data, int fflag,
+    struct thread * td)
+{
+	struct est_qos_request * eq;
+	struct est_qos * q;
+	int err;
+
+	if ((err = devfs_get_cdevpriv((void **)&q)) != 0)
+		return (err);
+	if ((fflag & FWRITE) == 0)
+		return (EBADF);
+
+	mtx_lock(&est_mtx);
+	switch (cmd) {
+	case EST_QOS_SET:
+		eq = (struct est_qos_request *)data;
+		if (eq->eq_mhz == 0 || eq->eq_mhz > 0xffff ||
+		    eq->eq_ms > 24 * 3600 * 1000) {
+			err = EINVAL;
+			break;
+		}
+		q->MHz = eq->eq_mhz;
+		q->timeout = eq->eq_ms != 0;
+		q->expires = ticks +
+		    MAX((int)((int64_t)eq->eq_ms * hz / 1000), 1);
+		if (!q->active) {
+			LIST_INSERT_HEAD(&est_qos_list, q, link);
+			q->active = 1;
+			est_qos_nreq++;
+		}
+		break;
+	case EST_QOS_CLEAR:
+		if (q->active) {
+			LIST_REMOVE(q, link);
+			q->active = 0;
+			est_qos_nreq--;
+		}
+		break;
+	default:
+		err = ENOTTY;
+		break;
+	}
+	mtx_unlock(&est_mtx);
+
+	if (err == 0)
+		err = est_qos_changed();
+	return (err);
+}
+
+static struct cdevsw est_qos_cdevsw = {
+	.d_version =	D_VERSION,
+	.d_open =	est_qos_open,
+	.d_ioctl =	est_qos_ioctl,
+	.d_name =	"est",
+};
+
+static SYSCTL_NODE(_hw_est, OID_AUTO, qos, CTLFLAG_RD, 0,
+    "Minimum frequency requests from /dev/est");
+SYSCTL_INT(_hw_est_qos, OID_AUTO, min_mhz, CTLFLAG_RD, &est_qos_mhz, 0,
+    "Highest active request (MHz, 0: none)");
+SYSCTL_INT(_hw_est_qos, OID_AUTO, requests, CTLFLAG_RD, &est_qos_nreq, 0,
+    "Active requests");
+SYSCTL_UINT(_hw_est_qos, OID_AUTO, expired, CTLFLAG_RD, &est_qos_nexpired,
+    0, "Requests which timed out");
+
+/*
+ * Thermal-aware stepping.  When the die gets too hot, the thermal
+ * monitor (TM1/TM2) duty-cycles the clock or forces the lowest
+ * setpoint, which costs far more than dropping one EST step would.
+ * Every period ms a callout on each domain's leader reads
+ * IA32_THERM_STATUS.  If the monitor is engaged, or engaged since we
+ * last looked (the log bit, which we then clear), or if the digital
+ * sensor of later parts reports fewer than margin degrees to go, we
+ * lower the domain's ceiling to one setpoint below where it is.
+ * Once hysteresis samples in a row have been cool, the ceiling goes
+ * back up one setpoint.  Cores of a package share the die, so the
+ * leader's sensor speaks for the domain.  We poll rather than take
+ * the thermal interrupt enabled by IA32_THERM_INTERRUPT, whose LVT
+ * entry belongs to the local APIC code.  Without a digital sensor, as
+ * on the Pentium M, the first sign we get is the monitor having
+ * engaged: we keep it from engaging again, but can't head off the
+ * first time, and the interrupt would tell us no sooner, as it fires
+ * on the same sensor's trip points.  It is off unless
+ * hw.est.thermal.enable is set, since it overrides what the user and
+ * the governor ask for.
+ */
+#ifndef MSR_THERM_INTERRUPT
+#define	MSR_THERM_INTERRUPT	0x19b
+#endif
+#ifndef MSR_THERM_STATUS
+#define	MSR_THERM_STATUS	0x19c
+#endif
+#define	EST_THERM_TM		0x00000001	/* monitor engaged */
+#define	EST_THERM_LOG		0x00000002	/* engaged since cleared */
+#define	EST_THERM_READING(st)	(((st) >> 16) & 0x7f)	/* below TjMax */
+#define	EST_THERM_VALID		0x80000000	/* reading is valid */
+
+static int est_therm_supported = 0;
+static int est_therm_enable = 0;
+static int est_therm_period = 250;
+static int est_therm_hysteresis = 8;
+static int est_therm_margin = 5;
+static u_int est_therm_nthrottled = 0;
+static u_int est_therm_nstepdowns = 0;
+
+static int
+est_therm_ticks(void)
+{
+	int t;
+
+	t = (int)((int64_t)est_therm_period * hz / 1000);
+	return (t > 0 ? t : 1);
+}
+
+static void
+est_therm_tick(void * arg)
+{
+	struct est_cpu * ec;
+	freq_info * f;
+	uint64_t st;
+	int hot, cool, cur;
+
+	ec = arg;
+	mtx_assert(&est_mtx, MA_OWNED);
+	if (ec->freq_list == NULL || !est_therm_enable)
+		return;
+
+	st = est_rdmsr(MSR_THERM_STATUS);
+	hot = cool = 0;
+	if (st & (EST_THERM_TM | EST_THERM_LOG)) {
+		est_therm_nthrottled++;
+		if (st & EST_THERM_LOG)
+			est_wrmsr(MSR_THERM_STATUS, st & ~EST_THERM_LOG);
+		hot = 1;
+	} else if ((st & EST_THERM_VALID) == 0)
+		cool = 1;
+	else if (EST_THERM_READING(st) <= est_therm_margin)
+		hot = 1;
+	else if (EST_THERM_READING(st) >= 2 * est_therm_margin)
+		cool = 1;
+
+	if (hot) {
+		ec->therm_cool = 0;
+		if ((f = est_get_state(ec)) != NULL) {
+			cur = f - ec->freq_list;
+			if (ec->want < 0)
+				ec->want = cur;
+			if (cur < ec->therm_ceil)
+				cur = ec->therm_ceil;
+			if (cur + 1 < ec->nstates) {
+				ec->therm_ceil = cur + 1;
+				est_therm_nstepdowns++;
+				if (est_verbose)
+					printf("cpu%d: too hot, limiting CPU "
+					    "frequency to %d MHz.\n", ec->cpu,
+					    ec->freq_list[cur + 1].MHz);
+				(void)est_apply_limits(ec, EST_TC_THERMAL);
+			}
+		}
+	} else if (cool && ec->therm_ceil > 0) {
+		if (++ec->therm_cool >= est_therm_hysteresis) {
+			ec->therm_cool = 0;
+			ec->therm_ceil--;
+			(void)est_apply_limits(ec, EST_TC_THERMAL);
+		}
+	} else
+		ec->therm_cool = 0;
+
+	callout_reset_on(&ec->therm_callout, est_therm_ticks(),
+	    est_therm_tick, ec, ec->cpu);
+}
+
+static void
+est_therm_start(void)
+{
+	struct est_cpu * ec;
+
+	mtx_assert(&est_mtx, MA_OWNED);
+	if (!est_therm_supported)
+		return;
+	EST_FOREACH_LEADER(ec) {
+		ec->therm_cool = 0;
+		callout_reset_on(&ec->therm_callout, est_therm_ticks(),
+		    est_therm_tick, ec, ec->cpu);
+	}
+}
+
+/* Turning the thermal check off lifts the ceilings. */
+static int
+est_sysctl_therm_enable(SYSCTL_HANDLER_ARGS)
+{
+	struct est_cpu * ec;
+	int val, err;
+
+	val = est_therm_enable;
+	err = sysctl_handle_int(oidp, &val, 0, req);
+	if (err || req->newptr == NULL)
+		return (err);
+
+	mtx_lock(&est_mtx);
+	if (val && !est_therm_enable)
+		est_therm_start();
+	est_therm_enable = (val != 0);
+	mtx_unlock(&est_mtx);
+	if (val)
+		return (0);
+
+	EST_FOREACH_LEADER(ec) {
+		est_bind(ec->cpu);
+		mtx_lock(&est_mtx);
+		callout_stop(&ec->therm_callout);
+		if (ec->therm_ceil != 0) {
+			ec->therm_ceil = 0;
+			(void)est_apply_limits(ec, EST_TC_THERMAL);
+		}
+		mtx_unlock(&est_mtx);
+		est_unbind();
+	}
+	return (0);
+}
+
+/* The ceiling of CPU 0's domain, in MHz. */
+static int
+est_sysctl_therm_ceiling(SYSCTL_HANDLER_ARGS)
+{
+	struct est_cpu * ec;
+	int MHz;
+
+	MHz = 0;
+	mtx_lock(&est_mtx);
+	if (est_cpus != NULL) {
+		ec = EST_LEADER(EST_CPU(0));
+		if (ec->freq_list != NULL)
+			MHz = ec->freq_list[ec->therm_ceil].MHz;
+	}
+	mtx_unlock(&est_mtx);
+	return (sysctl_handle_int(oidp, &MHz, 0, req));
+}
+
+static SYSCTL_NODE(_hw_est, OID_AUTO, thermal, CTLFLAG_RD, 0,
+    "Stepping down before the thermal monitor throttles (without a "
+    "digital sensor, as on the Pentium M: once it has throttled)");
+SYSCTL_PROC(_hw_est_thermal, OID_AUTO, enable, CTLTYPE_INT | CTLFLAG_RWTUN,
+    0, 0, &est_sysctl_therm_enable, "I",
+    "Lower the frequency when the CPU gets too hot");
+SYSCTL_INT(_hw_est_thermal, OID_AUTO, period, CTLFLAG_RWTUN,
+    &est_therm_period, 0, "Sampling period (ms)");
+SYSCTL_INT(_hw_est_thermal, OID_AUTO, hysteresis, CTLFLAG_RWTUN,
+    &est_therm_hysteresis, 0, "Cool samples before stepping back up");
+SYSCTL_INT(_hw_est_thermal, OID_AUTO, margin, CTLFLAG_RWTUN,
+    &est_therm_margin, 0,
+    "Degrees below TjMax at which to step down, if there is a sensor");
+SYSCTL_PROC(_hw_est_thermal, OID_AUTO, ceiling, CTLTYPE_INT | CTLFLAG_RD,
+    0, 0, &est_sysctl_therm_ceiling, "I",
+    "Highest frequency currently allowed on CPU 0 (MHz)");
+SYSCTL_UINT(_hw_est_thermal, OID_AUTO, throttled, CTLFLAG_RD,
+    &est_therm_nthrottled, 0,
+    "Samples which found the thermal monitor had throttled the CPU");
+SYSCTL_UINT(_hw_est_thermal, OID_AUTO, stepdowns, CTLFLAG_RD,
+    &est_therm_nstepdowns, 0, "Times the ceiling was lowered");
+SYSCTL_INT(_hw_est_thermal, OID_AUTO, supported, CTLFLAG_RD,
+    &est_therm_supported, 0, "The processor has a thermal monitor");
+
+/*
+ * Load-time calibration, for boards where the table doesn't match
+ * what the CPU delivers.  With hw.est.calib.enable set in loader.conf,
+ * each domain is moved through every setpoint in turn and spins in
+ * a fixed loop for hw.est.calib.ms, timed against the timecounter.
+ * The Pentium M TSC counts core clocks, so the TSC over that interval
+ * gives the clock the setpoint really runs at, and the loop count the
+ * work it gets done, which on-demand clock modulation can cut without
+ * the TSC noticing.  A setpoint is flagged if its clock is more than
+ * hw.est.calib.tolerance percent off the table, or if it does that
+ * much less work per clock than the best setpoint.  Pointless if the
+ * TSC is the timecounter, so we don't try then.
+ */
+#define	EST_CAL_CHUNK	10000		/* loop iterations between looks */
+
+static int est_calib_enable = 0;
+static int est_calib_ms = 20;
+static int est_calib_tolerance = 3;
+static u_int est_calib_nflagged = 0;
+
+#ifndef EST_SIM
+static uint64_t
+est_calib_ns(void)
+{
+	struct bintime bt;
+
+	binuptime(&bt);
+	return ((uint64_t)bt.sec * 1000000000 +
+	    (((bt.frac >> 32) * 1000000000) >> 32));
+}
+
+/* The volatile makes every iteration a load and a store. */
+static void
+est_calib_spin(u_int n)
+{
+	volatile u_int i;
+
+	critical_enter();
+	for (i = 0; i < n; i++)
+		;
+	critical_exit();
+}
+#endif
+
+/*
+ * Measure every setpoint of ec's domain, then put it back where it
+ * was.  Returns the number of setpoints flagged, or -1 if we couldn't
+ * get through them all.
+ */
+static int
+est_calibrate(struct est_cpu * ec)
+{
+	struct est_calib * c;
+	freq_info * f;
+	uint64_t t0, t1, t2, tsc0, tsc1, n, cpc, best;
+	int i, cur, err, nflagged;
+
+	est_bind(ec->cpu);
+	mtx_lock(&est_mtx);
+	cur = (f = est_get_state(ec)) != NULL ? f - ec->freq_list : -1;
+	mtx_unlock(&est_mtx);
+	err = cur < 0 ? EINVAL : 0;
+	ec->calibrated = 0;
+
+	for (i = 0; i < ec->nstates && err == 0; i++) {
+		c = &ec->calib[i];
+		mtx_lock(&est_mtx);
+		t0 = est_calib_ns();
+		err = est_set_state(ec, &ec->freq_list[i], EST_TC_CALIBRATE);
+		t1 = est_calib_ns();
+		mtx_unlock(&est_mtx);
+		if (err != 0)
+			break;
+
+		tsc0 = est_rdtsc();
+		n = 0;
+		do {
+			est_calib_spin(EST_CAL_CHUNK);
+			n += EST_CAL_CHUNK;
+			t2 = est_calib_ns();
+		} while (t2 - t1 < (uint64_t)MAX(est_calib_ms, 1) * 1000000);
+		tsc1 = est_rdtsc();
+
+		c->trans_us = (t1 - t0) / 1000;
+		c->mhz = (tsc1 - tsc0) * 1000 / (t2 - t1);
+		c->rate = n * 1000000 / (t2 - t1);
+	}
+
+	nflagged = 0;
+	if (err == 0) {
+		best = 0;
+		for (i = 0; i < ec->nstates; i++)
+			if (ec->calib[i].mhz > 0)
+				best = MAX(best, (uint64_t)ec->calib[i].rate *
+				    1000 / ec->calib[i].mhz);
+		for (i = 0; i < ec->nstates; i++) {
+			c = &ec->calib[i];
+			c->flags = 0;
+			if ((uint64_t)abs((int)c->mhz - ec->freq_list[i].MHz) *
+			    100 > (uint64_t)est_calib_tolerance *
+			    ec->freq_list[i].MHz)
+				c->flags |= EST_CAL_MHZ;
+			cpc = c->mhz > 0 ? (uint64_t)c->rate * 1000 / c->mhz : 0;
+			if (cpc * 100 < best * (100 - est_calib_tolerance))
+				c->flags |= EST_CAL_RATE;
+			if (c->flags != 0)
+				nflagged++;
+		}
+		ec->calibrated = 1;
+	}
+
+	mtx_lock(&est_mtx);
+	if (cur >= 0) {
+		(void)est_set_state(ec, &ec->freq_list[cur], EST_TC_CALIBRATE);
+		est_stats_reset(&ec->stats, ec->stats.cur);
+		est_shared_update(ec, 0);
+	}
+	mtx_unlock(&est_mtx);
+	est_unbind();
+	return (err == 0 ? nflagged : -1);
+}
+
+static void
+est_calibrate_all(void)
+{
+	struct est_cpu * ec;
+	struct est_calib * c;
+	int i;
+
+	if (est_tsc_is_timecounter()) {
+		printf("EST: not calibrating, the TSC is the timecounter.\n");
+		return;
+	}
+	EST_FOREACH_LEADER(ec) {
+		if (ec->freq_list == NULL)
+			continue;
+		if (est_calibrate(ec) < 0) {
+			printf("cpu%d: calibration failed.\n", ec->cpu);
+			continue;
+		}
+		for (i = 0; i < ec->nstates; i++) {
+			c = &ec->calib[i];
+			if (c->flags == 0)
+				continue;
+			est_calib_nflagged++;
+			printf("cpu%d: %d MHz setpoint runs at %u MHz%s.\n",
+			    ec->cpu, ec->freq_list[i].MHz, c->mhz,
+			    (c->flags & EST_CAL_RATE) ? ", and slower than "
+			    "its clock" : "");
+		}
+	}
+}
+
+/* The results for arg1 (CPU 0 if NULL), one row per setpoint. */
+static int
+est_sysctl_calib(SYSCTL_HANDLER_ARGS)
+{
+	struct est_cpu * ec;
+	struct est_calib * c;
+	struct sbuf sb;
+	int i, err;
+
+	if (est_cpus == NULL)
+		return (EOPNOTSUPP);
+	ec = EST_LEADER(arg1 != NULL ? (struct est_cpu *)arg1 : EST_CPU(0));
+	sbuf_new_for_sysctl(&sb, NULL, 128, req);
+	mtx_lock(&est_mtx);
+	for (i = ec->nstates - 1; ec->calibrated && i >= 0; i--) {
+		c = &ec->calib[i];
+		sbuf_printf(&sb, "\n%5d: %5u MHz %8u/ms %5u us%s%s",
+		    ec->freq_list[i].MHz, c->mhz, c->rate, c->trans_us,
+		    (c->flags & EST_CAL_MHZ) ? " clock" : "",
+		    (c->flags & EST_CAL_RATE) ? " throughput" : "");
+	}
+	mtx_unlock(&est_mtx);
+	err = sbuf_finish(&sb);
+	sbuf_delete(&sb);
+	return (err);
+}
+
+static SYSCTL_NODE(_hw_est, OID_AUTO, calib, CTLFLAG_RD, 0,
+    "Load-time setpoint calibration");
+SYSCTL_INT(_hw_est_calib, OID_AUTO, enable, CTLFLAG_RDTUN,
+    &est_calib_enable, 0, "Measure every setpoint at load time");
+SYSCTL_INT(_hw_est_calib, OID_AUTO, ms, CTLFLAG_RDTUN, &est_calib_ms, 0,
+    "Time spent measuring each setpoint (ms)");
+SYSCTL_INT(_hw_est_calib, OID_AUTO, tolerance, CTLFLAG_RDTUN,
+    &est_calib_tolerance, 0, "Deviation to flag (percent)");
+SYSCTL_UINT(_hw_est_calib, OID_AUTO, flagged, CTLFLAG_RD,
+    &est_calib_nflagged, 0, "Setpoints which didn't measure up");
+SYSCTL_PROC(_hw_est_calib, OID_AUTO, results, CTLTYPE_STRING | CTLFLAG_RD,
+    0, 0, &est_sysctl_calib, "A",
+    "Measured clock, loop rate and switching time of each setpoint");
+
+#ifdef EST_SIM
+/*
+ * Simulated processors, for exercising the driver and the governor on
+ * machines without a Pentium M.  hw.est.sim.cpu picks the model from
+ * est_procs, and every hw.est.sim.cores consecutive CPUs form a
+ * package.  Like the real thing, a package runs at the fastest
+ * setpoint any of its cores asks for; a change shows up in
+ * MSR_PERF_STATUS after hw.est.sim.settle reads of it (never, if
+ * negative).  The load is a fixed amount of work per second on each
+ * CPU (hw.est.sim.demand, in MHz), so utilization goes up as the
+ * simulated clock goes down.  The bus clock is that of the model;
+ * hw.est.sim.fsb reports it in MSR_FSB_FREQ as well.
+ *
+ * If hw.est.sim.heat is set, each package also has a temperature,
+ * which approaches ambient plus heat degrees times the power drawn
+ * (V^2 f, relative to the fastest setpoint) with a time constant of
+ * one second.  At tjmax the thermal monitor engages, halving both
+ * the power and the work done, as TM1 would.  hw.est.sim.dts adds a
+ * digital sensor reading to IA32_THERM_STATUS, which the Pentium M
+ * lacks.
+ */
+static int est_sim_cpu = 0;
+static int est_sim_cores = 1;
+static int est_sim_demand = 500;
+static int est_sim_settle = 0;
+static u_int est_sim_id = 0;
+static int est_sim_reject = 0;
+static uint16_t est_sim_ctl[MAXCPU];
+static uint16_t est_sim_status[MAXCPU];		/* per package */
+static int est_sim_pending[MAXCPU];		/* per package */
+static long est_sim_cp[MAXCPU][CPUSTATES];
+static int est_sim_heat = 0;
+static int est_sim_ambient = 45;
+static int est_sim_tjmax = 100;
+static int est_sim_dts = 0;
+static int est_sim_temp[MAXCPU];		/* per package, m°C */
+static int est_sim_temp_ticks[MAXCPU];
+static int est_sim_tm_log[MAXCPU];
+static int est_sim_misratio = 0;
+static int est_sim_fsb = 0;
+static int est_sim_busclk = 0;
+static uint64_t est_sim_tsc[MAXCPU];
+static uint64_t est_sim_ns = 0;
+
+static SYSCTL_NODE(_hw_est, OID_AUTO, sim, CTLFLAG_RD, 0,
+    "Simulated processor");
+SYSCTL_INT(_hw_est_sim, OID_AUTO, cpu, CTLFLAG_RDTUN, &est_sim_cpu, 0,
+    "Index of the simulated model in est_procs");
+SYSCTL_INT(_hw_est_sim, OID_AUTO, cores, CTLFLAG_RDTUN, &est_sim_cores, 0,
+    "Cores per simulated package");
+SYSCTL_INT(_hw_est_sim, OID_AUTO, demand, CTLFLAG_RWTUN, &est_sim_demand,
+    0, "Simulated load (MHz worth of work)");
+SYSCTL_INT(_hw_est_sim, OID_AUTO, settle, CTLFLAG_RWTUN, &est_sim_settle,
+    0, "MSR_PERF_STATUS reads before a transition completes");
+SYSCTL_UINT(_hw_est_sim, OID_AUTO, id, CTLFLAG_RDTUN, &est_sim_id, 0,
+    "MSR_PERF_STATUS[63:32] to report instead of the model's");
+SYSCTL_INT(_hw_est_sim, OID_AUTO, reject, CTLFLAG_RWTUN, &est_sim_reject,
+    0, "Bus ratio the simulated processor refuses to run at");
+SYSCTL_INT(_hw_est_sim, OID_AUTO, heat, CTLFLAG_RWTUN, &est_sim_heat, 0,
+    "Temperature rise at full power (degrees C, 0: no thermal model)");
+SYSCTL_INT(_hw_est_sim, OID_AUTO, ambient, CTLFLAG_RWTUN, &est_sim_ambient,
+    0, "Ambient temperature (degrees C)");
+SYSCTL_INT(_hw_est_sim, OID_AUTO, tjmax, CTLFLAG_RWTUN, &est_sim_tjmax, 0,
+    "Temperature at which the thermal monitor engages (degrees C)");
+SYSCTL_INT(_hw_est_sim, OID_AUTO, dts, CTLFLAG_RWTUN, &est_sim_dts, 0,
+    "Report a digital thermal sensor reading");
+SYSCTL_INT(_hw_est_sim, OID_AUTO, misratio, CTLFLAG_RWTUN,
+    &est_sim_misratio, 0, "Bus ratio which really runs one ratio lower");
+SYSCTL_INT(_hw_est_sim, OID_AUTO, fsb, CTLFLAG_RDTUN, &est_sim_fsb, 0,
+    "Report the bus clock in MSR_FSB_FREQ, as a Core Solo/Duo would");
+SYSCTL_INT(_hw_est_sim, OID_AUTO, busclk, CTLFLAG_RDTUN, &est_sim_busclk,
+    0, "Bus clock to run the model on (MHz, 0: the model's own)");
+
+/* What we report in MSR_PERF_STATUS[63:32]. */
+#define	EST_SIM_ID()							\
+	(est_sim_id != 0 ? est_sim_id : est_procs[est_sim_cpu].ID)
+
+/* The bus the simulated processor sits on. */
+#define	EST_SIM_BUSCLK()						\
+	(est_sim_busclk != 0 ? est_sim_busclk : est_procs[est_sim_cpu].BUSCLK)
+
+#define	EST_SIM_PKG(cpu)	((cpu) / est_sim_cores * est_sim_cores)
+
+static void
+est_sim_init(void)
+{
+	int i;
+
+	if (est_sim_cpu < 0 || est_sim_cpu >= EST_NPROCS)
+		est_sim_cpu = 0;
+	if (est_sim_cores < 1)
+		est_sim_cores = 1;
+	for (i = 0; i < MAXCPU; i++) {
+		est_sim_ctl[i] = EST_SIM_ID() & 0xffff;
+		est_sim_status[i] = est_sim_ctl[i];
+		est_sim_pending[i] = 0;
+		est_sim_temp[i] = est_sim_ambient * 1000;
+		est_sim_temp_ticks[i] = ticks;
+		est_sim_tm_log[i] = 0;
+	}
+
+	/* The TSC was calibrated at the setpoint we start at. */
+	tsc_freq = (uint64_t)est_ratio_mhz(est_sim_ctl[0] >> 8,
+	    EST_SIM_BUSCLK()) * 1000000;
+}
+
+/* The package setpoint: the fastest any of its cores asks for. */
+static uint16_t
+est_sim_resolve(int pkg)
+{
+	uint16_t ID16;
+	int i;
+
+	ID16 = est_sim_ctl[pkg];
+	for (i = pkg; i < pkg + est_sim_cores && i < MAXCPU; i++)
+		if ((est_sim_ctl[i] >> 8) > (ID16 >> 8))
+			ID16 = est_sim_ctl[i];
+	return (ID16);
+}
+
+#define	EST_SIM_HOT(pkg)	(est_sim_temp[pkg] >= est_sim_tjmax * 1000)
+
+/* Bring the temperature of pkg up to date. */
+static void
+est_sim_therm(int pkg)
+{
+	uint16_t ID16, top;
+	int64_t p, pmax, target;
+	int dt, mV;
+
+	dt = ticks - est_sim_temp_ticks[pkg];
+	if (dt <= 0)
+		return;
+	est_sim_temp_ticks[pkg] = ticks;
+
+	ID16 = est_sim_status[pkg];
+	top = EST_SIM_ID() & 0xffff;
+	mV = EST_VID_MV(ID16);
+	p = (int64_t)mV * mV * (ID16 >> 8);
+	mV = EST_VID_MV(top);
+	pmax = (int64_t)mV * mV * (top >> 8);
+	if (EST_SIM_HOT(pkg))
+		p /= 2;
+	target = est_sim_ambient * 1000 + est_sim_heat * p * 1000 / pmax;
+	est_sim_temp[pkg] += (target - est_sim_temp[pkg]) * dt / (hz + dt);
+	if (EST_SIM_HOT(pkg))
+		est_sim_tm_log[pkg] = 1;
+}
+
+static uint64_t
+est_sim_rdmsr(u_int msr)
+{
+	uint64_t st;
+	int pkg, below;
+
+	pkg = EST_SIM_PKG(curcpu);
+	switch (msr) {
+	case MSR_PERF_STATUS:
+		if (est_sim_pending[pkg] > 0 && --est_sim_pending[pkg] == 0)
+			est_sim_status[pkg] = est_sim_resolve(pkg);
+		return ((uint64_t)EST_SIM_ID() << 32 | est_sim_status[pkg]);
+	case MSR_PERF_CTL:
+		return (est_sim_ctl[curcpu]);
+	case MSR_FSB_FREQ:
+		switch (EST_SIM_BUSCLK()) {
+		case 133:
+			return (1);
+		case 166:
+			return (3);
+		case 200:
+			return (2);
+		case 266:
+			return (0);
+		case 333:
+			return (4);
+		}
+		return (5);
+	case MSR_THERM_STATUS:
+		if (est_sim_heat == 0)
+			return (0);
+		est_sim_therm(pkg);
+		st = (EST_SIM_HOT(pkg) ? EST_THERM_TM : 0) |
+		    (est_sim_tm_log[pkg] ? EST_THERM_LOG : 0);
+		if (est_sim_dts) {
+			below = est_sim_tjmax - est_sim_temp[pkg] / 1000;
+			st |= EST_THERM_VALID |
+			    (uint64_t)MAX(MIN(below, 0x7f), 0) << 16;
+		}
+		return (st);
+	}
+	return (0);
+}
+
+static void
+est_sim_wrmsr(u_int msr, uint64_t val)
+{
+	int pkg;
+
+	pkg = EST_SIM_PKG(curcpu);
+	if (msr == MSR_THERM_STATUS) {
+		if ((val & EST_THERM_LOG) == 0)
+			est_sim_tm_log[pkg] = 0;
+		return;
+	}
+	if (msr != MSR_PERF_CTL)
+		return;
+	if (((val >> 8) & 0xff) == est_sim_reject)
+		return;
+	est_sim_ctl[curcpu] = val & 0xffff;
+	if (est_sim_settle == 0)
+		est_sim_status[pkg] = est_sim_resolve(pkg);
+	est_sim_pending[pkg] = est_sim_settle;
+}
+
+/*
+ * The calibration loop: est_sim_clock() is a clock of its own which
+ * only moves while est_sim_spin() runs, one iteration per core clock
+ * (half of them lost while the thermal monitor is engaged).  The TSC
+ * counts core clocks.
+ */
+static uint64_t
+est_sim_rdtsc(void)
+{
+
+	return (est_sim_tsc[curcpu]);
+}
+
+static uint64_t
+est_sim_clock(void)
+{
+
+	return (est_sim_ns);
+}
+
+static void
+est_sim_spin(u_int n)
+{
+	uint64_t ns;
+	int pkg, ratio, MHz, work;
+
+	pkg = EST_SIM_PKG(curcpu);
+	ratio = est_sim_status[pkg] >> 8;
+	if (ratio == est_sim_misratio)
+		ratio--;
+	MHz = est_ratio_mhz(ratio, EST_SIM_BUSCLK());
+	work = MHz;
+	if (est_sim_heat != 0 && EST_SIM_HOT(pkg))
+		work /= 2;
+	work = MAX(work, 1);
+	ns = ((uint64_t)n * 1000 + work / 2) / work;
+	est_sim_ns += ns;
+	est_sim_tsc[curcpu] += ns * MHz / 1000;
+}
+
+/* Advance the simulated cp_time by one second's worth of stathz ticks. */
+static void
+est_sim_cp_time(int cpu, long * cp)
+{
+	int MHz, busy;
+
+	MHz = est_ratio_mhz(est_sim_status[EST_SIM_PKG(cpu)] >> 8,
+	    EST_SIM_BUSCLK());
+	if (est_sim_heat != 0 && EST_SIM_HOT(EST_SIM_PKG(cpu)))
+		MHz /= 2;
+	busy = MHz > 0 ? est_sim_demand * 100 / MHz : 100;
+	if (busy > 100)
+		busy = 100;
+	if (busy < 0)
+		busy = 0;
+	est_sim_cp[cpu][CP_USER] += busy;
+	est_sim_cp[cpu][CP_IDLE] += 100 - busy;
+	bcopy(est_sim_cp[cpu], cp, sizeof(est_sim_cp[cpu]));
+}
+#endif /* EST_SIM */
+
+/*
+ * Regenerate the freqs string of ec, which lists the frequencies
+ * supported in increasing order.  Our tables are in the opposite
+ * order (duh!) so read the table backwards.  freqs has room for
+ * every frequency of the largest table we may build: at most five
+ * digits and a separator each, plus the terminating NUL.
+ */
+static void
+est_update_freqs(struct est_cpu * ec)
+{
+	freq_info * f;
+	size_t len;
+
+	ec->freqs[0] = 0;
+	len = 0;
+	for (f = ec->freq_list; f->ID != 0; f++);
+	for (f--;; f--) {
+		len += snprintf(ec->freqs + len, sizeof(ec->freqs) - len,
+		    "%s%d", len ? " " : "", f->MHz);
+		if (f == ec->freq_list)
+			break;
+	}
+}
+
+/* hw.est_freqs is CPU 0's list, dev.cpu.N.est_freqs that of CPU N. */
+static int
+est_sysctl_freqs(SYSCTL_HANDLER_ARGS)
+{
+	struct est_cpu * ec;
+	char freqs[sizeof(ec->freqs)];
+
+	ec = arg1 != NULL ? arg1 : (est_cpus != NULL ? EST_CPU(0) : NULL);
+	freqs[0] = 0;
+	mtx_lock(&est_mtx);
+	if (ec != NULL && ec->freq_list != NULL)
+		strlcpy(freqs, ec->freqs, sizeof(freqs));
+	mtx_unlock(&est_mtx);
+	return (SYSCTL_OUT(req, freqs, strlen(freqs) + 1));
+}
+
+SYSCTL_PROC(_hw, OID_AUTO, est_freqs, CTLTYPE_STRING | CTLFLAG_RD, 0, 0,
+	&est_sysctl_freqs, "A", "CPU frequencies supported by Enhanced SpeedStep");
+
+/* Find the table which matches (vendor, ID, BUSCLK) in est_phash. */
+static const est_proc *
+est_lookup(const char * vendor, uint32_t ID, uint32_t BUSCLK)
+{
+	const est_proc * p;
+	u_int v, h;
+
+	for (v = 0; v < nitems(est_vendors); v++)
+		if (strncmp(est_vendors[v], vendor, 12) == 0)
+			break;
+	if (v == nitems(est_vendors))
+		return (NULL);
+
+	h = ((ID % 65521) * EST_PHASH_SEED % 65521 + BUSCLK + v) % 65521;
+	h %= EST_PHASH_SIZE;
+	if (est_phash[h] == 0)
+		return (NULL);
+	p = &est_procs[est_phash[h] - 1];
+	if (p->ID != ID || p->BUSCLK != BUSCLK || p->vendor != v)
+		return (NULL);
+	return (p);
+}
+
+/* Expand the operating points of p into tab, zero terminated. */
+static void
+est_expand(const est_proc * p, freq_info * tab)
+{
+	uint16_t ID16;
+	int i;
+
+	for (i = 0; i < p->nstates; i++) {
+		ID16 = est_pstates[p->first + i];
+		tab[i].MHz = est_ratio_mhz(ID16 >> 8, p->BUSCLK);
+		tab[i].ID = ID16;
+	}
+	tab[i].MHz = 0;
+	tab[i].ID = 0;
+}
+
+/*
+ * Make ec->freqtab the table of ec, if the current setpoint (ID16) is
+ * on it.
+ */
+static int
+est_install(struct est_cpu * ec, uint16_t ID16, uint32_t BUSCLK)
+{
+	freq_info * f;
+
+	/* Make sure the current setpoint is on the table */
+	for (f = ec->freqtab; f->ID != 0; f++)
+		if (f->ID == ID16)
+			break;
+	if (f->ID == 0)
+		return (EOPNOTSUPP);
+
+	ec->freq_list = ec->freqtab;
+	bcopy(ec->freqtab, ec->origtab, sizeof(ec->origtab));
+	est_index_build(ec, BUSCLK);
+	est_update_freqs(ec);
+	est_stats_reset(&ec->stats, f - ec->freqtab);
+	est_profile_bounds(ec);
+	ec->state = EST_SS_IDLE;
+
+	return (0);
+}
+
+static int
+findcpu(struct est_cpu * ec, char * vendor, uint64_t msr, uint32_t BUSCLK)
+{
+	const est_proc * p;
+
+	p = est_lookup(vendor, msr >> 32, BUSCLK);
+	if (p == NULL)
+		return (EOPNOTSUPP);
+	est_expand(p, ec->freqtab);
+	if (est_install(ec, msr & 0xffff, BUSCLK) != 0)
+		return (EOPNOTSUPP);
+
+	/* Print status message and enable EST */
+	printf("cpu%d: Enhanced Speedstep running at %d MHz.\n",
+	    ec->cpu, ec->freq_list[ec->stats.cur].MHz);
+
+	return 0;
+}
+
+/*
+ * Processors which aren't in estprocs still report the PERF IDs of
+ * their slowest and fastest setpoints in MSR_PERF_STATUS[63:32].  With
+ * hw.est.synthesize set, or by default on a bus other than 100 MHz
+ * (estprocs has no tables for those), we make up a table from those:
+ * ratios spaced about EST_SYNTH_MHZ apart in between, plus the one we
+ * are running at, with voltages interpolated between the two ends.
+ * Each setpoint is then tried in turn, and only those which
+ * MSR_PERF_STATUS confirms are kept.
+ */
+#define	EST_SYNTH_MHZ	200
+
+static int est_synthesize = -1;
+SYSCTL_INT(_hw_est, OID_AUTO, synthesize, CTLFLAG_RDTUN, &est_synthesize, 0,
+    "Build a table from MSR_PERF_STATUS for unrecognized processors "
+    "(-1: unless on a 100 MHz bus)");
+
+/*
+ * Return the VID for ratio on the line from the lo to the hi PERF ID,
+ * rounding up, so that we never ask for less voltage than the two
+ * known-good setpoints imply.
+ */
+static int
+est_interpolate_vid(uint16_t lo, uint16_t hi, int ratio)
+{
+	int rlo, rhi, vlo, vhi;
+
+	rlo = lo >> 8;
+	rhi = hi >> 8;
+	vlo = lo & 0xff;
+	vhi = hi & 0xff;
+	if (rhi == rlo || ratio >= rhi)
+		return (vhi);
+	if (ratio <= rlo)
+		return (vlo);
+	return (vlo + ((ratio - rlo) * (vhi - vlo) + (rhi - rlo - 1)) /
+	    (rhi - rlo));
+}
+
+/*
+ * Fill tab from the PERF IDs in msr, fastest first and zero
+ * terminated.  Returns the number of setpoints, or 0 if msr doesn't
+ * describe a usable range.
+ */
+static int
+est_synth_table(freq_info * tab, uint64_t msr, int BUSCLK)
+{
+	uint8_t ratio[256];
+	uint16_t lo, hi, cur;
+	int rlo, rhi, rcur, step, r, n, i;
+
+	hi = (msr >> 32) & 0xffff;
+	lo = (msr >> 48) & 0xffff;
+	cur = msr & 0xffff;
+	rlo = lo >> 8;
+	rhi = hi >> 8;
+	rcur = cur >> 8;
+	if (rlo == 0 || rlo >= rhi || (lo & 0xff) > (hi & 0xff) ||
+	    rcur < rlo || rcur > rhi)
+		return (0);
+
+	/* Widen the spacing until the table fits. */
+	step = (EST_SYNTH_MHZ * 1000 + est_busclk_khz(BUSCLK) / 2) /
+	    est_busclk_khz(BUSCLK);
+	for (step = MAX(step, 1);; step++) {
+		n = 0;
+		for (r = rhi; r > rlo; r -= step) {
+			if (r < rcur && (n == 0 || ratio[n - 1] > rcur))
+				ratio[n++] = rcur;
+			ratio[n++] = r;
+		}
+		if (rcur > rlo && ratio[n - 1] > rcur)
+			ratio[n++] = rcur;
+		ratio[n++] = rlo;
+		if (n <= EST_MAX_STATES)
+			break;
+	}
+
+	for (i = 0; i < n; i++) {
+		tab[i].MHz = est_ratio_mhz(ratio[i], BUSCLK);
+		if (ratio[i] == rcur)
+			tab[i].ID = cur;
+		else if (ratio[i] == rhi)
+			tab[i].ID = hi;
+		else if (ratio[i] == rlo)
+			tab[i].ID = lo;
+		else
+			tab[i].ID = ratio[i] << 8 |
+			    est_interpolate_vid(lo, hi, ratio[i]);
+	}
+	tab[n].MHz = 0;
+	tab[n].ID = 0;
+	return (n);
+}
+
+/*
+ * Synthesize a table for ec.  The cores of a package run at the
+ * fastest setpoint any of them asks for, so the other cores of ec's
+ * package which report the same range temporarily join its domain and
+ * are stepped along, and end up sharing the table.  Runs on ec's CPU
+ * with est_mtx held, and leaves the package at its fastest confirmed
+ * setpoint.
+ */
+static int
+est_synthesize_cpu(struct est_cpu * ec, uint32_t BUSCLK)
+{
+	struct est_cpu * m;
+	freq_info tab[EST_MAX_STATES + 1];
+	uint16_t ID16;
+	int i, n, ntried;
+
+	mtx_assert(&est_mtx, MA_OWNED);
+
+	/* Trying the setpoints would move the clock under the TSC. */
+	if (est_tsc_is_timecounter()) {
+		printf("cpu%d: not synthesizing a table, the TSC is the "
+		    "timecounter.\n", ec->cpu);
+		return (EBUSY);
+	}
+	ntried = est_synth_table(tab, ec->load_status, BUSCLK);
+	if (ntried == 0)
+		return (EOPNOTSUPP);
+	for (i = ec->cpu; i <= mp_maxid; i++) {
+		m = EST_CPU(i);
+		if (CPU_ABSENT(i) || m->freq_list != NULL ||
+		    m->pkg != ec->pkg ||
+		    (m->load_status >> 32) != (ec->load_status >> 32))
+			continue;
+		bcopy(tab, m->freqtab, sizeof(tab));
+		if (est_install(m, m->load_status & 0xffff, BUSCLK) != 0)
+			continue;
+		m->leader = ec->cpu;
+	}
+	if (ec->freq_list == NULL)
+		return (EOPNOTSUPP);
+
+	for (i = n = 0; tab[i].ID != 0; i++)
+		if (est_set_state(ec, &ec->freq_list[i], EST_TC_TABLE) == 0)
+			tab[n++] = tab[i];
+		else
+			printf("cpu%d: synthesized setpoint %d MHz (PERF ID "
+			    "0x%04x) not confirmed, dropping it.\n",
+			    ec->cpu, tab[i].MHz, tab[i].ID);
+	tab[n].MHz = 0;
+	tab[n].ID = 0;
+
+	/* Go to full speed, which we just confirmed we can reach. */
+	if (n > 0)
+		est_set_state(ec, &ec->freq_list[0], EST_TC_TABLE);
+	ID16 = est_rdmsr(MSR_PERF_STATUS) & 0xffff;
+	EST_FOREACH_MEMBER(ec, m) {
+		m->freq_list = NULL;
+		bcopy(tab, m->freqtab, sizeof(tab));
+		if (n > 0 && est_install(m, ID16, BUSCLK) == 0)
+			m->synth_id = ec->load_status >> 32;
+		else {
+			m->leader = m->cpu;
+			est_shared_off(m->cpu);
+		}
+	}
+	if (ec->freq_list == NULL)
+		return (EOPNOTSUPP);
+
+	printf("cpu%d: Enhanced Speedstep table synthesized from "
+	    "MSR_PERF_STATUS (%d of %d setpoints confirmed), running at "
+	    "%d MHz.\n", ec->cpu, n, ntried,
+	    ec->freq_list[ec->stats.cur].MHz);
+	return (0);
+}
+
+/*
+ * Replacement tables, e.g. for undervolting.  A table is written as
+ * "MHz:mV" pairs, fastest first, separated by spaces or commas.  It may
+ * be given in hw.est.override, which applies to every CPU, or in a
+ * firmware(9) image named by hw.est.firmware, which holds one table per
+ * line preceded by the MSR_PERF_STATUS[63:32] value, in hex, of the
+ * processor it is for.  Both may be set from loader.conf or at run
+ * time.  A table is only accepted if every setpoint lies within the
+ * ratio range the processor reports and asks for no more than its
+ * top voltage.  Setting either knob to "" goes back to the built-in
+ * tables.
+ */
+static char est_override[EST_MAX_STATES * 10 + 1] = "";
+static char est_firmware[64] = "";
+
+/*
+ * Parse the table in s into tab for ec, and check it against the
+ * limits ec reports.  Returns 0 or an errno.
+ */
+static int
+est_parse_table(struct est_cpu * ec, const char * s, freq_info * tab)
+{
+	uint16_t lo, hi;
+	u_long MHz, mV;
+	char * ep;
+	int kHz, n, r, VID;
+
+	hi = (ec->load_status >> 32) & 0xffff;
+	lo = (ec->load_status >> 48) & 0xffff;
+	kHz = est_busclk_khz(ec->busclk);
+	bzero(tab, (EST_MAX_STATES + 1) * sizeof(*tab));
+	for (n = 0;; n++) {
+		while (*s == ' ' || *s == '\t' || *s == ',')
+			s++;
+		if (*s == '\0' || *s == '\n')
+			break;
+		if (n == EST_MAX_STATES)
+			return (E2BIG);
+		MHz = strtoul(s, &ep, 10);
+		if (ep == s || *ep != ':')
+			return (EINVAL);
+		s = ep + 1;
+		mV = strtoul(s, &ep, 10);
+		if (ep == s)
+			return (EINVAL);
+		s = ep;
+
+		r = (MHz * 1000 + kHz / 2) / kHz;
+		if (r > 255 || est_ratio_mhz(r, ec->busclk) != MHz)
+			return (EINVAL);
+		if (mV < 700 || mV > 700 + 16 * 255)
+			return (EINVAL);
+		VID = (mV - 700 + 15) / 16;	/* round up */
+		if (r < (lo >> 8) || r > (hi >> 8) || VID > (hi & 0xff))
+			return (ERANGE);
+		if (n > 0 && r >= (tab[n - 1].ID >> 8))
+			return (EINVAL);
+		tab[n].MHz = MHz;
+		tab[n].ID = r << 8 | VID;
+	}
+	if (n == 0)
+		return (EINVAL);
+	tab[n].MHz = 0;
+	tab[n].ID = 0;
+	return (0);
+}
+
+/*
+ * Copy the table in a firmware image meant for ec, if any, to buf.
+ * Returns 0, or ENOENT if there is none.
+ */
+static int
+est_firmware_line(struct est_cpu * ec, const char * data, size_t len,
+    char * buf, size_t size)
+{
+	const char * end, * nl;
+	char * ep;
+	u_long ID;
+
+	end = data + len;
+	while (data < end) {
+		nl = memchr(data, '\n', end - data);
+		if (nl == NULL)
+			nl = end;
+		strlcpy(buf, data, MIN(size, (size_t)(nl - data) + 1));
+		ID = strtoul(buf, &ep, 16);
+		if (ep != buf && ID == (ec->load_status >> 32)) {
+			memmove(buf, ep, strlen(ep) + 1);
+			return (0);
+		}
+		data = nl + 1;
+	}
+	return (ENOENT);
+}
+
+/*
+ * Make tab the table of ec's domain, keeping as close to the current
+ * frequency as it allows.  If the processor won't go there, put the
+ * old table back.  Fails with EBUSY if that would mean changing
+ * frequency while the TSC forbids it.  We must be running on ec's CPU.
+ */
+static int
+est_set_table(struct est_cpu * ec, freq_info * tab, int overridden)
+{
+	struct est_cpu * m;
+	freq_info old[EST_MAX_STATES + 1];
+	freq_info * f;
+	int err, i, MHz, ceil, pass, was;
+
+	mtx_assert(&est_mtx, MA_OWNED);
+
+	if ((f = est_get_state(ec)) == NULL)
+		return (EINVAL);
+	MHz = f->MHz;
+	/* Only a table without the current frequency moves the clock. */
+	if ((err = est_tsc_busy()) != 0) {
+		for (i = 0; tab[i].ID != 0 && tab[i].MHz != MHz; i++)
+			;
+		if (tab[i].ID == 0)
+			return (err);
+	}
+	ceil = ec->therm_ceil > 0 ? ec->freq_list[ec->therm_ceil].MHz : 0;
+	bcopy(ec->freqtab, old, sizeof(old));
+	was = ec->overridden;
+
+	for (pass = 0; pass < 2; pass++) {
+		EST_FOREACH_MEMBER(ec, m) {
+			bcopy(tab, m->freqtab, sizeof(m->freqtab));
+			est_index_build(m, m->busclk);
+			est_update_freqs(m);
+			m->overridden = overridden;
+		}
+		ec->want = -1;
+		ec->async_want = -1;
+		ec->calibrated = 0;
+		est_profile_bounds(ec);
+		if (ceil != 0)
+			ec->therm_ceil = est_mhz_index(ec, ceil,
+			    EST_ROUND_DOWN);
+		f = &ec->freq_list[est_clamp(ec,
+		    est_mhz_index(ec, MHz, EST_ROUND_NEAREST))];
+		est_stats_reset(&ec->stats, f - ec->freq_list);
+		if ((err = est_set_state(ec, f, EST_TC_TABLE)) == 0)
+			return (pass == 0 ? 0 : EIO);
+		if (pass == 1)
+			break;
+		printf("cpu%d: new setpoint table rejected, restoring the "
+		    "old one.\n", ec->cpu);
+		tab = old;
+		overridden = was;
+	}
+	return (err);
+}
+
+/*
+ * Fine-grained tables.  The datasheets only list a handful of
+ * setpoints, but the processor takes any bus ratio between them.  With
+ * hw.est.fine.enable set, every ratio missing between two neighbouring
+ * setpoints of a table is added, with a VID interpolated between
+ * theirs (rounded up, as for synthesized tables) and kept within the
+ * envelope of the table: no lower than its slowest setpoint's VID and
+ * no higher than its fastest's.  Before the new table is published,
+ * each added setpoint is tried: MSR_PERF_STATUS must report it within
+ * hw.est.timeout_us, and keep reporting it over hw.est.fine.reads more
+ * reads hw.est.fine.interval_us apart.  Those which fail are left out.
+ */
+static int est_fine_enable = 0;
+static int est_fine_reads = 8;
+static int est_fine_interval_us = 50;
+static u_int est_fine_nadded = 0;
+static u_int est_fine_nrejected = 0;
+
+/*
+ * Extend tab, zero terminated and fastest first, with the missing
+ * ratios, and return a bitmask of the entries which are new.  Returns
+ * 0 if there are none, or if the result wouldn't fit.
+ */
+static uint32_t
+est_fine_table(freq_info * tab, int BUSCLK)
+{
+	freq_info out[EST_MAX_STATES + 1];
+	uint32_t added;
+	int vmin, vmax, VID, i, n, r;
+
+	for (n = 0; tab[n].ID != 0; n++)
+		;
+	if (n < 2 || (tab[0].ID >> 8) - (tab[n - 1].ID >> 8) + 1 >
+	    EST_MAX_STATES)
+		return (0);
+	vmax = tab[0].ID & 0xff;
+	vmin = tab[n - 1].ID & 0xff;
+
+	added = 0;
+	for (i = n = 0; tab[i].ID != 0; i++) {
+		out[n++] = tab[i];
+		if (tab[i + 1].ID == 0)
+			break;
+		for (r = (tab[i].ID >> 8) - 1; r > (tab[i + 1].ID >> 8); r--) {
+			VID = est_interpolate_vid(tab[i + 1].ID, tab[i].ID, r);
+			VID = MAX(MIN(VID, vmax), vmin);
+			out[n].MHz = est_ratio_mhz(r, BUSCLK);
+			out[n].ID = r << 8 | VID;
+			added |= 1U << n++;
+		}
+	}
+	out[n].MHz = 0;
+	out[n].ID = 0;
+	if (added != 0)
+		bcopy(out, tab, (n + 1) * sizeof(*tab));
+	return (added);
+}
+
+/*
+ * Move ec's domain to ID16, which needn't be on its table, and check
+ * that it gets there and stays.  We must be running on ec's CPU.
+ */
+static int
+est_fine_try(struct est_cpu * ec, uint16_t ID16)
+{
+	int step, t, i;
+
+	step = est_poll_us > 0 ? est_poll_us : 1;
+	est_write_ctl(ec, ID16);
+	for (t = 0; (est_rdmsr(MSR_PERF_STATUS) & 0xffff) != ID16; t += step) {
+		if (t > est_timeout_us)
+			return (ETIMEDOUT);
+		DELAY(step);
+	}
+	for (i = 0; i < est_fine_reads; i++) {
+		DELAY(est_fine_interval_us);
+		if ((est_rdmsr(MSR_PERF_STATUS) & 0xffff) != ID16)
+			return (EIO);
+	}
+	return (0);
+}
+
+/*
+ * Extend tab for ec's domain, dropping the setpoints which fail the
+ * check, and put the domain back where it was.  Trying them changes
+ * frequency, so this fails with EBUSY if the TSC forbids that.  Runs
+ * on ec's CPU with est_mtx held.
+ */
+static int
+est_fine_extend(struct est_cpu * ec, freq_info * tab)
+{
+	freq_info * f;
+	uint32_t added;
+	int err, i, n;
+
+	mtx_assert(&est_mtx, MA_OWNED);
+
+	if ((f = est_get_state(ec)) == NULL)
+		return (EINVAL);
+	if ((err = est_tsc_busy()) != 0)
+		return (err);
+	if ((added = est_fine_table(tab, ec->busclk)) == 0)
+		return (0);
+	ec->state = EST_SS_SWITCHING;
+	est_shared_update(ec, 0);
+	for (i = n = 0; tab[i].ID != 0; i++) {
+		if ((added & (1U << i)) != 0) {
+			if (est_fine_try(ec, tab[i].ID) != 0) {
+				printf("cpu%d: %d MHz (PERF ID 0x%04x) did not "
+				    "hold, leaving it out.\n", ec->cpu,
+				    tab[i].MHz, tab[i].ID);
+				est_fine_nrejected++;
+				continue;
+			}
+			est_fine_nadded++;
+		}
+		tab[n++] = tab[i];
+	}
+	tab[n].MHz = 0;
+	tab[n].ID = 0;
+
+	if (est_fine_try(ec, f->ID) != 0)
+		printf("cpu%d: could not return to %d MHz after trying the "
+		    "fine-grained setpoints.\n", ec->cpu, f->MHz);
+	ec->state = EST_SS_IDLE;
+	est_shared_update(ec, 0);
+	return (0);
+}
+
+/*
+ * Apply hw.est.override and hw.est.firmware (in that order of
+ * preference) to every domain, or restore the built-in tables if
+ * neither has one for it, and extend the result if hw.est.fine.enable
+ * is set.
+ */
+static int
+est_apply_overrides(void)
+{
+	const struct firmware * fw;
+	struct est_cpu * ec;
+	freq_info tab[EST_MAX_STATES + 1];
+	const char * s;
+	char * line;
+	int err, err1;
+
+	fw = NULL;
+	if (est_firmware[0] != '\0' &&
+	    (fw = firmware_get(est_firmware)) == NULL) {
+		printf("EST: firmware image %s not found.\n", est_firmware);
+		return (ENOENT);
+	}
+	line = malloc(EST_MAX_STATES * 10 + 1, M_TEMP, M_WAITOK);
+
+	err = 0;
+	EST_FOREACH_LEADER(ec) {
+		s = NULL;
+		if (est_override[0] != '\0')
+			s = est_override;
+		else if (fw != NULL && est_firmware_line(ec, fw->data,
+		    fw->datasize, line, EST_MAX_STATES * 10 + 1) == 0)
+			s = line;
+		if (s != NULL)
+			err1 = est_parse_table(ec, s, tab);
+		else {
+			bcopy(ec->origtab, tab, sizeof(tab));
+			err1 = 0;
+		}
+		if (err1 != 0) {
+			printf("cpu%d: invalid setpoint table (error %d).\n",
+			    ec->cpu, err1);
+			err = err1;
+			continue;
+		}
+		if (!est_fine_enable && ec->overridden == (s != NULL) &&
+		    bcmp(ec->freqtab, tab, sizeof(tab)) == 0)
+			continue;
+
+		est_bind(ec->cpu);
+		mtx_lock(&est_mtx);
+		if (ec->freq_list == NULL)
+			err1 = EINVAL;
+		else if (est_fine_enable)
+			err1 = est_fine_extend(ec, tab);
+		if (err1 == 0 && (ec->overridden != (s != NULL) ||
+		    bcmp(ec->freqtab, tab, sizeof(tab)) != 0))
+			err1 = est_set_table(ec, tab, s != NULL);
+		mtx_unlock(&est_mtx);
+		est_unbind();
+		if (err1 != 0)
+			err = err1;
+		else if (s != NULL)
+			printf("cpu%d: using setpoint table %s.\n", ec->cpu,
+			    ec->freqs);
+	}
+
+	free(line, M_TEMP);
+	if (fw != NULL)
+		firmware_put(fw, FIRMWARE_UNLOAD);
+	return (err);
+}
+
+/*
+ * arg1 is the buffer (est_override or est_firmware), arg2 its size.
+ * Before the driver has attached we only remember the value.
+ */
+static int
+est_sysctl_override(SYSCTL_HANDLER_ARGS)
+{
+	char * buf, * old;
+	int err;
+
+	buf = malloc(arg2, M_TEMP, M_WAITOK);
+	old = malloc(arg2, M_TEMP, M_WAITOK);
+	strlcpy(buf, arg1, arg2);
+	strlcpy(old, arg1, arg2);
+	err = sysctl_handle_string(oidp, buf, arg2, req);
+	if (err == 0 && req->newptr != NULL) {
+		strlcpy(arg1, buf, arg2);
+		if (est_cpus != NULL && (err = est_apply_overrides()) != 0) {
+			strlcpy(arg1, old, arg2);
+			(void)est_apply_overrides();
+		}
+	}
+	free(old, M_TEMP);
+	free(buf, M_TEMP);
+	return (err);
+}
+
+SYSCTL_PROC(_hw_est, OID_AUTO, override, CTLTYPE_STRING | CTLFLAG_RWTUN,
+    est_override, sizeof(est_override), &est_sysctl_override, "A",
+    "Setpoint table to use instead of the built-in one (MHz:mV ...)");
+SYSCTL_PROC(_hw_est, OID_AUTO, firmware, CTLTYPE_STRING | CTLFLAG_RWTUN,
+    est_firmware, sizeof(est_firmware), &est_sysctl_override, "A",
+    "firmware(9) image holding setpoint tables");
+
+static int
+est_sysctl_fine_enable(SYSCTL_HANDLER_ARGS)
+{
+	int err, val, old;
+
+	old = val = est_fine_enable;
+	err = sysctl_handle_int(oidp, &val, 0, req);
+	if (err != 0 || req->newptr == NULL || val == old)
+		return (err);
+	est_fine_enable = val != 0;
+	if (est_cpus != NULL && (err = est_apply_overrides()) != 0) {
+		est_fine_enable = old;
+		(void)est_apply_overrides();
+	}
+	return (err);
+}
+
+static SYSCTL_NODE(_hw_est, OID_AUTO, fine, CTLFLAG_RD, 0,
+    "Setpoints at every bus ratio");
+SYSCTL_PROC(_hw_est_fine, OID_AUTO, enable, CTLTYPE_INT | CTLFLAG_RWTUN,
+    0, 0, &est_sysctl_fine_enable, "I",
+    "Add every bus ratio between the setpoints of the table");
+SYSCTL_INT(_hw_est_fine, OID_AUTO, reads, CTLFLAG_RWTUN, &est_fine_reads,
+    0, "Reads of MSR_PERF_STATUS a new setpoint must hold for");
+SYSCTL_INT(_hw_est_fine, OID_AUTO, interval_us, CTLFLAG_RWTUN,
+    &est_fine_interval_us, 0, "Interval between those reads (us)");
+SYSCTL_UINT(_hw_est_fine, OID_AUTO, added, CTLFLAG_RD, &est_fine_nadded, 0,
+    "Setpoints which passed the check");
+SYSCTL_UINT(_hw_est_fine, OID_AUTO, rejected, CTLFLAG_RD,
+    &est_fine_nrejected, 0, "Setpoints which failed the check");
+
+/*
+ * Return an identifier for the package we are running on: the initial
+ * APIC ID with the bits numbering logical CPUs within a package
+ * stripped off.
+ */
+static int
+est_package_id(void)
+{
+#ifdef EST_SIM
+	return (EST_SIM_PKG(curcpu));
+#else
+	u_int p[4];
+	int apic, nlogical, shift;
+
+	do_cpuid(1, p);
+	apic = (p[1] >> 24) & 0xff;
+	nlogical = (p[3] & CPUID_HTT) ? (p[1] >> 16) & 0xff : 1;
+	for (shift = 0; (1 << shift) < nlogical; shift++)
+		;
+	return (apic >> shift);
+#endif
+}
+
+/*
+ * The bus clock, in MHz as estprocs quotes it: 0 until we have found
+ * it out at load time, unless set in loader.conf.  Processors from the
+ * Core Solo/Duo (Yonah) on report it in MSR_FSB_FREQ.  The Pentium M
+ * doesn't, but its TSC runs at the core clock, and tsc_freq was
+ * measured at the setpoint it booted at, so tsc_freq over the bus
+ * ratio in MSR_PERF_STATUS gives it away.  If neither works, assume
+ * the 400 MT/s (100 MHz) bus of the early parts.
+ */
+static int est_busclk = 0;
+SYSCTL_INT(_hw_est, OID_AUTO, busclk, CTLFLAG_RDTUN, &est_busclk, 0,
+    "Bus clock (MHz, 0: detect)");
+
+static const int est_busclks[] = { 100, 133, 166, 200 };
+
+/* MSR_FSB_FREQ[2:0] to the bus clock. */
+static const int est_fsb_codes[8] = { 266, 133, 200, 166, 333, 100, 0, 0 };
+
+/* Is MSR_FSB_FREQ there?  The sim pretends to be a Yonah if asked. */
+static int
+est_has_fsb_freq(void)
+{
+#ifdef EST_SIM
+	return (est_sim_fsb);
 #else
-#include <sys/pcpu.h>
+	u_int family, model;
+
+	family = (cpu_id >> 8) & 0xf;
+	model = ((cpu_id >> 4) & 0xf) | ((cpu_id >> 12) & 0xf0);
+	return (family == 6 && model >= 0x0e);
 #endif
+}
 
-#include <machine/md_var.h>
+/*
+ * Work out the bus clock from status, MSR_PERF_STATUS of the CPU we
+ * are running on.
+ */
+static int
+est_busclk_detect(uint64_t status)
+{
+	uint64_t kHz;
+	u_int i, ratio;
+	int BUSCLK;
 
-/* Names and numbers from IA-32 System Programming Guide */
-#define MSR_PERF_STATUS		0x198
-#define MSR_PERF_CTL		0x199
+	if (est_has_fsb_freq()) {
+		BUSCLK = est_fsb_codes[est_rdmsr(MSR_FSB_FREQ) & 7];
+		if (BUSCLK != 0)
+			return (BUSCLK);
+	}
+	ratio = (status >> 8) & 0xff;
+	if (ratio != 0 && tsc_freq != 0) {
+		kHz = tsc_freq / 1000 / ratio;
+		for (i = 0; i < nitems(est_busclks); i++)
+			if (kHz * 100 > (uint64_t)est_busclk_khz(
+			    est_busclks[i]) * 97 && kHz * 100 < (uint64_t)
+			    est_busclk_khz(est_busclks[i]) * 103)
+				return (est_busclks[i]);
+	}
+	printf("EST: could not tell the bus clock, assuming 100 MHz.\n");
+	return (100);
+}
 
-/* Specifies a frequency, and how to get it. */
-typedef struct {
-	uint16_t MHz;
-	uint16_t ID;
-} freq_info;
+/*
+ * Identify the processor on every CPU and group the CPUs into domains.
+ * Returns the number of CPUs on which EST is usable.
+ */
+static int
+est_attach_cpus(char * vendor)
+{
+	struct est_cpu * ec, * m;
+	int i, n, err;
 
-/* Identifying characteristics of a processor and its frequencies */
-typedef struct {
-	char * vendor;
-	uint32_t ID;
-	uint32_t BUSCLK;
-	freq_info * freqtab;
-} cpu_info;
-
-#define ID16(MHz, mv, BUSCLK)				\
-    ( ((MHz / BUSCLK) << 8) + ((mv ? mv - 700 : 0) >> 4) )
-#define ID32(MHz_hi, mv_hi, MHz_lo, mv_lo, BUSCLK)	\
-    ( (ID16(MHz_lo, mv_lo, BUSCLK) << 16) + (ID16(MHz_hi, mv_hi, BUSCLK)) )
-#define FREQ_INFO_100(MHz, mv)				\
-    { MHz, ID16(MHz, mv, 100) }
-#define INTEL_100(tab, zhi, vhi, zlo, vlo)		\
-    { GenuineIntel, ID32(zhi, vhi, zlo, vlo, 100), 100, tab }
+	for (i = 0; i <= mp_maxid; i++) {
+		if (CPU_ABSENT(i))
+			continue;
+		ec = EST_CPU(i);
+		ec->cpu = i;
+		ec->leader = i;
+		callout_init_mtx(&ec->gov_callout, &est_mtx, 0);
+		callout_init_mtx(&ec->qos_callout, &est_mtx, 0);
+		callout_init_mtx(&ec->therm_callout, &est_mtx, 0);
+		callout_init_mtx(&ec->shared_callout, &est_mtx, 0);
+		ec->want = -1;
+		ec->async_want = -1;
+		ec->boot_idx = -1;
+		ec->resume_idx = -1;
 
-char GenuineIntel[12] = "GenuineIntel";
+		est_bind(i);
+		ec->load_status = est_rdmsr(MSR_PERF_STATUS);
+		ec->pkg = est_package_id();
+		if (est_busclk == 0)
+			est_busclk = est_busclk_detect(ec->load_status);
+		est_unbind();
+	}
+
+	n = 0;
+	for (i = 0; i <= mp_maxid; i++) {
+		if (CPU_ABSENT(i))
+			continue;
+		ec = EST_CPU(i);
+
+		/* Already done along with another core of its package? */
+		if (ec->freq_list != NULL) {
+			n++;
+			continue;
+		}
+
+		/* Identify the exact CPU model, or make its table up */
+		err = findcpu(ec, vendor, ec->load_status, est_busclk);
+		if (err != 0 && (est_synthesize > 0 ||
+		    (est_synthesize < 0 && est_busclk != 100))) {
+			est_bind(i);
+			mtx_lock(&est_mtx);
+			err = est_synthesize_cpu(ec, est_busclk);
+			mtx_unlock(&est_mtx);
+			est_unbind();
+		}
+		if (err != 0) {
+			printf("cpu%d: Processor claims to support "
+			    "Enhanced Speedstep, but is not recognized.\n"
+			    "Please update driver or contact "
+			    "the maintainer.\n"
+			    "cpu_vendor = %12s msr = %0llx, BUSCLK = %x.\n",
+			    i, vendor, (unsigned long long)ec->load_status,
+			    est_busclk);
+			continue;
+		}
+		n++;
+	}
+
+	/* Join the domain of an earlier CPU in the same package. */
+	EST_FOREACH(ec) {
+		if (ec->leader != ec->cpu)
+			continue;
+		EST_FOREACH(m) {
+			if (m == ec)
+				break;
+			if (m->leader == m->cpu && m->pkg == ec->pkg &&
+			    memcmp(m->freqtab, ec->freqtab,
+			    sizeof(ec->freqtab)) == 0) {
+				ec->leader = m->cpu;
+				break;
+			}
+		}
+	}
+	return (n);
+}
+
+/* Add the dev.cpu.N knobs for every CPU on which EST is usable. */
+static void
+est_add_sysctls(void)
+{
+	struct est_cpu * ec;
+	struct sysctl_oid * tree;
+	device_t dev;
+
+	EST_FOREACH(ec) {
+		sysctl_ctx_init(&ec->sysctl_ctx);
+		dev = devclass_get_device(devclass_find("cpu"), ec->cpu);
+		if (dev == NULL || (tree = device_get_sysctl_tree(dev)) == NULL)
+			continue;
+		SYSCTL_ADD_PROC(&ec->sysctl_ctx, SYSCTL_CHILDREN(tree),
+		    OID_AUTO, "est_freq", CTLTYPE_INT | CTLFLAG_RW, ec, 0,
+		    est_sysctl_mhz, "I",
+		    "Current frequency of this CPU's domain");
+		SYSCTL_ADD_PROC(&ec->sysctl_ctx, SYSCTL_CHILDREN(tree),
+		    OID_AUTO, "est_freqs", CTLTYPE_STRING | CTLFLAG_RD, ec, 0,
+		    est_sysctl_freqs, "A", "Frequencies supported");
+		SYSCTL_ADD_INT(&ec->sysctl_ctx, SYSCTL_CHILDREN(tree),
+		    OID_AUTO, "est_domain", CTLFLAG_RD, &ec->leader, 0,
+		    "First CPU of the domain sharing this CPU's setpoint");
+		SYSCTL_ADD_PROC(&ec->sysctl_ctx, SYSCTL_CHILDREN(tree),
+		    OID_AUTO, "est_residency", CTLTYPE_STRING | CTLFLAG_RD,
+		    ec, 0, est_sysctl_stats, "A",
+		    "Time spent at each frequency (MHz:ms)");
+		SYSCTL_ADD_PROC(&ec->sysctl_ctx, SYSCTL_CHILDREN(tree),
+		    OID_AUTO, "est_energy", CTLTYPE_STRING | CTLFLAG_RD,
+		    ec, 3, est_sysctl_stats, "A",
+		    "Estimated energy spent at each frequency (MHz:mJ)");
+		SYSCTL_ADD_PROC(&ec->sysctl_ctx, SYSCTL_CHILDREN(tree),
+		    OID_AUTO, "est_calibration", CTLTYPE_STRING | CTLFLAG_RD,
+		    ec, 0, est_sysctl_calib, "A",
+		    "Measured clock, loop rate and switching time of each "
+		    "setpoint");
+		SYSCTL_ADD_PROC(&ec->sysctl_ctx, SYSCTL_CHILDREN(tree),
+		    OID_AUTO, "est_snapshot", CTLTYPE_OPAQUE | CTLFLAG_RD,
+		    ec, 1, est_sysctl_table, "S,est_snapshot",
+		    "Setpoints, current state and statistics");
+	}
+}
 
 /*
- * Data from
- * Intel Pentium M Processor Datasheet (Order Number 252612), Table 5
+ * est_pm devices.  Once the module has found its CPUs it adds an
+ * est_pm child to each cpuN device it manages; the identify method
+ * covers cpuN devices which show up later.  The device carries what
+ * is tied to the CPU's device lifecycle: suspend and resume, and
+ * unless hw.est.cpufreq is 0, a cpufreq(4) driver registering
+ * freq_list as absolute settings, so that powerd(8) and the rest of
+ * the stock tooling can drive us.  Settings go through est_change(),
+ * so domains, the TSC, QoS requests and the thermal ceiling are
+ * handled as for the sysctls.  We stay away if the in-tree est(4)
+ * driver got there first.
  */
-static freq_info PM17_130[] = {
-	/* 130nm 1.70GHz Pentium M */
-	FREQ_INFO_100(1700, 1484),
-	FREQ_INFO_100(1400, 1308),
-	FREQ_INFO_100(1200, 1228),
-	FREQ_INFO_100(1000, 1116),
-	FREQ_INFO_100( 800, 1004),
-	FREQ_INFO_100( 600,  956),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM16_130[] = {
-	/* 130nm 1.60GHz Pentium M */
-	FREQ_INFO_100(1600, 1484),
-	FREQ_INFO_100(1400, 1420),
-	FREQ_INFO_100(1200, 1276),
-	FREQ_INFO_100(1000, 1164),
-	FREQ_INFO_100( 800, 1036),
-	FREQ_INFO_100( 600,  956),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM15_130[] = {
-	/* 130nm 1.50GHz Pentium M */
-	FREQ_INFO_100(1500, 1484),
-	FREQ_INFO_100(1400, 1452),
-	FREQ_INFO_100(1200, 1356),
-	FREQ_INFO_100(1000, 1228),
-	FREQ_INFO_100( 800, 1116),
-	FREQ_INFO_100( 600,  956),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM14_130[] = {
-	/* 130nm 1.40GHz Pentium M */
-	FREQ_INFO_100(1400, 1484),
-	FREQ_INFO_100(1200, 1436),
-	FREQ_INFO_100(1000, 1308),
-	FREQ_INFO_100( 800, 1180),
-	FREQ_INFO_100( 600,  956),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM13_130[] = {
-	/* 130nm 1.30GHz Pentium M */
-	FREQ_INFO_100(1300, 1388),
-	FREQ_INFO_100(1200, 1356),
-	FREQ_INFO_100(1000, 1292),
-	FREQ_INFO_100( 800, 1260),
-	FREQ_INFO_100( 600,  956),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM13_LV_130[] = {
-	/* 130nm 1.30GHz Low Voltage Pentium M */
-	FREQ_INFO_100(1300, 1180),
-	FREQ_INFO_100(1200, 1164),
-	FREQ_INFO_100(1100, 1100),
-	FREQ_INFO_100(1000, 1020),
-	FREQ_INFO_100( 900, 1004),
-	FREQ_INFO_100( 800,  988),
-	FREQ_INFO_100( 600,  956),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM12_LV_130[] = {
-	/* 130 nm 1.20GHz Low Voltage Pentium M */
-	FREQ_INFO_100(1200, 1180),
-	FREQ_INFO_100(1100, 1164),
-	FREQ_INFO_100(1000, 1100),
-	FREQ_INFO_100( 900, 1020),
-	FREQ_INFO_100( 800, 1004),
-	FREQ_INFO_100( 600,  956),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM11_LV_130[] = {
-	/* 130 nm 1.10GHz Low Voltage Pentium M */
-	FREQ_INFO_100(1100, 1180),
-	FREQ_INFO_100(1000, 1164),
-	FREQ_INFO_100( 900, 1100),
-	FREQ_INFO_100( 800, 1020),
-	FREQ_INFO_100( 600,  956),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM11_ULV_130[] = {
-	/* 130 nm 1.10GHz Ultra Low Voltage Pentium M */
-	FREQ_INFO_100(1100, 1004),
-	FREQ_INFO_100(1000,  988),
-	FREQ_INFO_100( 900,  972),
-	FREQ_INFO_100( 800,  956),
-	FREQ_INFO_100( 600,  844),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM10_ULV_130[] = {
-	/* 130 nm 1.00GHz Ultra Low Voltage Pentium M */
-	FREQ_INFO_100(1000, 1004),
-	FREQ_INFO_100( 900,  988),
-	FREQ_INFO_100( 800,  972),
-	FREQ_INFO_100( 600,  844),
-	FREQ_INFO_100(   0,    0),
-};
+static int est_cpufreq = 1;
+SYSCTL_INT(_hw_est, OID_AUTO, cpufreq, CTLFLAG_RDTUN, &est_cpufreq, 0,
+    "Register as a cpufreq(4) driver");
 
 /*
- * Data from
- * Intel Pentium M Processor on 90nm Process with 2-MB L2 Cache
- * Datasheet (Order Number 302189), Table 5
- */
-static freq_info PM_765A_90[] = {
-	/* 90 nm 2.10GHz Pentium M, VID #A */
-	FREQ_INFO_100(2100, 1340),
-	FREQ_INFO_100(1800, 1276),
-	FREQ_INFO_100(1600, 1228),
-	FREQ_INFO_100(1400, 1180),
-	FREQ_INFO_100(1200, 1132),
-	FREQ_INFO_100(1000, 1084),
-	FREQ_INFO_100( 800, 1036),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_765B_90[] = {
-	/* 90 nm 2.10GHz Pentium M, VID #B */
-	FREQ_INFO_100(2100, 1324),
-	FREQ_INFO_100(1800, 1260),
-	FREQ_INFO_100(1600, 1212),
-	FREQ_INFO_100(1400, 1180),
-	FREQ_INFO_100(1200, 1132),
-	FREQ_INFO_100(1000, 1084),
-	FREQ_INFO_100( 800, 1036),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_765C_90[] = {
-	/* 90 nm 2.10GHz Pentium M, VID #C */
-	FREQ_INFO_100(2100, 1308),
-	FREQ_INFO_100(1800, 1244),
-	FREQ_INFO_100(1600, 1212),
-	FREQ_INFO_100(1400, 1164),
-	FREQ_INFO_100(1200, 1116),
-	FREQ_INFO_100(1000, 1084),
-	FREQ_INFO_100( 800, 1036),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_765E_90[] = {
-	/* 90 nm 2.10GHz Pentium M, VID #E */
-	FREQ_INFO_100(2100, 1356),
-	FREQ_INFO_100(1800, 1292),
-	FREQ_INFO_100(1600, 1244),
-	FREQ_INFO_100(1400, 1196),
-	FREQ_INFO_100(1200, 1148),
-	FREQ_INFO_100(1000, 1100),
-	FREQ_INFO_100( 800, 1052),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_755A_90[] = {
-	/* 90 nm 2.00GHz Pentium M, VID #A */
-	FREQ_INFO_100(2000, 1340),
-	FREQ_INFO_100(1800, 1292),
-	FREQ_INFO_100(1600, 1244),
-	FREQ_INFO_100(1400, 1196),
-	FREQ_INFO_100(1200, 1148),
-	FREQ_INFO_100(1000, 1100),
-	FREQ_INFO_100( 800, 1052),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_755B_90[] = {
-	/* 90 nm 2.00GHz Pentium M, VID #B */
-	FREQ_INFO_100(2000, 1324),
-	FREQ_INFO_100(1800, 1276),
-	FREQ_INFO_100(1600, 1228),
-	FREQ_INFO_100(1400, 1180),
-	FREQ_INFO_100(1200, 1132),
-	FREQ_INFO_100(1000, 1084),
-	FREQ_INFO_100( 800, 1036),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_755C_90[] = {
-	/* 90 nm 2.00GHz Pentium M, VID #C */
-	FREQ_INFO_100(2000, 1308),
-	FREQ_INFO_100(1800, 1276),
-	FREQ_INFO_100(1600, 1228),
-	FREQ_INFO_100(1400, 1180),
-	FREQ_INFO_100(1200, 1132),
-	FREQ_INFO_100(1000, 1084),
-	FREQ_INFO_100( 800, 1036),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_755D_90[] = {
-	/* 90 nm 2.00GHz Pentium M, VID #D */
-	FREQ_INFO_100(2000, 1276),
-	FREQ_INFO_100(1800, 1244),
-	FREQ_INFO_100(1600, 1196),
-	FREQ_INFO_100(1400, 1164),
-	FREQ_INFO_100(1200, 1116),
-	FREQ_INFO_100(1000, 1084),
-	FREQ_INFO_100( 800, 1036),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_745A_90[] = {
-	/* 90 nm 1.80GHz Pentium M, VID #A */
-	FREQ_INFO_100(1800, 1340),
-	FREQ_INFO_100(1600, 1292),
-	FREQ_INFO_100(1400, 1228),
-	FREQ_INFO_100(1200, 1164),
-	FREQ_INFO_100(1000, 1116),
-	FREQ_INFO_100( 800, 1052),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_745B_90[] = {
-	/* 90 nm 1.80GHz Pentium M, VID #B */
-	FREQ_INFO_100(1800, 1324),
-	FREQ_INFO_100(1600, 1276),
-	FREQ_INFO_100(1400, 1212),
-	FREQ_INFO_100(1200, 1164),
-	FREQ_INFO_100(1000, 1116),
-	FREQ_INFO_100( 800, 1052),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_745C_90[] = {
-	/* 90 nm 1.80GHz Pentium M, VID #C */
-	FREQ_INFO_100(1800, 1308),
-	FREQ_INFO_100(1600, 1260),
-	FREQ_INFO_100(1400, 1212),
-	FREQ_INFO_100(1200, 1148),
-	FREQ_INFO_100(1000, 1100),
-	FREQ_INFO_100( 800, 1052),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_745D_90[] = {
-	/* 90 nm 1.80GHz Pentium M, VID #D */
-	FREQ_INFO_100(1800, 1276),
-	FREQ_INFO_100(1600, 1228),
-	FREQ_INFO_100(1400, 1180),
-	FREQ_INFO_100(1200, 1132),
-	FREQ_INFO_100(1000, 1084),
-	FREQ_INFO_100( 800, 1036),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_735A_90[] = {
-	/* 90 nm 1.70GHz Pentium M, VID #A */
-	FREQ_INFO_100(1700, 1340),
-	FREQ_INFO_100(1400, 1244),
-	FREQ_INFO_100(1200, 1180),
-	FREQ_INFO_100(1000, 1116),
-	FREQ_INFO_100( 800, 1052),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_735B_90[] = {
-	/* 90 nm 1.70GHz Pentium M, VID #B */
-	FREQ_INFO_100(1700, 1324),
-	FREQ_INFO_100(1400, 1244),
-	FREQ_INFO_100(1200, 1180),
-	FREQ_INFO_100(1000, 1116),
-	FREQ_INFO_100( 800, 1052),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_735C_90[] = {
-	/* 90 nm 1.70GHz Pentium M, VID #C */
-	FREQ_INFO_100(1700, 1308),
-	FREQ_INFO_100(1400, 1228),
-	FREQ_INFO_100(1200, 1164),
-	FREQ_INFO_100(1000, 1116),
-	FREQ_INFO_100( 800, 1052),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_735D_90[] = {
-	/* 90 nm 1.70GHz Pentium M, VID #D */
-	FREQ_INFO_100(1700, 1276),
-	FREQ_INFO_100(1400, 1212),
-	FREQ_INFO_100(1200, 1148),
-	FREQ_INFO_100(1000, 1100),
-	FREQ_INFO_100( 800, 1052),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_725A_90[] = {
-	/* 90 nm 1.60GHz Pentium M, VID #A */
-	FREQ_INFO_100(1600, 1340),
-	FREQ_INFO_100(1400, 1276),
-	FREQ_INFO_100(1200, 1212),
-	FREQ_INFO_100(1000, 1132),
-	FREQ_INFO_100( 800, 1068),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_725B_90[] = {
-	/* 90 nm 1.60GHz Pentium M, VID #B */
-	FREQ_INFO_100(1600, 1324),
-	FREQ_INFO_100(1400, 1260),
-	FREQ_INFO_100(1200, 1196),
-	FREQ_INFO_100(1000, 1132),
-	FREQ_INFO_100( 800, 1068),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_725C_90[] = {
-	/* 90 nm 1.60GHz Pentium M, VID #C */
-	FREQ_INFO_100(1600, 1308),
-	FREQ_INFO_100(1400, 1244),
-	FREQ_INFO_100(1200, 1180),
-	FREQ_INFO_100(1000, 1116),
-	FREQ_INFO_100( 800, 1052),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_725D_90[] = {
-	/* 90 nm 1.60GHz Pentium M, VID #D */
-	FREQ_INFO_100(1600, 1276),
-	FREQ_INFO_100(1400, 1228),
-	FREQ_INFO_100(1200, 1164),
-	FREQ_INFO_100(1000, 1116),
-	FREQ_INFO_100( 800, 1052),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_715A_90[] = {
-	/* 90 nm 1.50GHz Pentium M, VID #A */
-	FREQ_INFO_100(1500, 1340),
-	FREQ_INFO_100(1200, 1228),
-	FREQ_INFO_100(1000, 1148),
-	FREQ_INFO_100( 800, 1068),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_715B_90[] = {
-	/* 90 nm 1.50GHz Pentium M, VID #B */
-	FREQ_INFO_100(1500, 1324),
-	FREQ_INFO_100(1200, 1212),
-	FREQ_INFO_100(1000, 1148),
-	FREQ_INFO_100( 800, 1068),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_715C_90[] = {
-	/* 90 nm 1.50GHz Pentium M, VID #C */
-	FREQ_INFO_100(1500, 1308),
-	FREQ_INFO_100(1200, 1212),
-	FREQ_INFO_100(1000, 1132),
-	FREQ_INFO_100( 800, 1068),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_715D_90[] = {
-	/* 90 nm 1.50GHz Pentium M, VID #D */
-	FREQ_INFO_100(1500, 1276),
-	FREQ_INFO_100(1200, 1180),
-	FREQ_INFO_100(1000, 1116),
-	FREQ_INFO_100( 800, 1052),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_738_90[] = {
-	/* 90 nm 1.40GHz Low Voltage Pentium M */
-	FREQ_INFO_100(1400, 1116),
-	FREQ_INFO_100(1300, 1116),
-	FREQ_INFO_100(1200, 1100),
-	FREQ_INFO_100(1100, 1068),
-	FREQ_INFO_100(1000, 1052),
-	FREQ_INFO_100( 900, 1036),
-	FREQ_INFO_100( 800, 1020),
-	FREQ_INFO_100( 600,  988),
-	FREQ_INFO_100(   0,    0),
-};
-/*===================================================*/
-/* ---->                                             */
-/* Data from Datasheet Intel Pentium M processor on
-   90 nm Process with 2-MB L2 Cache. Document Number
-   302189-008 Table 3-6.
-*/
-static freq_info PM_753G_90[] = {
-        /* 90 nm 1.20Ghz Ultra Low Voltage Pentium M */
-        FREQ_INFO_100(1200,  956),
-        FREQ_INFO_100(1100,  940),
-        FREQ_INFO_100(1000,  908),
-        FREQ_INFO_100( 900,  892),
-        FREQ_INFO_100( 800,  860),
-        FREQ_INFO_100( 600,  812),
-        FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_753H_90[] = {
-        /* 90 nm 1.20Ghz Ultra Low Voltage Pentium M */
-        FREQ_INFO_100(1200,  940),
-        FREQ_INFO_100(1100,  924),
-        FREQ_INFO_100(1000,  908),
-        FREQ_INFO_100( 900,  876),
-        FREQ_INFO_100( 800,  860),
-        FREQ_INFO_100( 600,  812),
-        FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_753I_90[] = {
-        /* 90 nm 1.20Ghz Ultra Low Voltage Pentium M */
-        FREQ_INFO_100(1200,  924),
-        FREQ_INFO_100(1100,  908),
-        FREQ_INFO_100(1000,  892),
-        FREQ_INFO_100( 900,  876),
-        FREQ_INFO_100( 800,  860),
-        FREQ_INFO_100( 600,  812),
-        FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_753J_90[] = {
-        /* 90 nm 1.10Ghz Ultra Low Voltage Pentium M */
-        FREQ_INFO_100(1200,  908),
-        FREQ_INFO_100(1100,  892),
-        FREQ_INFO_100(1000,  876),
-        FREQ_INFO_100( 900,  860),
-        FREQ_INFO_100( 800,  844),
-        FREQ_INFO_100( 600,  812),
-        FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_753K_90[] = {
-        /* 90 nm 1.10Ghz Ultra Low Voltage Pentium M */
-        FREQ_INFO_100(1200,  892),
-        FREQ_INFO_100(1100,  892),
-        FREQ_INFO_100(1000,  876),
-        FREQ_INFO_100( 900,  860),
-        FREQ_INFO_100( 800,  844),
-        FREQ_INFO_100( 600,  812),
-        FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_753L_90[] = {
-        /* 90 nm 1.10Ghz Ultra Low Voltage Pentium M */
-        FREQ_INFO_100(1200,  876),
-        FREQ_INFO_100(1100,  876),
-        FREQ_INFO_100(1000,  860),
-        FREQ_INFO_100( 900,  844),
-        FREQ_INFO_100( 800,  844),
-        FREQ_INFO_100( 600,  812),
-        FREQ_INFO_100(   0,    0),
-};
-/*  <---------- Added                                */
-/*===================================================*/
-static freq_info PM_733_90[] = {
-	/* 90 nm 1.10GHz Ultra Low Voltage Pentium M */
-	FREQ_INFO_100(1100,  940),
-	FREQ_INFO_100(1000,  924),
-	FREQ_INFO_100( 900,  892),
-	FREQ_INFO_100( 800,  876),
-	FREQ_INFO_100( 600,  812),
-	FREQ_INFO_100(   0,    0),
-};
-static freq_info PM_723_90[] = {
-	/* 90 nm 1.00GHz Ultra Low Voltage Pentium M */
-	FREQ_INFO_100(1000,  940),
-	FREQ_INFO_100( 900,  908),
-	FREQ_INFO_100( 800,  876),
-	FREQ_INFO_100( 600,  812),
-	FREQ_INFO_100(   0,    0),
-};
+ * Transition latency, us: the upper bound of the slowest latency
+ * bucket seen, or EST_TRANS_LAT before there have been any.
+ */
+#define	EST_TRANS_LAT	10
 
-/*
- * XXX When adding new processors here, check that the est_frequencies
- * buffer (declared below) is still large enough.
- */
-static cpu_info ESTprocs[] = {
-	INTEL_100(PM17_130,	1700, 1484, 600, 956),
-	INTEL_100(PM16_130,	1600, 1484, 600, 956),
-	INTEL_100(PM15_130,	1500, 1484, 600, 956),
-	INTEL_100(PM14_130,	1400, 1484, 600, 956),
-	INTEL_100(PM13_130,	1300, 1388, 600, 956),
-	INTEL_100(PM13_LV_130,	1300, 1180, 600, 956),
-	INTEL_100(PM12_LV_130,	1200, 1180, 600, 956),
-	INTEL_100(PM11_LV_130,	1100, 1180, 600, 956),
-	INTEL_100(PM11_ULV_130,	1100, 1004, 600, 844),
-	INTEL_100(PM10_ULV_130,	1000, 1004, 600, 844),
-	INTEL_100(PM_765A_90,	2100, 1340, 600, 988),
-	INTEL_100(PM_765B_90,	2100, 1324, 600, 988),
-	INTEL_100(PM_765C_90,	2100, 1308, 600, 988),
-	INTEL_100(PM_765E_90,	2100, 1356, 600, 988),
-	INTEL_100(PM_755A_90,	2000, 1340, 600, 988),
-	INTEL_100(PM_755B_90,	2000, 1324, 600, 988),
-	INTEL_100(PM_755C_90,	2000, 1308, 600, 988),
-	INTEL_100(PM_755D_90,	2000, 1276, 600, 988),
-	INTEL_100(PM_745A_90,	1800, 1340, 600, 988),
-	INTEL_100(PM_745B_90,	1800, 1324, 600, 988),
-	INTEL_100(PM_745C_90,	1800, 1308, 600, 988),
-	INTEL_100(PM_745D_90,	1800, 1276, 600, 988),
-	INTEL_100(PM_735A_90,	1700, 1340, 600, 988),
-	INTEL_100(PM_735B_90,	1700, 1324, 600, 988),
-	INTEL_100(PM_735C_90,	1700, 1308, 600, 988),
-	INTEL_100(PM_735D_90,	1700, 1276, 600, 988),
-	INTEL_100(PM_725A_90,	1600, 1340, 600, 988),
-	INTEL_100(PM_725B_90,	1600, 1324, 600, 988),
-	INTEL_100(PM_725C_90,	1600, 1308, 600, 988),
-	INTEL_100(PM_725D_90,	1600, 1276, 600, 988),
-	INTEL_100(PM_715A_90,	1500, 1340, 600, 988),
-	INTEL_100(PM_715B_90,	1500, 1324, 600, 988),
-	INTEL_100(PM_715C_90,	1500, 1308, 600, 988),
-	INTEL_100(PM_715D_90,	1500, 1276, 600, 988),
-	INTEL_100(PM_738_90,	1400, 1116, 600, 988),
-/*============================================================*/
-/* ---->                                             */
-/* Data from Datasheet Intel Pentium M processor on
-   90 nm Process with 2-MB L2 Cache. Document Number
-   302189-008 Table 3-6.
-*/
-	INTEL_100(PM_753G_90,   1200,  956, 600, 812),
-	INTEL_100(PM_753H_90,   1200,  940, 600, 812),
-	INTEL_100(PM_753I_90,   1200,  924, 600, 812),
-	INTEL_100(PM_753J_90,   1200,  908, 600, 812),
-	INTEL_100(PM_753K_90,   1200,  892, 600, 812),
-	INTEL_100(PM_753L_90,   1200,  876, 600, 812),
-/*============================================================*/
-	INTEL_100(PM_733_90,	1100,  940, 600, 812),
-	INTEL_100(PM_723_90,	1000,  940, 600, 812),
-	{ NULL, 0, 0, NULL },
-};
+static int
+est_latency_us(struct est_cpu * ec)
+{
+	struct est_stats * st;
+	int b;
 
-static int est_verbose = 0;
-SYSCTL_INT(_hw, OID_AUTO, est_verbose, CTLFLAG_RW, &est_verbose,
-	   0, "Log CPU frequency changes");
+	st = &EST_LEADER(ec)->stats;
+	for (b = EST_LAT_BUCKETS - 1; b >= 0; b--)
+		if (st->latency[b] != 0)
+			break;
+	if (b < 0)
+		return (EST_TRANS_LAT);
+	return (b < EST_LAT_BUCKETS - 1 ? 1 << b : est_timeout_us);
+}
+
+static void
+est_pm_setting(device_t dev, struct est_cpu * ec, int i,
+    struct cf_setting * set)
+{
+
+	memset(set, CPUFREQ_VAL_UNKNOWN, sizeof(*set));
+	set->freq = ec->freq_list[i].MHz;
+	set->volts = EST_VID_MV(ec->freq_list[i].ID);
+	if ((set->power = est_power_mw(ec->freq_list, i)) < 0)
+		set->power = CPUFREQ_VAL_UNKNOWN;
+	set->lat = est_latency_us(ec);
+	set->dev = dev;
+}
+
+/* The est_cpu of the CPU dev is attached to, if we manage it. */
+static struct est_cpu *
+est_pm_cpu(device_t dev)
+{
+	struct pcpu * pc;
+	struct est_cpu * ec;
 
-static freq_info * freq_list = NULL;		/* NULL if EST is disabled */
+	if (est_cpus == NULL || (pc = cpu_get_pcpu(dev)) == NULL ||
+	    CPU_ABSENT(pc->pc_cpuid))
+		return (NULL);
+	ec = EST_CPU(pc->pc_cpuid);
+	return (ec->freq_list != NULL ? ec : NULL);
+}
+
+static void
+est_pm_identify(driver_t * driver, device_t parent)
+{
+
+	if (est_pm_cpu(parent) == NULL ||
+	    device_find_child(parent, "est_pm", -1) != NULL)
+		return;
+	if (BUS_ADD_CHILD(parent, 10, "est_pm", -1) == NULL)
+		device_printf(parent, "add est_pm child failed\n");
+}
 
 static int
-est_sysctl_mhz(SYSCTL_HANDLER_ARGS)
+est_pm_probe(device_t dev)
 {
-	uint64_t msr;
+
+	if (est_pm_cpu(dev) == NULL ||
+	    device_find_child(device_get_parent(dev), "est", -1) != NULL)
+		return (ENXIO);
+	device_set_desc(dev, "Enhanced SpeedStep (est_PM)");
+	return (0);
+}
+
+static int
+est_pm_attach(device_t dev)
+{
+
+	return (est_cpufreq ? cpufreq_register(dev) : 0);
+}
+
+static int
+est_pm_detach(device_t dev)
+{
+
+	return (est_cpufreq ? cpufreq_unregister(dev) : 0);
+}
+
+/* Remember where the domain was, if dev is on its leader. */
+static int
+est_pm_suspend(device_t dev)
+{
+	struct est_cpu * ec;
 	freq_info * f;
-	int MHz, MHz_wanted;
-	int err = 0;
+	int bound;
 
-	if (freq_list == NULL)
-		return (EOPNOTSUPP);
+	if ((ec = est_pm_cpu(dev)) == NULL || ec->leader != ec->cpu)
+		return (0);
+	bound = est_bind_save(ec->cpu);
+	mtx_lock(&est_mtx);
+	ec->resume_idx = (f = est_get_state(ec)) != NULL ?
+	    f - ec->freq_list : -1;
+	mtx_unlock(&est_mtx);
+	est_rebind(bound);
+	return (0);
+}
 
-	/* Read current status, and make sure it's on our table */
-	msr = rdmsr(MSR_PERF_STATUS) & 0xffff;
-	for (f = freq_list; f->MHz != 0; f++)
-		if (f->ID == msr)
-			break;
-	if (f->MHz == 0) {
-		printf("MSR_PERF_STATUS reports clock ratio (%d) "
-		    "not in freq_list.  Disabling EST.\n",
-		    (int)(msr >> 16));
-		freq_list = NULL;
-		return (EINVAL);
+/*
+ * Firmware brings the CPUs back at whatever setpoint it likes, and
+ * may have reset MSR_PERF_CTL on some cores of a package but not
+ * others, so write the setpoint from before the suspend back to every
+ * member of the domain, within the current limits.  est_get_state()
+ * accounts for where we find it first.
+ */
+static int
+est_pm_resume(device_t dev)
+{
+	struct est_cpu * ec;
+	int bound, i;
+
+	if ((ec = est_pm_cpu(dev)) == NULL || ec->leader != ec->cpu ||
+	    ec->resume_idx < 0)
+		return (0);
+	bound = est_bind_save(ec->cpu);
+	mtx_lock(&est_mtx);
+	if (ec->freq_list == NULL || est_get_state(ec) == NULL) {
+		ec->resume_idx = -1;
+		mtx_unlock(&est_mtx);
+		est_rebind(bound);
+		return (0);
 	}
-	MHz = f->MHz;
+	i = est_clamp(ec, ec->resume_idx);
+	if (est_set_state(ec, &ec->freq_list[i], EST_TC_RESUME) != 0)
+		device_printf(dev, "could not restore %d MHz after resume\n",
+		    ec->freq_list[i].MHz);
+	ec->resume_idx = -1;
+	mtx_unlock(&est_mtx);
+	est_rebind(bound);
+	return (0);
+}
 
-	if (req->newptr) {
-		/*
-		 * Check that the TSC isn't being used as a timecounter.
-		 * If it is, then return EBUSY and refuse to change the
-		 * clock speed.
-		 */
-		if (strcmp(timecounter->tc_name, "TSC") == 0)
-			return EBUSY;
+static int
+est_pm_settings(device_t dev, struct cf_setting * sets, int * count)
+{
+	struct est_cpu * ec;
+	int i, err;
 
-		err = SYSCTL_IN(req, &MHz_wanted, sizeof(int));
-		if (err)
-			return err;
+	if (sets == NULL || count == NULL)
+		return (EINVAL);
+	err = 0;
+	mtx_lock(&est_mtx);
+	if ((ec = est_pm_cpu(dev)) == NULL)
+		err = ENXIO;
+	else if (*count < ec->nstates)
+		err = E2BIG;
+	else {
+		for (i = 0; i < ec->nstates; i++)
+			est_pm_setting(dev, ec, i, &sets[i]);
+		*count = ec->nstates;
+	}
+	mtx_unlock(&est_mtx);
+	return (err);
+}
 
-		/* Look up desired frequency in table */
-		for (f = freq_list; f->MHz != 0; f++)
-			if (f->MHz == MHz_wanted)
-				break;
-		if (f->MHz == 0)
-			return (EOPNOTSUPP);
+static int
+est_pm_set(device_t dev, const struct cf_setting * set)
+{
+	struct est_cpu * ec;
+	int i;
 
-		if (est_verbose)
-			printf("Changing CPU frequency from %d MHz "
-			    "to %d MHz.\n", MHz, MHz_wanted);
+	if (set == NULL)
+		return (EINVAL);
+	mtx_lock(&est_mtx);
+	i = (ec = est_pm_cpu(dev)) != NULL ?
+	    est_mhz_index(ec, set->freq, EST_ROUND_EXACT) : -1;
+	mtx_unlock(&est_mtx);
+	if (ec == NULL)
+		return (ENXIO);
+	if (i < 0)
+		return (EINVAL);
+	return (est_change(ec, EST_CHANGE_INDEX, i));
+}
 
-		msr = rdmsr(MSR_PERF_CTL);
-		msr = (msr & ~(uint64_t)(0xffff)) | f->ID;
-		wrmsr(MSR_PERF_CTL, msr);
+static int
+est_pm_get(device_t dev, struct cf_setting * set)
+{
+	struct est_cpu * ec;
+	int i;
 
-		/*
-		 * Sleep for a short time, to let the cpu find
-		 * its new frequency before we return to the user.
-		 */
-		tsleep(&freq_list, PUSER, "EST", 1);
-	} else {
-		err = SYSCTL_OUT(req, &MHz, sizeof(int));
+	if (set == NULL)
+		return (EINVAL);
+	if ((ec = est_pm_cpu(dev)) == NULL)
+		return (ENXIO);
+	if ((i = est_current(ec, NULL)) < 0)
+		return (EIO);
+	/* The table may have gone, or changed, since we read i. */
+	mtx_lock(&est_mtx);
+	if (ec->freq_list == NULL || i >= ec->nstates) {
+		mtx_unlock(&est_mtx);
+		return (EIO);
 	}
+	est_pm_setting(dev, ec, i, set);
+	mtx_unlock(&est_mtx);
+	return (0);
+}
 
-	return err;
+static int
+est_pm_type(device_t dev, int * type)
+{
+
+	if (type == NULL)
+		return (EINVAL);
+	*type = CPUFREQ_TYPE_ABSOLUTE;
+	return (0);
 }
 
-SYSCTL_PROC(_hw, OID_AUTO, est_curfreq, CTLTYPE_INT | CTLFLAG_RW, 0, 0,
-	    &est_sysctl_mhz, "I", "Current CPU frequency for Enhanced SpeedStep");
+static device_method_t est_pm_methods[] = {
+	/* Device interface */
+	DEVMETHOD(device_identify,	est_pm_identify),
+	DEVMETHOD(device_probe,		est_pm_probe),
+	DEVMETHOD(device_attach,	est_pm_attach),
+	DEVMETHOD(device_detach,	est_pm_detach),
+	DEVMETHOD(device_suspend,	est_pm_suspend),
+	DEVMETHOD(device_resume,	est_pm_resume),
+
+	/* cpufreq interface */
+	DEVMETHOD(cpufreq_drv_set,	est_pm_set),
+	DEVMETHOD(cpufreq_drv_get,	est_pm_get),
+	DEVMETHOD(cpufreq_drv_type,	est_pm_type),
+	DEVMETHOD(cpufreq_drv_settings,	est_pm_settings),
+
+	DEVMETHOD_END
+};
+
+static driver_t est_pm_driver = {
+	"est_pm",
+	est_pm_methods,
+	0,
+};
+
+#if __FreeBSD_version >= 1400058
+DRIVER_MODULE(est_pm, cpu, est_pm_driver, 0, 0);
+#else
+static devclass_t est_pm_devclass;
+DRIVER_MODULE(est_pm, cpu, est_pm_driver, est_pm_devclass, 0, 0);
+#endif
+
+/* Add (or with attach clear, remove) an est_pm child on each CPU. */
+static void
+est_pm_children(int attach)
+{
+	struct est_cpu * ec;
+	device_t cpu, child;
+
+	mtx_lock(&Giant);
+	EST_FOREACH(ec) {
+		cpu = devclass_get_device(devclass_find("cpu"), ec->cpu);
+		if (cpu == NULL)
+			continue;
+		child = device_find_child(cpu, "est_pm", -1);
+		if (!attach) {
+			if (child != NULL)
+				(void)device_delete_child(cpu, child);
+			continue;
+		}
+		if (child != NULL)
+			continue;
+		est_pm_identify(&est_pm_driver, cpu);
+		if ((child = device_find_child(cpu, "est_pm", -1)) != NULL &&
+		    device_probe_and_attach(child) != 0)
+			(void)device_delete_child(cpu, child);
+	}
+	mtx_unlock(&Giant);
+}
 
 /*
- * XXX fixed buffer size XXX
- * This buffer is large enough for up to 16 frequencies of < 10GHz.
- * If we need more than that, increase the buffer size.  Since this
- * buffer is filled using data declared above, this is safe.
+ * Boot policy.  Loaded from loader.conf, we get going as soon as the
+ * APs are up, long before userland can set a frequency, so
+ * hw.est.boot_policy can move every domain to its fastest (1) or
+ * slowest (2) setpoint right away instead of leaving it where the
+ * BIOS did (0).  Once the root file system is mounted we hand over:
+ * domains nobody has set a frequency on in the meantime go back to
+ * the setpoint we found them at, and the governor starts if it is
+ * enabled.  Ignored if the module is loaded after boot.
  */
-static char est_frequencies[80] = "";
-SYSCTL_STRING(_hw, OID_AUTO, est_freqs, CTLFLAG_RD, est_frequencies, 0,
-	"CPU frequencies supported by Enhanced SpeedStep");
+#define	EST_BOOT_LEAVE	0
+#define	EST_BOOT_FAST	1
+#define	EST_BOOT_SLOW	2
 
-static int
-findcpu(char * vendor, uint64_t msr, uint32_t BUSCLK)
-{
-	cpu_info * p;
-	freq_info * f;
-	char freq[6];
-	uint32_t ID;
-	uint16_t ID16;
+static int est_boot_policy = EST_BOOT_LEAVE;
+static int est_boot_pending = 0;
+static eventhandler_tag est_boot_tag = NULL;
 
-	ID = msr >> 32;
-	ID16 = msr & 0xffff;
+SYSCTL_INT(_hw_est, OID_AUTO, boot_policy, CTLFLAG_RDTUN, &est_boot_policy,
+    0, "Setpoint until the root file system is mounted: 0 as found, "
+    "1 fastest, 2 slowest");
+SYSCTL_INT(_hw_est, OID_AUTO, boot_pending, CTLFLAG_RD, &est_boot_pending,
+    0, "The boot policy is in effect");
 
-	/* Find a table which matches (vendor, ID, BUSCLK) */
-	for (p = ESTprocs; p->ID != 0; p++)
-		if ((bcmp(p->vendor, vendor, 12) == 0) &&
-		    (p->ID == ID) &&
-		    (p->BUSCLK == BUSCLK))
-			break;
-	if (p->ID == 0)
-		return (EOPNOTSUPP);
+static void
+est_boot_apply(void)
+{
+	struct est_cpu * ec;
 
-	/* Make sure the current setpoint is on the table */
-	for (f = p->freqtab; f->ID != 0; f++)
-		if (f->ID == ID16)
-			break;
-	if (f->ID == 0)
-		return (EOPNOTSUPP);
+	EST_FOREACH_LEADER(ec) {
+		if (ec->freq_list == NULL)
+			continue;
+		est_bind(ec->cpu);
+		mtx_lock(&est_mtx);
+		ec->boot_idx = est_boot_policy == EST_BOOT_FAST ? 0 :
+		    ec->nstates - 1;
+		ec->want = ec->boot_idx;
+		if (est_apply_limits(ec, EST_TC_BOOT) != 0)
+			ec->want = ec->boot_idx = -1;
+		mtx_unlock(&est_mtx);
+		est_unbind();
+	}
+}
 
-	/* Print status message and enable EST */
-	printf("Enhanced Speedstep running at %d MHz.\n", f->MHz);
-	freq_list = p->freqtab;
+static void
+est_boot_handover(void * arg)
+{
+	struct est_cpu * ec;
 
-	/*
-	 * Generate est_frequencies string, which lists the frequencies
-	 * supported in increasing order.  Our tables are in the opposite
-	 * order (duh!) so read the table backwards.
-	 */
-	est_frequencies[0] = 0;
-	for (f = freq_list; f->ID != 0; f++);
-	for (f--;; f--) {
-		if (est_frequencies[0] == 0)
-			sprintf(freq, "%d", f->MHz);
-		else
-			sprintf(freq, " %d", f->MHz);
-		strcat(est_frequencies, freq);
-		if (f == freq_list)
-			break;
+	mtx_lock(&est_mtx);
+	if (!est_boot_pending || est_cpus == NULL) {
+		mtx_unlock(&est_mtx);
+		return;
 	}
+	est_boot_pending = 0;
+	mtx_unlock(&est_mtx);
 
-	return 0;
+	EST_FOREACH_LEADER(ec) {
+		if (ec->freq_list == NULL)
+			continue;
+		est_bind(ec->cpu);
+		mtx_lock(&est_mtx);
+		if (ec->boot_idx >= 0) {
+			ec->want = est_id_index(ec, ec->load_status & 0xffff);
+			(void)est_apply_limits(ec, EST_TC_BOOT);
+			ec->boot_idx = -1;
+		}
+		mtx_unlock(&est_mtx);
+		est_unbind();
+	}
+
+	mtx_lock(&est_mtx);
+	if (est_gov_enable)
+		est_gov_start();
+	mtx_unlock(&est_mtx);
 }
 
 static int
 est_loader(struct module *m, int what, void *arg)
 {
-	uint64_t msr;
+	struct est_cpu * ec;
+	struct taskqueue * tq;
+	char * vendor;
+#ifndef EST_SIM
 	u_int p[4];
-	int ncpu, ncpulen;
+#endif
 	int err = 0;
 
 	switch (what) {
 	case MOD_LOAD:
-		/*
-		 * Work out how many cpus we have.  We don't support
-		 * Enhanced Speedstep on SMP systems.  Fortunately, no
-		 * such systems exist yet.  (When they exist, I'll write
-		 * the code for them, m'kay?)
-		 */
-		ncpulen = sizeof(ncpu);
-#if __FreeBSD_version >= 502000
-		ncpu = mp_ncpus;
-#elif __FreeBSD_version >= 500023
-		err = kernel_sysctlbyname(curthread, "hw.ncpu", &ncpu,
-		    &ncpulen, NULL, 0, NULL);
+		callout_init_mtx(&est_tsc_callout, &est_mtx, 0);
+#ifdef EST_SIM
+		est_sim_init();
+		vendor = GenuineIntel;
+		est_therm_supported = 1;
 #else
-		err = kernel_sysctlbyname(curproc, "hw.ncpu", &ncpu,
-		    &ncpulen, NULL, 0, NULL);
-#endif
-		if (err)
-			break;
-		if (ncpu != 1) {
-			printf("Enhanced SpeedStep not supported "
-			    "with more than one processor.\n");
-			break;
-		}
+		vendor = cpu_vendor;
 
 		/* Check that CPUID is supported */
 		if (cpu_high == 0) {
@@ -799,21 +4748,153 @@ est_loader(struct module *m, int what, void *arg)
 			    "on this processor.\n");
 			break;
 		}
+		est_therm_supported = (p[3] & CPUID_TM) != 0;
+#endif /* !EST_SIM */
 
-		/* Identify the exact CPU model */
-		msr = rdmsr(MSR_PERF_STATUS);
-		if (findcpu(cpu_vendor, msr, 100) != 0) {
-			printf("Processor claims to support "
-			    "Enhanced Speedstep, but is not recognized.\n"
-			    "Please update driver or contact "
-			    "the maintainer.\n"
-			    "cpu_vendor = %12s msr = %0llx, BUSCLK = %x.\n",
-			    cpu_vendor, (unsigned long long)msr, 100);
+		/*
+		 * Everything reads the frequency from the state page, so
+		 * we can't do without it.
+		 */
+		if (est_shared_init() != 0) {
+			printf("EST: no memory for the state page.\n");
+			err = ENOMEM;
 			break;
 		}
+		est_cpus = malloc((mp_maxid + 1) * sizeof(*est_cpus), M_EST,
+		    M_WAITOK | M_ZERO);
+		if (est_attach_cpus(vendor) == 0) {
+			free(est_cpus, M_EST);
+			est_cpus = NULL;
+			contigfree(est_shared_buf, est_shared_size, M_EST);
+			est_shared_buf = NULL;
+			break;
+		}
+		TASK_INIT(&est_async_task, 0, est_async_run, NULL);
+		est_tq = taskqueue_create("est", M_WAITOK,
+		    taskqueue_thread_enqueue, &est_tq);
+		taskqueue_start_threads(&est_tq, 1, PWAIT, "est taskq");
+		est_add_sysctls();
+		est_pm_children(1);
+		est_qos_dev = make_dev(&est_qos_cdevsw, 0, UID_ROOT, GID_WHEEL,
+		    0600, "est");
+		est_trace_dev = make_dev(&est_trace_cdevsw, 0, UID_ROOT,
+		    GID_WHEEL, 0400, "est_trace");
+		est_shared_dev = make_dev(&est_shared_cdevsw, 0, UID_ROOT,
+		    GID_WHEEL, 0444, "est_state");
+
+		/* Apply any table overrides from loader.conf */
+		if (est_override[0] != '\0' || est_firmware[0] != '\0' ||
+		    est_fine_enable)
+			(void)est_apply_overrides();
+
+		if (est_calib_enable)
+			est_calibrate_all();
 
+		/*
+		 * Start the governor if it was enabled from loader.conf,
+		 * unless the boot policy holds the CPUs until mountroot.
+		 */
+		est_boot_pending = cold && est_boot_policy != EST_BOOT_LEAVE;
+		mtx_lock(&est_mtx);
+		EST_FOREACH_LEADER(ec)
+			est_shared_update(ec, 0);
+		est_shared_start();
+		est_tsc_start();
+		if (est_gov_enable && !est_boot_pending)
+			est_gov_start();
+		if (est_therm_enable)
+			est_therm_start();
+		mtx_unlock(&est_mtx);
+		est_profile_update();
+		est_profile_tag = EVENTHANDLER_REGISTER(power_profile_change,
+		    est_profile_event, NULL, EVENTHANDLER_PRI_ANY);
+		if (est_boot_pending) {
+			est_boot_apply();
+			est_boot_tag = EVENTHANDLER_REGISTER(mountroot,
+			    est_boot_handover, NULL, EVENTHANDLER_PRI_ANY);
+		}
 		break;
 	case MOD_UNLOAD:
+		if (est_cpus == NULL)
+			break;
+		/* Closes out every QoS request. */
+		if (est_qos_dev != NULL)
+			destroy_dev(est_qos_dev);
+		est_qos_dev = NULL;
+		if (est_trace_dev != NULL)
+			destroy_dev(est_trace_dev);
+		est_trace_dev = NULL;
+		if (est_shared_dev != NULL)
+			destroy_dev(est_shared_dev);
+		est_shared_dev = NULL;
+
+		if (est_boot_tag != NULL)
+			EVENTHANDLER_DEREGISTER(mountroot, est_boot_tag);
+		est_boot_tag = NULL;
+		est_boot_pending = 0;
+		if (est_profile_tag != NULL)
+			EVENTHANDLER_DEREGISTER(power_profile_change,
+			    est_profile_tag);
+		est_profile_tag = NULL;
+
+		mtx_lock(&est_mtx);
+		est_gov_enable = 0;
+		callout_stop(&est_tsc_callout);
+		EST_FOREACH(ec)
+			callout_stop(&ec->shared_callout);
+		mtx_unlock(&est_mtx);
+		callout_drain(&est_tsc_callout);
+		EST_FOREACH(ec) {
+			callout_drain(&ec->gov_callout);
+			callout_drain(&ec->qos_callout);
+			callout_drain(&ec->therm_callout);
+			callout_drain(&ec->shared_callout);
+		}
+		/* Applies whatever is still queued. */
+		mtx_lock(&est_mtx);
+		tq = est_tq;
+		est_tq = NULL;
+		mtx_unlock(&est_mtx);
+		taskqueue_free(tq);
+
+		/* Don't leave a replacement table's voltages behind. */
+		est_override[0] = '\0';
+		est_firmware[0] = '\0';
+		est_fine_enable = 0;
+		(void)est_apply_overrides();
+
+		est_pm_children(0);
+		EST_FOREACH(ec)
+			sysctl_ctx_free(&ec->sysctl_ctx);
+		mtx_lock(&est_mtx);
+		ec = est_cpus;
+		est_cpus = NULL;
+		mtx_unlock(&est_mtx);
+		free(ec, M_EST);
+
+		/*
+		 * destroy_dev() doesn't revoke mappings, so once the rings
+		 * have been mapped a tracer may still be reading them:
+		 * leave them allocated rather than let their pages be
+		 * reused under it.
+		 */
+		if (est_trace_buf != NULL && est_trace_mapped)
+			printf("EST: leaving the %zu bytes of /dev/est_trace "
+			    "allocated, as they may still be mapped.\n",
+			    est_trace_size);
+		else if (est_trace_buf != NULL)
+			contigfree(est_trace_buf, est_trace_size, M_EST);
+		est_trace_buf = NULL;
+		est_trace_mapped = 0;
+
+		/* The same goes for the state page. */
+		if (est_shared_mapped)
+			printf("EST: leaving /dev/est_state allocated, as it "
+			    "may still be mapped.\n");
+		else
+			contigfree(est_shared_buf, est_shared_size, M_EST);
+		est_shared_buf = NULL;
+		est_shared_mapped = 0;
 		break;
 	default:
 		err = EINVAL;
@@ -829,4 +4910,8 @@ static moduledata_t est_mod = {
 	NULL
 };
 
-DECLARE_MODULE(est, est_mod, SI_SUB_KLD, SI_ORDER_ANY);
+/*
+ * We need the APs to be running so that we can look at their MSRs,
+ * so when preloaded, wait until they have been started.
+ */
+DECLARE_MODULE(est, est_mod, SI_SUB_SMP, SI_ORDER_ANY);
@@ -0,0 +1,155 @@
+/*-
+ * Binary interface of the est_PM driver.
+ *
+ * hw.est.table returns an array of struct est_pstate, one per
+ * setpoint, fastest first.  hw.est.snapshot (and dev.cpu.N.est_snapshot
+ * for a given CPU) returns a struct est_snapshot, all of which was
+ * read at the same instant.  Check es_version and es_size before
+ * using a snapshot; fields will only ever be appended.
+ *
+ * /dev/est takes minimum frequency requests: EST_QOS_SET keeps every
+ * CPU at eq_mhz or faster for eq_ms milliseconds (0: until the file
+ * is closed), replacing any earlier request made through the same
+ * file, and EST_QOS_CLEAR withdraws it.
+ *
+ * /dev/est_trace is the transition trace: mmap it read-only and find a
+ * struct est_trace_header at the start, followed at eth_ring_offset by
+ * one ring per CPU, eth_ring_size bytes apart.  etr_head counts the
+ * events ever written to a ring; event n is etr_ev[n % eth_nentries].
+ * Read etr_head (with acquire semantics), copy the events you want,
+ * then read etr_head again: events more than eth_nentries - 1 behind
+ * it may have been overwritten while you copied them.  Events are
+ * only recorded while the device is open.
+ *
+ * /dev/est_state holds the current setpoint of every CPU: mmap it
+ * read-only and find a struct est_state_header at the start, followed
+ * at esh_cpu_offset by one struct est_state_cpu per CPU, esh_cpu_size
+ * bytes apart.  esc_seq is odd while an entry is being updated, and
+ * goes up by two with every update: read it (with acquire semantics),
+ * copy the entry, then read it again, and retry if it was odd or has
+ * changed.  While esc_state is EST_SS_SWITCHING, the entry still
+ * describes the setpoint the CPU is leaving.
+ */
+
+#ifndef _EST_PM_H_
+#define	_EST_PM_H_
+
+#include <sys/types.h>
+#include <sys/ioccom.h>
+
+#define	EST_ABI_VERSION		1
+#define	EST_ABI_MAXSTATES	32
+
+struct est_pstate {
+	uint16_t	ep_mhz;
+	uint16_t	ep_mv;		/* decoded from the VID */
+	uint16_t	ep_id;		/* MSR_PERF_CTL value: ratio << 8 | VID */
+	uint16_t	ep_flags;
+};
+
+#define	EST_PS_CURRENT	0x0001		/* the CPU is running at it */
+
+struct est_snapshot {
+	uint32_t	es_version;	/* EST_ABI_VERSION */
+	uint32_t	es_size;	/* sizeof(struct est_snapshot) */
+	uint32_t	es_cpu;
+	uint32_t	es_domain;	/* first CPU sharing our setpoint */
+	uint32_t	es_nstates;
+	uint32_t	es_cur;		/* index into es_table */
+	uint32_t	es_count;	/* transitions */
+	uint32_t	es_slow;	/* as hw.est.slow, retried and failed */
+	uint32_t	es_retried;
+	uint32_t	es_failed;
+	uint64_t	es_uptime;	/* when this was taken, us */
+	uint64_t	es_residency[EST_ABI_MAXSTATES];	/* us */
+	struct est_pstate es_table[EST_ABI_MAXSTATES];
+	uint32_t	es_power[EST_ABI_MAXSTATES];	/* estimated, mW */
+	uint64_t	es_energy[EST_ABI_MAXSTATES];	/* estimated, uJ */
+};
+
+struct est_qos_request {
+	uint32_t	eq_mhz;
+	uint32_t	eq_ms;		/* 0: until closed */
+};
+
+#define	EST_QOS_SET	_IOW('E', 1, struct est_qos_request)
+#define	EST_QOS_CLEAR	_IO('E', 2)
+
+#define	EST_TRACE_MAGIC		0x54545345	/* "ESTT" */
+#define	EST_TRACE_VERSION	1
+
+struct est_trace_header {
+	uint32_t	eth_magic;
+	uint32_t	eth_version;
+	uint32_t	eth_ncpu;	/* rings */
+	uint32_t	eth_nentries;	/* events per ring, a power of 2 */
+	uint32_t	eth_ring_offset;
+	uint32_t	eth_ring_size;
+};
+
+/* Why a transition happened: et_cause. */
+#define	EST_TC_USER	1		/* hw.est_curfreq etc., cpufreq(4) */
+#define	EST_TC_GOVERNOR	2
+#define	EST_TC_THERMAL	3
+#define	EST_TC_QOS	4		/* a /dev/est request came or went */
+#define	EST_TC_TSC	5		/* the TSC drift fallback */
+#define	EST_TC_TABLE	6		/* a new setpoint table */
+#define	EST_TC_EXTERNAL	7		/* someone else wrote MSR_PERF_CTL */
+#define	EST_TC_CALIBRATE 8		/* hw.est.calib.enable at load */
+#define	EST_TC_RESUME	9		/* restored after a suspend */
+#define	EST_TC_BOOT	10		/* hw.est.boot_policy */
+#define	EST_TC_PROFILE	11		/* the power profile changed */
+
+struct est_trace_event {
+	uint64_t	et_time;	/* uptime, ns */
+	uint32_t	et_settle;	/* us, or EST_TRACE_UNKNOWN */
+	uint16_t	et_from;	/* PERF IDs */
+	uint16_t	et_to;
+	uint16_t	et_cpu;		/* domain */
+	uint8_t		et_cause;
+	uint8_t		et_flags;
+	uint32_t	et_spare[3];
+};
+
+#define	EST_TRACE_UNKNOWN	0xffffffff
+#define	EST_TF_FAILED		0x01	/* et_to is where it got stuck */
+
+struct est_trace_ring {
+	volatile uint32_t etr_head;
+	uint32_t	etr_spare[15];
+	struct est_trace_event etr_ev[];
+};
+
+#define	EST_STATE_MAGIC		0x53545345	/* "ESTS" */
+#define	EST_STATE_VERSION	1
+
+struct est_state_header {
+	uint32_t	esh_magic;
+	uint32_t	esh_version;
+	uint32_t	esh_ncpu;
+	uint32_t	esh_cpu_offset;
+	uint32_t	esh_cpu_size;
+	uint32_t	esh_spare[3];
+};
+
+struct est_state_cpu {
+	volatile uint32_t esc_seq;
+	uint32_t	esc_domain;	/* first CPU sharing our setpoint */
+	uint32_t	esc_mhz;	/* 0: EST is off on this CPU */
+	uint16_t	esc_id;		/* PERF ID */
+	uint16_t	esc_index;	/* into hw.est.table */
+	uint32_t	esc_nstates;
+	uint32_t	esc_count;	/* transitions, as es_count */
+	uint32_t	esc_state;	/* EST_SS_* */
+	uint32_t	esc_spare0;
+	uint64_t	esc_since;	/* uptime when we got there, us */
+	uint64_t	esc_verified;	/* uptime of the last MSR check, us */
+	uint32_t	esc_spare[4];
+};
+
+/* What the domain of a CPU is doing: esc_state. */
+#define	EST_SS_OFF		0	/* EST is off; only esc_seq is valid */
+#define	EST_SS_IDLE		1
+#define	EST_SS_SWITCHING	2	/* a transition is under way */
+
+#endif /* !_EST_PM_H_ */
@@ -0,0 +1,197 @@
+#!/usr/bin/awk -f
+#
+# Generate estprocs.h from estprocs.
+#
+# Every operating point is packed into the 16-bit value the processor
+# uses in MSR_PERF_CTL/MSR_PERF_STATUS (bus ratio << 8 | VID), and all
+# tables share one est_pstates[] array; the driver only expands the
+# table of the processor it finds.  Processors are located through a
+# perfect hash of (vendor, MSR_PERF_STATUS[63:32], BUSCLK):
+#
+#	slot = ((ID % 65521) * EST_PHASH_SEED % 65521 + BUSCLK + vendor)
+#	    % 65521 % EST_PHASH_SIZE
+#
+# where vendor is an index into est_vendors[].  The seed is searched
+# for here, so that no two processors share a slot.  EST_MAX_STATES
+# is the size of the largest table the driver may build from one of
+# ours, which has a setpoint for every ratio between its ends.
+#
+# Usage: awk -f estprocs2h.awk estprocs > estprocs.h
+#
+
+function err(msg) {
+	printf("%s:%d: %s\n", FILENAME, FNR, msg) > "/dev/stderr"
+	failed = 1
+	exit 1
+}
+
+# Bus clocks quoted as 133 or 166 MHz are really 133 1/3 and 166 2/3.
+function ratio_mhz(ratio, busclk,	khz) {
+	khz = busclk * 1000
+	if (busclk % 100 == 33)
+		khz += 333
+	else if (busclk % 100 == 66)
+		khz += 667
+	return int((ratio * khz + 500) / 1000)
+}
+
+function id16(mhz, mv, busclk,	ratio, vid) {
+	ratio = int(mhz / busclk)
+	if (ratio < 1 || ratio > 255)
+		err("bus ratio out of range")
+	if (ratio_mhz(ratio, busclk) != mhz)
+		err(mhz " MHz is not a multiple of the " busclk " MHz bus clock")
+	vid = 0
+	if (mv != 0) {
+		if (mv < 700 || mv > 700 + 16 * 255)
+			err("voltage out of range")
+		vid = int((mv - 700) / 16)
+	}
+	return ratio * 256 + vid
+}
+
+function phash(id, busclk, vendor, seed) {
+	return (((id % 65521) * seed % 65521 + busclk + vendor) % 65521) % \
+	    phash_size
+}
+
+BEGIN {
+	nprocs = 0
+	nstates = 0
+	nvendors = 0
+	maxstates = 0
+	failed = 0
+}
+
+/^[ \t]*#/ || /^[ \t]*$/ {
+	next
+}
+
+$1 == "cpu" {
+	if (NF < 5)
+		err("usage: cpu <name> <vendor> <BUSCLK> <description>")
+	if ($2 in procidx)
+		err("duplicate table " $2)
+	if (nprocs > 0 && count[nprocs - 1] == 0)
+		err("table " name[nprocs - 1] " has no states")
+	if (!($3 in vendoridx)) {
+		vendoridx[$3] = nvendors
+		vendors[nvendors++] = $3
+	}
+	procidx[$2] = nprocs
+	name[nprocs] = $2
+	vendor[nprocs] = vendoridx[$3]
+	busclk[nprocs] = $4 + 0
+	desc[nprocs] = $5
+	for (i = 6; i <= NF; i++)
+		desc[nprocs] = desc[nprocs] " " $i
+	first[nprocs] = nstates
+	count[nprocs] = 0
+	nprocs++
+	next
+}
+
+$1 == "state" {
+	if (nprocs == 0)
+		err("state outside of a cpu table")
+	if (NF != 3)
+		err("usage: state <MHz> <mV>")
+	p = nprocs - 1
+	if (count[p] > 0 && $2 + 0 >= mhz[nstates - 1])
+		err("states must be listed fastest first")
+	mhz[nstates] = $2 + 0
+	mv[nstates] = $3 + 0
+	state[nstates] = id16($2 + 0, $3 + 0, busclk[p])
+	nstates++
+	if (++count[p] > maxstates)
+		maxstates = count[p]
+	next
+}
+
+{
+	err("unknown keyword " $1)
+}
+
+END {
+	if (failed)
+		exit 1
+	if (nprocs == 0 || count[nprocs - 1] == 0)
+		err("no complete cpu tables")
+	if (nprocs > 254)
+		err("too many cpu tables for an 8-bit hash index")
+
+	# The ID reported in MSR_PERF_STATUS[63:32] is made of the
+	# lowest (high word) and highest (low word) operating points.
+	for (p = 0; p < nprocs; p++) {
+		lo = first[p] + count[p] - 1
+		id[p] = state[lo] * 65536 + state[first[p]]
+
+		# Leave room for every ratio in between (hw.est.fine).
+		span = int(state[first[p]] / 256) - int(state[lo] / 256) + 1
+		if (span > maxstates)
+			maxstates = span
+		key = vendor[p] SUBSEP id[p] SUBSEP busclk[p]
+		if (key in seen)
+			err("tables " seen[key] " and " name[p] \
+			    " are indistinguishable")
+		seen[key] = name[p]
+	}
+
+	for (phash_size = 1; phash_size < 2 * nprocs; phash_size *= 2)
+		;
+	for (;;) {
+		for (seed = 1; seed < 65521; seed++) {
+			split("", used)
+			for (p = 0; p < nprocs; p++) {
+				h = phash(id[p], busclk[p], vendor[p], seed)
+				if (h in used)
+					break
+				used[h] = p
+			}
+			if (p == nprocs)
+				break
+		}
+		if (seed < 65521)
+			break
+		phash_size *= 2
+	}
+
+	printf("/*\n * THIS FILE IS AUTOMATICALLY GENERATED.  DO NOT EDIT.\n")
+	printf(" *\n * Generated from estprocs by estprocs2h.awk.\n */\n\n")
+	printf("#define\tEST_NPROCS\t\t%d\n", nprocs)
+	printf("#define\tEST_MAX_STATES\t\t%d\n", maxstates)
+	printf("#define\tEST_PHASH_SEED\t\t%d\n", seed)
+	printf("#define\tEST_PHASH_SIZE\t\t%d\n\n", phash_size)
+
+	printf("static const char *est_vendors[] = {\n")
+	for (v = 0; v < nvendors; v++)
+		printf("\t\"%s\",\n", vendors[v])
+	printf("};\n\n")
+
+	printf("static const uint16_t est_pstates[] = {\n")
+	for (p = 0; p < nprocs; p++) {
+		printf("\t/* %s: %s */\n\t", name[p], desc[p])
+		for (i = 0; i < count[p]; i++) {
+			s = first[p] + i
+			printf("0x%04x,%s", state[s],
+			    i == count[p] - 1 ? "\n" : " ")
+		}
+	}
+	printf("};\n\n")
+
+	printf("static const est_proc est_procs[EST_NPROCS] = {\n")
+	for (p = 0; p < nprocs; p++)
+		printf("\t{ \"%s\", 0x%08x, %d, %d, %d, %d },\n", name[p],
+		    id[p], busclk[p], vendor[p], first[p], count[p])
+	printf("};\n\n")
+
+	for (h = 0; h < phash_size; h++)
+		slot[h] = 0
+	for (p = 0; p < nprocs; p++)
+		slot[phash(id[p], busclk[p], vendor[p], seed)] = p + 1
+	printf("/* est_procs[] index + 1, or 0 for an empty slot */\n")
+	printf("static const uint8_t est_phash[EST_PHASH_SIZE] = {")
+	for (h = 0; h < phash_size; h++)
+		printf("%s%3d,", h % 12 == 0 ? "\n\t" : " ", slot[h])
+	printf("\n};\n")
+}
@@ -0,0 +1,550 @@
+/*-
+ * Microbenchmarks for est_PM.c, built against the userland kernel shim
+ * with the simulated processor backend (EST_SIM).
+ *
+ * Usage: est_bench [-c cpus] [-k cores] [-m model] [-n iterations]
+ *            [-t threads]
+ *
+ * -m selects the simulated processor by est_procs name or index, -c
+ * and -k give the number of CPUs and the cores per package.  Every
+ * result is the mean over the given number of iterations, in ns.  -t
+ * runs the stress test instead of the benchmarks, with that many
+ * threads reading and writing the frequency at once.
+ */
+
+#include "../est_PM.c"
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+static int bench_iters = 100000;
+
+static uint64_t
+bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static void
+bench_report(const char *name, uint64_t start, int n)
+{
+
+	kshim_quiet = 0;
+	printf("%-32s %10d %12.1f\n", name, n,
+	    (double)(bench_ns() - start) / n);
+}
+
+static int
+bench_get(const char *name)
+{
+	size_t len;
+	int val;
+
+	len = sizeof(val);
+	if (kshim_sysctlbyname(name, &val, &len, NULL, 0) != 0)
+		return (-1);
+	return (val);
+}
+
+static int
+bench_set(const char *name, int val)
+{
+
+	return (kshim_sysctlbyname(name, NULL, NULL, &val, sizeof(val)));
+}
+
+/* Identify every processor in est_procs in turn. */
+static void
+bench_findcpu(void)
+{
+	struct est_cpu *ec;
+	const est_proc *p;
+	uint64_t start, msr;
+	int i;
+
+	ec = calloc(1, sizeof(*ec));
+	start = bench_ns();
+	for (i = 0; i < bench_iters; i++) {
+		p = &est_procs[i % EST_NPROCS];
+		if (est_lookup(GenuineIntel, p->ID, p->BUSCLK) != p)
+			abort();
+	}
+	bench_report("est_lookup", start, bench_iters);
+
+	kshim_quiet = 1;
+	start = bench_ns();
+	for (i = 0; i < bench_iters; i++) {
+		p = &est_procs[i % EST_NPROCS];
+		msr = (uint64_t)p->ID << 32 | est_pstates[p->first];
+		if (findcpu(ec, GenuineIntel, msr, p->BUSCLK) != 0)
+			abort();
+	}
+	bench_report("findcpu", start, bench_iters);
+	(free)(ec);
+}
+
+static void
+bench_sysctl(void)
+{
+	struct est_snapshot es;
+	char buf[256];
+	uint64_t start;
+	size_t len;
+	int i;
+
+	start = bench_ns();
+	for (i = 0; i < bench_iters; i++)
+		bench_get("hw.est_curfreq");
+	bench_report("read hw.est_curfreq", start, bench_iters);
+
+	start = bench_ns();
+	for (i = 0; i < bench_iters; i++)
+		bench_get("hw.est.pstate");
+	bench_report("read hw.est.pstate", start, bench_iters);
+
+	start = bench_ns();
+	for (i = 0; i < bench_iters; i++) {
+		len = sizeof(buf);
+		kshim_sysctlbyname("hw.est_freqs", buf, &len, NULL, 0);
+	}
+	bench_report("read hw.est_freqs", start, bench_iters);
+
+	start = bench_ns();
+	for (i = 0; i < bench_iters; i++) {
+		len = sizeof(buf);
+		kshim_sysctlbyname("hw.est.stats.residency", buf, &len,
+		    NULL, 0);
+	}
+	bench_report("read hw.est.stats.residency", start, bench_iters);
+
+	start = bench_ns();
+	for (i = 0; i < bench_iters; i++) {
+		len = sizeof(buf);
+		kshim_sysctlbyname("hw.est.stats.energy", buf, &len, NULL, 0);
+	}
+	bench_report("read hw.est.stats.energy", start, bench_iters);
+
+	start = bench_ns();
+	for (i = 0; i < bench_iters; i++) {
+		len = sizeof(es);
+		kshim_sysctlbyname("hw.est.snapshot", &es, &len, NULL, 0);
+	}
+	bench_report("read hw.est.snapshot", start, bench_iters);
+
+	start = bench_ns();
+	for (i = 0; i < bench_iters; i++)
+		bench_set("hw.est_curfreq", bench_get("hw.est_curfreq"));
+	bench_report("write hw.est_curfreq (no-op)", start, bench_iters);
+}
+
+/* Bounce between the fastest and slowest setpoints. */
+static void
+bench_transitions(int settle)
+{
+	char name[64];
+	uint64_t start;
+	int i, slowest;
+
+	slowest = EST_CPU(0)->nstates - 1;
+	bench_set("hw.est.sim.settle", settle);
+	start = bench_ns();
+	for (i = 0; i < bench_iters; i++)
+		if (bench_set("hw.est.pstate", i & 1 ? 0 : slowest) != 0)
+			abort();
+	snprintf(name, sizeof(name), "transition (settle %d%s)", settle,
+	    est_trace_consumers > 0 ? ", traced" : "");
+	bench_report(name, start, bench_iters);
+	bench_set("hw.est.sim.settle", 0);
+}
+
+/* The same, with a reader holding /dev/est_trace open. */
+static void
+bench_traced(void)
+{
+	struct kshim_file *fp;
+
+	if ((fp = kshim_open("est_trace", FREAD)) == NULL)
+		abort();
+	bench_transitions(0);
+	kshim_close(fp);
+}
+
+/* Read CPU 0's frequency from /dev/est_state, as a reader would. */
+static void
+bench_shared(void)
+{
+	const struct est_state_header *esh;
+	const struct est_state_cpu *esc;
+	struct kshim_file *fp;
+	uint64_t start, sum;
+	uint32_t seq;
+	int i;
+
+	if ((fp = kshim_open("est_state", FREAD)) == NULL ||
+	    (esh = kshim_mmap(fp, PAGE_SIZE)) == NULL)
+		abort();
+	esc = (const struct est_state_cpu *)((const char *)esh +
+	    esh->esh_cpu_offset);
+	sum = 0;
+	start = bench_ns();
+	for (i = 0; i < bench_iters; i++) {
+		do {
+			seq = atomic_load_acq_32(&esc->esc_seq);
+			sum += esc->esc_mhz;
+			atomic_thread_fence_acq();
+		} while ((seq & 1) != 0 || seq != esc->esc_seq);
+	}
+	bench_report("read /dev/est_state", start, bench_iters);
+	if (sum == 0)
+		abort();
+	kshim_close(fp);
+}
+
+/*
+ * Asynchronous writes: the cost of queueing one, and of a burst of
+ * eight followed by a wait, which pays for a single transition.
+ */
+static void
+bench_async(void)
+{
+	uint64_t start;
+	int i, j, slowest;
+
+	slowest = EST_CPU(0)->nstates - 1;
+	bench_set("hw.est.async.enable", 1);
+	start = bench_ns();
+	for (i = 0; i < bench_iters; i++)
+		if (bench_set("hw.est.pstate", i & 1 ? 0 : slowest) != 0)
+			abort();
+	bench_report("async write", start, bench_iters);
+	bench_get("hw.est.async.wait");
+
+	start = bench_ns();
+	for (i = 0; i < bench_iters; i++) {
+		for (j = 0; j < 8; j++)
+			bench_set("hw.est.pstate", (i + j) & 1 ? 0 : slowest);
+		bench_get("hw.est.async.wait");
+	}
+	bench_report("async burst of 8 + wait", start, bench_iters);
+	bench_set("hw.est.async.enable", 0);
+}
+
+/* Run the governor callout with a load that keeps it moving. */
+static void
+bench_governor(void)
+{
+	uint64_t start;
+	int i;
+
+	bench_set("hw.est.governor.period", 10);
+	bench_set("hw.est.governor.hysteresis", 1);
+	bench_set("hw.est.governor.enable", 1);
+	start = bench_ns();
+	for (i = 0; i < bench_iters; i++) {
+		bench_set("hw.est.sim.demand", i & 1 ? 100 : 5000);
+		kshim_advance(est_gov_ticks());
+	}
+	bench_report("governor tick", start, bench_iters);
+	bench_set("hw.est.governor.enable", 0);
+}
+
+/* Raise and drop a minimum frequency request through /dev/est. */
+static void
+bench_qos(void)
+{
+	struct est_qos_request eq;
+	struct kshim_file *fp;
+	uint64_t start;
+	int i;
+
+	if ((fp = kshim_open("est", FREAD | FWRITE)) == NULL)
+		abort();
+	bench_set("hw.est.pstate", EST_CPU(0)->nstates - 1);
+	eq.eq_mhz = EST_CPU(0)->freq_list[0].MHz;
+	eq.eq_ms = 0;
+	start = bench_ns();
+	for (i = 0; i < bench_iters; i++)
+		if (kshim_ioctl(fp, i & 1 ? EST_QOS_CLEAR : EST_QOS_SET,
+		    &eq) != 0)
+			abort();
+	bench_report("QoS request set/clear", start, bench_iters);
+	kshim_close(fp);
+}
+
+/*
+ * The stress test.  Half the threads read hw.est_curfreq,
+ * dev.cpu.N.est_freq, hw.est.pstate and /dev/est_state, and half
+ * write the first three, while the main thread keeps the governor
+ * busy and switches between the built-in and fine-grained tables,
+ * until every thread has done its iterations.  Each frequency read
+ * must be one the CPU can run at, and each state page entry must agree
+ * with itself; the test fails if either ever isn't so, or if a write
+ * fails other than by asking for a setpoint the current table lacks or
+ * by timing out (as it will with -k greater than -c, since the cores
+ * we don't have never let the package slow down).
+ */
+struct stress_thread {
+	pthread_t	td;
+	int		id;
+	int		ncpus;
+	int		reader;
+	uint32_t	seed;
+	u_int		nbad;
+};
+
+static int stress_mhz[256];		/* by bus ratio, every table */
+static const struct est_state_header *stress_esh;
+static volatile u_int stress_running;
+
+static int
+stress_valid(int MHz)
+{
+	int r;
+
+	for (r = 0; r < 256; r++)
+		if (stress_mhz[r] != 0 && stress_mhz[r] == MHz)
+			return (1);
+	return (0);
+}
+
+static uint32_t
+stress_random(struct stress_thread *st)
+{
+
+	st->seed ^= st->seed << 13;
+	st->seed ^= st->seed >> 17;
+	st->seed ^= st->seed << 5;
+	return (st->seed);
+}
+
+static void
+stress_read(struct stress_thread *st, int cpu)
+{
+	const struct est_state_cpu *esc;
+	struct est_state_cpu copy;
+	char name[64];
+	uint32_t seq;
+	int val;
+
+	if (!stress_valid(bench_get("hw.est_curfreq")))
+		st->nbad++;
+	snprintf(name, sizeof(name), "dev.cpu.%d.est_freq", cpu);
+	if (!stress_valid(bench_get(name)))
+		st->nbad++;
+	val = bench_get("hw.est.pstate");
+	if (val < 0 || val >= EST_MAX_STATES)
+		st->nbad++;
+
+	esc = (const struct est_state_cpu *)((const char *)stress_esh +
+	    stress_esh->esh_cpu_offset + cpu * stress_esh->esh_cpu_size);
+	do {
+		seq = atomic_load_acq_32(&esc->esc_seq);
+		memcpy(&copy, (const void *)esc, sizeof(copy));
+		atomic_thread_fence_acq();
+	} while ((seq & 1) != 0 || seq != esc->esc_seq);
+	if (copy.esc_state == EST_SS_OFF ||
+	    stress_mhz[copy.esc_id >> 8] != (int)copy.esc_mhz ||
+	    copy.esc_index >= copy.esc_nstates)
+		st->nbad++;
+}
+
+static void
+stress_write(struct stress_thread *st, int cpu)
+{
+	char name[64];
+	int err, r;
+
+	do
+		r = stress_random(st) % 256;
+	while (stress_mhz[r] == 0);
+	switch (stress_random(st) % 3) {
+	case 0:
+		err = bench_set("hw.est.pstate",
+		    stress_random(st) % EST_MAX_STATES);
+		break;
+	case 1:
+		err = bench_set("hw.est_curfreq", stress_mhz[r]);
+		break;
+	default:
+		snprintf(name, sizeof(name), "dev.cpu.%d.est_freq", cpu);
+		err = bench_set(name, stress_mhz[r]);
+		break;
+	}
+	if (err != 0 && err != EINVAL && err != EOPNOTSUPP &&
+	    err != ETIMEDOUT)
+		st->nbad++;
+}
+
+static void *
+stress_main(void *arg)
+{
+	struct stress_thread *st;
+	int i;
+
+	st = arg;
+	for (i = 0; i < bench_iters; i++) {
+		if (st->reader)
+			stress_read(st, (st->id + i) % st->ncpus);
+		else
+			stress_write(st, (st->id + i) % st->ncpus);
+	}
+	atomic_subtract_int(&stress_running, 1);
+	return (NULL);
+}
+
+static int
+bench_stress(int nthreads, int ncpus)
+{
+	freq_info tab[EST_MAX_STATES + 1];
+	struct stress_thread *st;
+	struct kshim_file *fp;
+	uint64_t start;
+	u_int nbad;
+	int i, nticks;
+
+	bcopy(EST_CPU(0)->origtab, tab, sizeof(tab));
+	(void)est_fine_table(tab, EST_CPU(0)->busclk);
+	for (i = 0; tab[i].ID != 0; i++)
+		stress_mhz[tab[i].ID >> 8] = tab[i].MHz;
+	if ((fp = kshim_open("est_state", FREAD)) == NULL ||
+	    (stress_esh = kshim_mmap(fp, PAGE_SIZE)) == NULL)
+		abort();
+
+	kshim_quiet = 1;
+	bench_set("hw.est.governor.period", 10);
+	bench_set("hw.est.governor.hysteresis", 1);
+	bench_set("hw.est.governor.enable", 1);
+	st = calloc(nthreads, sizeof(*st));
+	stress_running = nthreads;
+	start = bench_ns();
+	for (i = 0; i < nthreads; i++) {
+		st[i].id = i;
+		st[i].ncpus = ncpus;
+		st[i].reader = (i & 1) == 0;
+		st[i].seed = i + 1;
+		if (pthread_create(&st[i].td, NULL, stress_main, &st[i]) != 0)
+			abort();
+	}
+	for (nticks = 0; stress_running > 0; nticks++) {
+		if (nticks % 64 == 0)
+			bench_set("hw.est.fine.enable", nticks / 64 % 2);
+		bench_set("hw.est.sim.demand", nticks & 1 ? 100 : 5000);
+		kshim_advance(1);
+	}
+	nbad = 0;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(st[i].td, NULL);
+		nbad += st[i].nbad;
+	}
+	bench_report("stress", start, bench_iters * nthreads);
+	printf("%d threads, %d ticks, %u bad\n", nthreads, nticks, nbad);
+
+	kshim_quiet = 1;
+	bench_set("hw.est.governor.enable", 0);
+	bench_set("hw.est.fine.enable", 0);
+	(free)(st);
+	kshim_close(fp);
+	return (nbad != 0);
+}
+
+static int
+bench_model(const char *arg)
+{
+	char *end;
+	int i;
+
+	i = (int)strtol(arg, &end, 0);
+	if (*end == '\0' && i >= 0 && i < EST_NPROCS)
+		return (i);
+	for (i = 0; i < EST_NPROCS; i++)
+		if (strcmp(est_procs[i].name, arg) == 0)
+			return (i);
+	fprintf(stderr, "est_bench: unknown model %s\n", arg);
+	exit(1);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: est_bench [-c cpus] [-k cores] [-m model] "
+	    "[-n iterations]\n"
+	    "                 [-t threads]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	char buf[16];
+	int ch, model, ncpus, nthreads, bad;
+
+	model = 0;
+	ncpus = 1;
+	nthreads = 0;
+	while ((ch = getopt(argc, argv, "c:k:m:n:t:")) != -1) {
+		switch (ch) {
+		case 'c':
+			ncpus = atoi(optarg);
+			if (ncpus < 1 || ncpus > MAXCPU)
+				usage();
+			break;
+		case 'k':
+			kshim_setenv("hw.est.sim.cores", optarg);
+			break;
+		case 'm':
+			model = bench_model(optarg);
+			break;
+		case 'n':
+			bench_iters = atoi(optarg);
+			if (bench_iters < 1)
+				usage();
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads < 2)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	mp_ncpus = ncpus;
+	mp_maxid = ncpus - 1;
+	snprintf(buf, sizeof(buf), "%d", model);
+	kshim_setenv("hw.est.sim.cpu", buf);
+	kshim_quiet = 1;
+	if (kshim_load() != 0 || est_cpus == NULL) {
+		fprintf(stderr, "est_bench: driver did not attach\n");
+		return (1);
+	}
+	kshim_quiet = 0;
+
+	printf("model %s, %d cpu(s), %d setpoints\n\n", est_procs[model].name,
+	    ncpus, EST_CPU(0)->nstates);
+	printf("%-32s %10s %12s\n", "benchmark", "iterations", "ns/op");
+	if (nthreads > 0) {
+		bad = bench_stress(nthreads, ncpus);
+		kshim_quiet = 1;
+		kshim_unload();
+		return (bad);
+	}
+	bench_findcpu();
+	bench_sysctl();
+	bench_transitions(0);
+	bench_transitions(10);
+	bench_traced();
+	bench_shared();
+	bench_async();
+	bench_governor();
+	bench_qos();
+
+	kshim_quiet = 1;
+	kshim_unload();
+	return (0);
+}
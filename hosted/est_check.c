@@ -0,0 +1,1366 @@
+/*-
+ * Functional checks of est_PM.c, built against the userland kernel
+ * shim with the simulated processor backend (EST_SIM).
+ *
+ * Usage: est_check [-v] [check ...]
+ *
+ * Runs the named checks, or all of them, each in a child process of
+ * its own so that it starts from a freshly loaded driver, and prints
+ * one line per check.  -v also shows what the driver prints.  The exit
+ * status is the number of checks which failed.
+ */
+
+#include "../est_PM.c"
+
+#include <sys/wait.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+
+static int check_failed;
+
+#define	CHECK(cond) do {						\
+	if (!(cond)) {							\
+		printf("    %s:%d: %s\n", __func__, __LINE__, #cond);	\
+		check_failed = 1;					\
+	}								\
+} while (0)
+
+static int
+check_get(const char *name, int *val)
+{
+	size_t len;
+
+	len = sizeof(*val);
+	return (kshim_sysctlbyname(name, val, &len, NULL, 0));
+}
+
+/* Read an integer sysctl, or -1 if it can't be read. */
+static int
+check_val(const char *name)
+{
+	int val;
+
+	return (check_get(name, &val) == 0 ? val : -1);
+}
+
+static int
+check_set(const char *name, int val)
+{
+
+	return (kshim_sysctlbyname(name, NULL, NULL, &val, sizeof(val)));
+}
+
+static const char *
+check_str(const char *name)
+{
+	static char buf[256];
+	size_t len;
+
+	len = sizeof(buf);
+	if (kshim_sysctlbyname(name, buf, &len, NULL, 0) != 0)
+		return ("");
+	return (buf);
+}
+
+static int
+check_set_str(const char *name, const char *val)
+{
+
+	return (kshim_sysctlbyname(name, NULL, NULL, val, strlen(val) + 1));
+}
+
+static int
+check_cpu_mhz(int cpu)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "dev.cpu.%d.est_freq", cpu);
+	return (check_val(name));
+}
+
+/* Load the driver on ncpus CPUs, cores to a package, model given. */
+static void
+check_load(int ncpus, int cores, int model)
+{
+	char buf[16];
+
+	mp_ncpus = ncpus;
+	mp_maxid = ncpus - 1;
+	snprintf(buf, sizeof(buf), "%d", cores);
+	kshim_setenv("hw.est.sim.cores", buf);
+	snprintf(buf, sizeof(buf), "%d", model);
+	kshim_setenv("hw.est.sim.cpu", buf);
+	if (kshim_load() != 0 || est_cpus == NULL) {
+		printf("    the driver did not attach\n");
+		exit(1);
+	}
+}
+
+/* Read cpu's entry of the state page. */
+static void
+check_shared(int cpu, struct est_state_cpu *copy)
+{
+	const struct est_state_cpu *esc;
+	uint32_t seq;
+
+	esc = EST_SHARED_CPU(cpu);
+	do {
+		seq = atomic_load_acq_32(&esc->esc_seq);
+		memcpy(copy, (const void *)esc, sizeof(*copy));
+		atomic_thread_fence_acq();
+	} while ((seq & 1) != 0 || seq != esc->esc_seq);
+}
+
+/*
+ * MSR_PERF_STATUS reports a ratio which isn't on the table: EST is
+ * disabled on that domain, every way of reading its frequency says
+ * so, and the other domains carry on.
+ */
+static void
+check_disabled(void)
+{
+	struct est_state_cpu esc;
+	int top, val;
+
+	check_load(4, 2, 0);
+	top = EST_CPU(2)->freq_list[0].MHz;
+	CHECK(check_cpu_mhz(2) > 0);
+	est_sim_status[EST_SIM_PKG(2)] = 0x1f00 |
+	    (est_sim_status[EST_SIM_PKG(2)] & 0xff);
+	CHECK(check_set("dev.cpu.2.est_freq", top) != 0);
+	CHECK(EST_CPU(2)->freq_list == NULL);
+	CHECK(EST_CPU(3)->freq_list == NULL);
+	CHECK(check_get("dev.cpu.2.est_freq", &val) == EOPNOTSUPP);
+	CHECK(check_get("dev.cpu.3.est_freq", &val) == EOPNOTSUPP);
+	check_shared(2, &esc);
+	CHECK(esc.esc_state == EST_SS_OFF && esc.esc_mhz == 0);
+	check_shared(3, &esc);
+	CHECK(esc.esc_state == EST_SS_OFF && esc.esc_mhz == 0);
+	CHECK(check_cpu_mhz(0) > 0);
+	check_shared(0, &esc);
+	CHECK(esc.esc_state == EST_SS_IDLE);
+
+	/* The same, found by the periodic check of the page. */
+	est_sim_status[0] = 0x1f00 | (est_sim_status[0] & 0xff);
+	kshim_advance(est_shared_ticks());
+	CHECK(EST_CPU(0)->freq_list == NULL);
+	CHECK(check_get("hw.est_curfreq", &val) == EOPNOTSUPP);
+	CHECK(check_get("hw.est.pstate", &val) == EOPNOTSUPP);
+	CHECK(check_get("dev.cpu.0.freq", &val) != 0);
+	check_shared(0, &esc);
+	CHECK(esc.esc_state == EST_SS_OFF);
+}
+
+/*
+ * The trace rings record transitions while the device is open, with
+ * the time they took to settle, and outlive an unload once mapped;
+ * opening it fails cleanly if they can't be allocated.
+ */
+static void
+check_trace(void)
+{
+	const struct est_trace_header *eth;
+	const struct est_trace_ring *r;
+	struct kshim_file *fp;
+
+	check_load(1, 1, 0);
+	kshim_contig_fail = 1;
+	CHECK(kshim_open("est_trace", FREAD) == NULL && errno == ENOMEM);
+	kshim_contig_fail = 0;
+	if ((fp = kshim_open("est_trace", FREAD)) == NULL ||
+	    (eth = kshim_mmap(fp, PAGE_SIZE)) == NULL) {
+		CHECK(!"/dev/est_trace can be mapped");
+		return;
+	}
+	r = (const struct est_trace_ring *)((const char *)eth +
+	    eth->eth_ring_offset);
+	CHECK(check_set("hw.est.pstate", EST_CPU(0)->nstates - 1) == 0);
+	CHECK(r->etr_head == 1 && r->etr_ev[0].et_cause == EST_TC_USER);
+	CHECK(r->etr_ev[0].et_settle == 0);
+	/* Found there on the 4th poll, 3 hw.est.poll_us apart. */
+	CHECK(check_set("hw.est.sim.settle", 4) == 0);
+	CHECK(check_set("hw.est.pstate", 0) == 0);
+	CHECK(r->etr_head == 2 && r->etr_ev[1].et_settle ==
+	    3 * (u_int)check_val("hw.est.poll_us"));
+	CHECK(r->etr_ev[1].et_time > r->etr_ev[0].et_time);
+	kshim_close(fp);
+	kshim_unload();
+	CHECK(eth->eth_magic == EST_TRACE_MAGIC && r->etr_head == 2);
+}
+
+/*
+ * The state page follows transitions and outlives an unload once
+ * mapped; the driver refuses to load if it can't be allocated.
+ */
+static void
+check_shared_page(void)
+{
+	const struct est_state_header *esh;
+	const struct est_state_cpu *esc;
+	struct kshim_file *fp;
+	int slowest;
+
+	mp_ncpus = 1;
+	mp_maxid = 0;
+	kshim_contig_fail = 1;
+	CHECK(kshim_load() == ENOMEM && est_cpus == NULL);
+	kshim_contig_fail = 0;
+	check_load(1, 1, 0);
+	if ((fp = kshim_open("est_state", FREAD)) == NULL ||
+	    (esh = kshim_mmap(fp, PAGE_SIZE)) == NULL) {
+		CHECK(!"/dev/est_state can be mapped");
+		return;
+	}
+	esc = (const struct est_state_cpu *)((const char *)esh +
+	    esh->esh_cpu_offset);
+	CHECK(esc->esc_mhz == (uint32_t)check_val("hw.est_curfreq"));
+	slowest = EST_CPU(0)->nstates - 1;
+	CHECK(check_set("hw.est.pstate", slowest) == 0);
+	CHECK(esc->esc_index == slowest && esc->esc_state == EST_SS_IDLE &&
+	    esc->esc_mhz == EST_CPU(0)->freq_list[slowest].MHz);
+	kshim_close(fp);
+	kshim_unload();
+	CHECK(esh->esh_magic == EST_STATE_MAGIC && esc->esc_index == slowest);
+}
+
+/*
+ * Suspend and resume put back each domain's setpoint on every member,
+ * whatever the firmware left behind, and leave the caller bound where
+ * it was, as acpi_EnterSleepState() needs.
+ */
+static void
+check_suspend(void)
+{
+	struct est_cpu *ec;
+	int i, j, mhz[4];
+	uint16_t fast;
+
+	check_load(4, 2, 0);
+	ec = EST_CPU(0);
+	fast = ec->freq_list[0].ID;
+	CHECK(check_set("dev.cpu.0.est_freq",
+	    ec->freq_list[ec->nstates - 1].MHz) == 0);
+	CHECK(check_set("dev.cpu.2.est_freq",
+	    ec->freq_list[ec->nstates / 2].MHz) == 0);
+	for (i = 0; i < 4; i++)
+		mhz[i] = check_cpu_mhz(i);
+	CHECK(mhz[0] != mhz[2] && mhz[0] != ec->freq_list[0].MHz);
+
+	sched_bind(curthread, 0);
+	CHECK(kshim_suspend() == 0);
+	CHECK(sched_is_bound(curthread) && curcpu == 0);
+	for (i = 0; i < 4; i++)
+		est_sim_ctl[i] = est_sim_status[EST_SIM_PKG(i)] = fast;
+	CHECK(kshim_resume() == 0);
+	CHECK(sched_is_bound(curthread) && curcpu == 0);
+	for (i = 0; i < 4; i++) {
+		CHECK(check_cpu_mhz(i) == mhz[i]);
+		for (j = 0; j < ec->nstates; j++)
+			if (ec->freq_list[j].MHz == mhz[i])
+				break;
+		CHECK(j < ec->nstates &&
+		    est_sim_ctl[i] == ec->freq_list[j].ID);
+	}
+
+	/* An unbound caller stays unbound. */
+	sched_unbind(curthread);
+	CHECK(kshim_suspend() == 0 && kshim_resume() == 0);
+	CHECK(!sched_is_bound(curthread));
+}
+
+/* A timecounter which runs check_slow_ppm slow. */
+static int check_slow_ppm;
+
+static u_int
+check_slow_get(struct timecounter *tc)
+{
+
+	return ((u_int)((uint64_t)ticks * tc->tc_frequency *
+	    (1000000 - check_slow_ppm) / 1000000 / hz));
+}
+
+/*
+ * With the TSC as the timecounter, transitions rescale it and wind it
+ * up, but the governor may only run them if the drift it could cause
+ * over a period is within hw.est.tsc.max_drift_ppm.  The drift check
+ * times the TSC against the best other timecounter, and if they
+ * disagree stops the governor and puts everything back.
+ */
+static void
+check_tsc(void)
+{
+	static struct timecounter tsc_tc = { "TSC", 0 };
+	static struct timecounter slow_tc = { "HPET", 14318180,
+	    check_slow_get, 0xffffffff, 2000, NULL };
+	struct est_cpu *ec;
+	int fast, i, ppm, slow, windups;
+
+	tsc_tc.tc_frequency = 2100000000;
+	tsc_tc.tc_next = timecounter;
+	timecounter = &tsc_tc;
+	check_load(1, 1, 0);
+	ec = EST_CPU(0);
+	fast = ec->freq_list[0].MHz;
+	slow = ec->freq_list[ec->nstates - 1].MHz;
+	CHECK(check_val("hw.est.tsc.gov_drift_ppm") == 0);
+	windups = kshim_nwindups;
+	CHECK(check_set("hw.est.pstate", ec->nstates - 1) == 0);
+	CHECK(tsc_freq == est_tsc_base * slow / est_tsc_mhz);
+	CHECK(kshim_nwindups == windups + 1);
+
+	CHECK(check_set("hw.est.governor.period", 100) == 0);
+	CHECK(check_set("hw.est.governor.enable", 1) == 0);
+	ppm = check_val("hw.est.timeout_us") * (fast - slow) * 1000 /
+	    (slow * 100);
+	CHECK(check_val("hw.est.tsc.gov_drift_ppm") == ppm);
+	CHECK(ppm > check_val("hw.est.tsc.max_drift_ppm"));
+	CHECK(check_set("hw.est.pstate", 0) == EBUSY);
+	CHECK(check_val("hw.est.pstate") == ec->nstates - 1);
+
+	CHECK(check_set("hw.est.governor.period", 100 * ppm /
+	    check_val("hw.est.tsc.max_drift_ppm") + 1) == 0);
+	CHECK(check_val("hw.est.tsc.gov_drift_ppm") <=
+	    check_val("hw.est.tsc.max_drift_ppm"));
+	CHECK(check_set("hw.est.pstate", 0) == 0);
+	CHECK(tsc_freq == est_tsc_base * fast / est_tsc_mhz);
+	CHECK(tsc_tc.tc_frequency == est_tsc_tc_base * fast / est_tsc_mhz);
+
+	/* ACPI-fast agrees with the TSC. */
+	kshim_advance(25 * hz);
+	CHECK(check_val("hw.est.tsc.fallbacks") == 0);
+	ppm = check_val("hw.est.tsc.drift_ppm");
+	CHECK(ppm > -100 && ppm < 100);
+
+	/* The HPET, which is better, says the TSC runs 0.5% fast. */
+	check_slow_ppm = 5000;
+	slow_tc.tc_next = tsc_tc.tc_next;
+	tsc_tc.tc_next = &slow_tc;
+	for (i = 0; i < 25 * hz && est_tsc_nfallbacks == 0; i++)
+		kshim_advance(1);
+	CHECK(check_val("hw.est.tsc.fallbacks") == 1);
+	CHECK(check_val("hw.est.tsc.drift_ppm") > 4900);
+	CHECK(check_val("hw.est.governor.enable") == 0 &&
+	    !callout_pending(&ec->gov_callout));
+	CHECK(check_val("hw.est.tsc.compensate") == 0);
+	CHECK(check_cpu_mhz(0) == est_tsc_mhz && tsc_freq == est_tsc_base);
+	CHECK(tsc_tc.tc_frequency == est_tsc_tc_base);
+	CHECK(check_set("hw.est.pstate", ec->nstates - 1) == EBUSY);
+}
+
+/* Write ec's table as hw.est.override would take it, minus skip. */
+static void
+check_table_str(struct est_cpu *ec, char *buf, size_t size, int skip,
+    int dmv)
+{
+	size_t len;
+	int i;
+
+	buf[0] = '\0';
+	for (i = 0; i < ec->nstates; i++) {
+		if (i == skip)
+			continue;
+		len = strlen(buf);
+		snprintf(buf + len, size - len, "%s%d:%d", len > 0 ? " " : "",
+		    ec->freq_list[i].MHz, EST_VID_MV(ec->freq_list[i].ID) + dmv);
+	}
+}
+
+/*
+ * While the TSC forbids frequency changes, a replacement table is
+ * refused if it would move the clock, and taken if it only changes
+ * voltages.
+ */
+static void
+check_table(void)
+{
+	static struct timecounter tsc_tc = { "TSC", 0 };
+	struct est_cpu *ec;
+	char buf[EST_MAX_STATES * 10 + 1];
+	int cur, i;
+
+	tsc_tc.tc_frequency = 1700000000;
+	timecounter = &tsc_tc;
+	check_load(2, 1, 0);
+	ec = EST_CPU(0);
+	cur = check_cpu_mhz(0);
+	for (i = 0; i < ec->nstates && ec->freq_list[i].MHz != cur; i++)
+		;
+	CHECK(i < ec->nstates);
+
+	check_table_str(ec, buf, sizeof(buf), i, 0);
+	CHECK(kshim_sysctlbyname("hw.est.override", NULL, NULL, buf,
+	    strlen(buf) + 1) == EBUSY);
+	CHECK(!ec->overridden && ec->freq_list[i].MHz == cur);
+	CHECK(check_cpu_mhz(0) == cur);
+
+	check_table_str(ec, buf, sizeof(buf), -1, -16);
+	CHECK(kshim_sysctlbyname("hw.est.override", NULL, NULL, buf,
+	    strlen(buf) + 1) == 0);
+	CHECK(ec->overridden && check_cpu_mhz(0) == cur);
+	CHECK(est_sim_ctl[0] == ec->freq_list[i].ID);
+}
+
+/*
+ * Fine-grained setpoints are only tried while the TSC allows frequency
+ * changes.
+ */
+static void
+check_fine(void)
+{
+	static struct timecounter tsc_tc = { "TSC", 0 };
+	struct timecounter *tc;
+	struct est_cpu *ec;
+	int n;
+
+	tsc_tc.tc_frequency = 1700000000;
+	tc = timecounter;
+	timecounter = &tsc_tc;
+	check_load(2, 1, 0);
+	ec = EST_CPU(0);
+	n = ec->nstates;
+	CHECK(check_set("hw.est.fine.enable", 1) == EBUSY);
+	CHECK(check_val("hw.est.fine.enable") == 0);
+	CHECK(est_fine_nadded == 0 && est_fine_nrejected == 0);
+	CHECK(ec->nstates == n && est_sim_ctl[0] == ec->freq_list[0].ID);
+
+	timecounter = tc;
+	CHECK(check_set("hw.est.fine.enable", 1) == 0);
+	CHECK(est_fine_nadded > 0 && ec->nstates + EST_CPU(1)->nstates ==
+	    2 * n + (int)est_fine_nadded);
+}
+
+/*
+ * Writes to hw.est_curfreq match the table as hw.est.round says, and
+ * hw.est.pstate and hw.est.step move by index, stopping at the ends.
+ */
+static void
+check_round(void)
+{
+	struct est_cpu *ec;
+	int fast, hi, lo, n;
+
+	check_load(1, 1, 0);
+	ec = EST_CPU(0);
+	n = ec->nstates;
+	fast = ec->freq_list[0].MHz;
+	hi = ec->freq_list[1].MHz;
+	lo = ec->freq_list[2].MHz;
+
+	CHECK(check_set("hw.est_curfreq", lo) == 0);
+	CHECK(check_val("hw.est_curfreq") == lo);
+	CHECK(check_set("hw.est_curfreq", lo + (hi - lo) / 4) != 0);
+	CHECK(check_set("hw.est_curfreq", fast + 100) != 0);
+	CHECK(check_val("hw.est_curfreq") == lo);
+
+	CHECK(check_set("hw.est.round", EST_ROUND_NEAREST) == 0);
+	CHECK(check_set("hw.est_curfreq", hi - (hi - lo) / 4) == 0);
+	CHECK(check_val("hw.est_curfreq") == hi);
+	CHECK(check_set("hw.est_curfreq", lo + (hi - lo) / 4) == 0);
+	CHECK(check_val("hw.est_curfreq") == lo);
+	CHECK(check_set("hw.est_curfreq", fast + 100) == 0);
+	CHECK(check_val("hw.est_curfreq") == fast);
+
+	/* Far beyond the table, where MHz * 1000 no longer fits an int. */
+	CHECK(check_set("hw.est_curfreq", lo) == 0);
+	CHECK(check_set("hw.est_curfreq", 3000000) == 0);
+	CHECK(check_val("hw.est_curfreq") == fast);
+	CHECK(check_set("hw.est_curfreq", lo) == 0);
+	CHECK(check_set("hw.est_curfreq", INT_MAX) == 0);
+	CHECK(check_val("hw.est_curfreq") == fast);
+	CHECK(check_set("hw.est.profile.performance.max_mhz", INT_MAX) == 0);
+	CHECK(check_set("hw.est.profile.performance.min_mhz", 3000000) == 0);
+	CHECK(check_val("hw.est_curfreq") == fast);
+	CHECK(check_set("hw.est.profile.performance.min_mhz", 0) == 0);
+
+	CHECK(check_set("hw.est.round", EST_ROUND_DOWN) == 0);
+	CHECK(check_set("hw.est_curfreq", hi - 1) == 0);
+	CHECK(check_val("hw.est_curfreq") == lo);
+	CHECK(check_set("hw.est.round", EST_ROUND_UP) == 0);
+	CHECK(check_set("hw.est_curfreq", lo + 1) == 0);
+	CHECK(check_val("hw.est_curfreq") == hi);
+
+	CHECK(check_set("hw.est.pstate", n - 1) == 0);
+	CHECK(check_val("hw.est_curfreq") == ec->freq_list[n - 1].MHz);
+	CHECK(check_set("hw.est.pstate", n) != 0);
+	CHECK(check_set("hw.est.step", 1) == 0);
+	CHECK(check_val("hw.est.pstate") == n - 2);
+	CHECK(check_set("hw.est.step", n) == 0);
+	CHECK(check_val("hw.est.pstate") == 0);
+	CHECK(check_set("hw.est.step", -2) == 0);
+	CHECK(check_val("hw.est.pstate") == 2);
+}
+
+/*
+ * A processor missing from estprocs is left alone unless
+ * hw.est.synthesize is set; then the package gets a table spanning the
+ * range it reports, without the setpoints it won't confirm, and runs
+ * at full speed.  Not while the TSC is the timecounter, though.
+ */
+static void
+check_synth(void)
+{
+	static struct timecounter tsc_tc = { "TSC", 0 };
+	struct est_cpu *ec;
+	char buf[16];
+	int i;
+
+	/* 2.1 GHz at VID 0x31 down to 600 MHz at VID 0x11. */
+	snprintf(buf, sizeof(buf), "%u", 0x06111531U);
+	kshim_setenv("hw.est.sim.id", buf);
+	mp_ncpus = 2;
+	mp_maxid = 1;
+	kshim_setenv("hw.est.sim.cores", "2");
+	CHECK(kshim_load() != 0 || est_cpus == NULL ||
+	    EST_CPU(0)->freq_list == NULL);
+	kshim_unload();
+
+	kshim_setenv("hw.est.synthesize", "1");
+	kshim_setenv("hw.est.sim.reject", "13");
+	check_load(2, 2, 0);
+	ec = EST_CPU(0);
+	CHECK(ec->synth_id == 0x06111531U && EST_CPU(1)->leader == 0);
+	CHECK(ec->freq_list[0].ID == 0x1531 &&
+	    ec->freq_list[ec->nstates - 1].ID == 0x0611);
+	/* Ratios 21, 19, ... 7 and 6, less 13. */
+	CHECK(ec->nstates == 8);
+	for (i = 1; i < ec->nstates; i++) {
+		CHECK((ec->freq_list[i].ID >> 8) != 13);
+		CHECK(ec->freq_list[i].MHz < ec->freq_list[i - 1].MHz);
+		CHECK((ec->freq_list[i].ID & 0xff) <=
+		    (ec->freq_list[i - 1].ID & 0xff));
+	}
+	CHECK(check_cpu_mhz(0) == ec->freq_list[0].MHz);
+	CHECK(check_cpu_mhz(1) == ec->freq_list[0].MHz);
+	for (i = ec->nstates - 1; i >= 0; i--) {
+		CHECK(check_set("hw.est.pstate", i) == 0);
+		CHECK(check_cpu_mhz(1) == ec->freq_list[i].MHz);
+	}
+	kshim_unload();
+
+	/* Not if trying the setpoints would upset the TSC timecounter. */
+	tsc_tc.tc_frequency = 1500000000;
+	timecounter = &tsc_tc;
+	mp_ncpus = 2;
+	mp_maxid = 1;
+	CHECK(kshim_load() != 0 || est_cpus == NULL ||
+	    EST_CPU(0)->freq_list == NULL);
+}
+
+/*
+ * The bus clock comes from MSR_FSB_FREQ where there is one, and from
+ * tsc_freq and the boot ratio otherwise.  Nothing in estprocs matches
+ * a processor off a 100 MHz bus, so it gets a synthesized table with
+ * setpoints on that bus by default, and none with hw.est.synthesize=0.
+ */
+static void
+check_busclk(void)
+{
+	struct est_cpu *ec;
+	int i;
+
+	/* 333 MHz is in MSR_FSB_FREQ's codes but not tsc_freq's guesses. */
+	kshim_setenv("hw.est.sim.busclk", "333");
+	kshim_setenv("hw.est.sim.fsb", "1");
+	check_load(1, 1, 0);
+	CHECK(check_val("hw.est.busclk") == 333);
+	kshim_unload();
+	/* The shim keeps what was detected across loads. */
+	kshim_setenv("hw.est.busclk", "0");
+	kshim_setenv("hw.est.sim.fsb", "0");
+	check_load(1, 1, 0);
+	CHECK(check_val("hw.est.busclk") == 100);
+	kshim_unload();
+
+	/* Model 0's 400 MT/s table doesn't fit the same part at 533. */
+	kshim_setenv("hw.est.busclk", "0");
+	kshim_setenv("hw.est.sim.busclk", "133");
+	check_load(1, 1, 0);
+	ec = EST_CPU(0);
+	CHECK(check_val("hw.est.busclk") == 133);
+	CHECK(ec->synth_id == est_procs[0].ID && ec->busclk == 133);
+	CHECK(ec->freq_list[0].MHz == 2267 && check_cpu_mhz(0) == 2267);
+	for (i = 0; i < ec->nstates; i++)
+		CHECK(ec->freq_list[i].MHz ==
+		    ((ec->freq_list[i].ID >> 8) * 400 + 1) / 3);
+	CHECK(check_set("hw.est.pstate", ec->nstates - 1) == 0);
+	CHECK(check_cpu_mhz(0) == 800);
+	kshim_unload();
+
+	kshim_setenv("hw.est.busclk", "0");
+	kshim_setenv("hw.est.synthesize", "0");
+	mp_ncpus = 1;
+	mp_maxid = 0;
+	CHECK(kshim_load() != 0 || est_cpus == NULL ||
+	    EST_CPU(0)->freq_list == NULL);
+}
+
+/*
+ * Minimum frequency requests hold every domain at or above the highest
+ * of them, and what was asked for otherwise comes back once they are
+ * cleared, closed or timed out.
+ */
+static void
+check_qos(void)
+{
+	struct est_qos_request eq;
+	struct est_cpu *ec;
+	struct kshim_file *fp, *fp1, *fp2;
+	int slow;
+
+	check_load(4, 2, 0);
+	ec = EST_CPU(0);
+	slow = ec->freq_list[ec->nstates - 1].MHz;
+	CHECK(check_set("hw.est.pstate", ec->nstates - 1) == 0);
+	if ((fp1 = kshim_open("est", FREAD | FWRITE)) == NULL ||
+	    (fp2 = kshim_open("est", FREAD | FWRITE)) == NULL) {
+		CHECK(!"/dev/est can be opened");
+		return;
+	}
+
+	/* Rounded up to a setpoint, on every domain. */
+	eq.eq_mhz = ec->freq_list[3].MHz + 1;
+	eq.eq_ms = 0;
+	if ((fp = kshim_open("est", FREAD)) != NULL) {
+		CHECK(kshim_ioctl(fp, EST_QOS_SET, &eq) != 0);
+		kshim_close(fp);
+	}
+	CHECK(kshim_ioctl(fp1, EST_QOS_SET, &eq) == 0);
+	CHECK(check_cpu_mhz(0) == ec->freq_list[2].MHz);
+	CHECK(check_cpu_mhz(2) == ec->freq_list[2].MHz);
+	CHECK(check_set("hw.est_curfreq", slow) == 0);
+	CHECK(check_cpu_mhz(0) == ec->freq_list[2].MHz);
+
+	eq.eq_mhz = ec->freq_list[1].MHz;
+	eq.eq_ms = 100;
+	CHECK(kshim_ioctl(fp2, EST_QOS_SET, &eq) == 0);
+	CHECK(check_val("hw.est.qos.requests") == 2);
+	CHECK(check_val("hw.est.qos.min_mhz") == ec->freq_list[1].MHz);
+	CHECK(check_cpu_mhz(2) == ec->freq_list[1].MHz);
+	kshim_advance(hz / 5);
+	CHECK(check_val("hw.est.qos.expired") == 1);
+	CHECK(check_cpu_mhz(2) == ec->freq_list[2].MHz);
+
+	/* The highest wins whichever order they were made in. */
+	eq.eq_ms = 0;
+	CHECK(kshim_ioctl(fp2, EST_QOS_SET, &eq) == 0);
+	CHECK(check_cpu_mhz(0) == ec->freq_list[1].MHz);
+	CHECK(kshim_ioctl(fp1, EST_QOS_CLEAR, NULL) == 0);
+	eq.eq_mhz = ec->freq_list[3].MHz;
+	CHECK(kshim_ioctl(fp1, EST_QOS_SET, &eq) == 0);
+	CHECK(check_val("hw.est.qos.min_mhz") == ec->freq_list[1].MHz);
+	CHECK(check_cpu_mhz(0) == ec->freq_list[1].MHz);
+
+	CHECK(kshim_ioctl(fp1, EST_QOS_CLEAR, NULL) == 0);
+	kshim_close(fp2);
+	CHECK(check_val("hw.est.qos.requests") == 0);
+	CHECK(check_val("hw.est.qos.min_mhz") == 0);
+	CHECK(check_cpu_mhz(0) == slow && check_cpu_mhz(2) == slow);
+	kshim_close(fp1);
+}
+
+/*
+ * Thermal stepping is off by default; once enabled, a package running
+ * too hot gets a ceiling below its fastest setpoint, which stays until
+ * it has cooled down.
+ */
+static void
+check_thermal(void)
+{
+	struct est_cpu *ec;
+	int fast;
+
+	kshim_setenv("hw.est.sim.heat", "70");
+	check_load(1, 1, 10);
+	ec = EST_CPU(0);
+	fast = ec->freq_list[0].MHz;
+	CHECK(check_val("hw.est.thermal.enable") == 0);
+	kshim_advance(3 * hz);
+	CHECK(check_val("hw.est.thermal.stepdowns") == 0);
+	CHECK(check_cpu_mhz(0) == fast);
+
+	CHECK(check_set("hw.est.thermal.enable", 1) == 0);
+	kshim_advance(3 * hz);
+	CHECK(check_val("hw.est.thermal.stepdowns") > 0);
+	CHECK(check_val("hw.est.thermal.ceiling") < fast);
+	CHECK(check_set("hw.est_curfreq", fast) == 0);
+	CHECK(check_cpu_mhz(0) <= check_val("hw.est.thermal.ceiling"));
+
+	CHECK(check_set("hw.est.sim.heat", 40) == 0);
+	kshim_advance(10 * hz);
+	CHECK(check_val("hw.est.thermal.ceiling") == fast);
+	CHECK(check_cpu_mhz(0) == fast);
+}
+
+static int check_async_locks;
+
+/* Queue hw.est.pstate 4 as the async task takes est_mtx a third time. */
+static void
+check_async_hook(struct mtx *m)
+{
+
+	if (m == &est_mtx && ++check_async_locks == 3) {
+		kshim_mtx_hook = NULL;
+		CHECK(check_set("hw.est.pstate", 4) == 0);
+	}
+}
+
+/*
+ * Queued writes are checked at once, applied later with one transition
+ * per domain for the latest value, even if it comes in while the task
+ * runs, and replaced by a synchronous write.
+ */
+static void
+check_async(void)
+{
+	struct est_cpu *ec0, *ec2;
+	uint32_t n0, n2;
+
+	check_load(4, 2, 0);
+	ec0 = EST_CPU(0);
+	ec2 = EST_CPU(2);
+	n0 = ec0->stats.count;
+	n2 = ec2->stats.count;
+	CHECK(check_set("hw.est.async.enable", 1) == 0);
+	CHECK(check_set("hw.est.pstate", 1) == 0);
+	CHECK(check_set("hw.est.pstate", 3) == 0);
+	CHECK(check_set("dev.cpu.2.est_freq", ec2->freq_list[2].MHz) == 0);
+	CHECK(check_set("hw.est_curfreq", ec0->freq_list[0].MHz + 1) != 0);
+	CHECK(check_val("hw.est.async.requested") == 5);
+	CHECK(check_val("hw.est.async.coalesced") == 3);
+	CHECK(check_cpu_mhz(0) == ec0->freq_list[0].MHz);
+
+	kshim_taskqueue_run();
+	CHECK(check_val("hw.est.async.completed") == 5);
+	CHECK(check_val("hw.est.async.error") == 0);
+	CHECK(check_cpu_mhz(0) == ec0->freq_list[3].MHz);
+	CHECK(check_cpu_mhz(2) == ec2->freq_list[2].MHz);
+	CHECK(ec0->stats.count == n0 + 1 && ec2->stats.count == n2 + 1);
+
+	CHECK(check_set("hw.est.pstate", ec0->nstates - 1) == 0);
+	CHECK(check_set("hw.est.async.enable", 0) == 0);
+	CHECK(check_set("hw.est.pstate", 1) == 0);
+	kshim_taskqueue_run();
+	CHECK(check_cpu_mhz(0) == ec0->freq_list[1].MHz);
+	CHECK(check_cpu_mhz(2) == ec2->freq_list[1].MHz);
+	CHECK(check_val("hw.est.async.completed") ==
+	    check_val("hw.est.async.requested"));
+
+	/* Nor does the task lose a write made while it runs. */
+	CHECK(check_set("hw.est.async.enable", 1) == 0);
+	CHECK(check_set("hw.est.pstate", 2) == 0);
+	check_async_locks = 0;
+	kshim_mtx_hook = check_async_hook;
+	kshim_taskqueue_run();
+	CHECK(check_async_locks >= 3);
+	CHECK(check_cpu_mhz(0) == ec0->freq_list[4].MHz);
+	CHECK(check_cpu_mhz(2) == ec2->freq_list[4].MHz);
+	CHECK(check_val("hw.est.async.completed") ==
+	    check_val("hw.est.async.requested"));
+}
+
+/*
+ * Calibration measures every setpoint of every domain, flags the one
+ * which runs a ratio low and leaves the domains where they were; it
+ * doesn't run with the TSC as the timecounter.
+ */
+static void
+check_calib(void)
+{
+	static struct timecounter tsc_tc = { "TSC", 0 };
+	struct est_cpu *ec;
+	char buf[16];
+	int i, mhz, start;
+
+	/* Find the table and where the CPUs start first. */
+	check_load(4, 2, 0);
+	start = check_cpu_mhz(0);
+	snprintf(buf, sizeof(buf), "%d", EST_CPU(0)->freq_list[2].ID >> 8);
+	kshim_unload();
+
+	kshim_setenv("hw.est.calib.enable", "1");
+	kshim_setenv("hw.est.sim.misratio", buf);
+	check_load(4, 2, 0);
+	CHECK(check_val("hw.est.calib.flagged") == 2);
+	CHECK(check_cpu_mhz(0) == start && check_cpu_mhz(2) == start);
+	EST_FOREACH_LEADER(ec) {
+		CHECK(ec->calibrated);
+		for (i = 0; i < ec->nstates; i++) {
+			mhz = ec->freq_list[i].MHz;
+			if (i == 2)
+				CHECK(ec->calib[i].flags == EST_CAL_MHZ &&
+				    ec->calib[i].mhz < (uint32_t)mhz);
+			else
+				CHECK(ec->calib[i].flags == 0 &&
+				    ec->calib[i].mhz * 100 >= (uint32_t)mhz *
+				    (100 - est_calib_tolerance) &&
+				    ec->calib[i].mhz * 100 <= (uint32_t)mhz *
+				    (100 + est_calib_tolerance));
+		}
+	}
+	kshim_unload();
+
+	tsc_tc.tc_frequency = 1700000000;
+	timecounter = &tsc_tc;
+	check_load(1, 1, 0);
+	CHECK(!EST_CPU(0)->calibrated);
+}
+
+/*
+ * Loaded at boot, hw.est.boot_policy holds every domain at its slowest
+ * setpoint until mountroot, which puts back those nobody set since;
+ * loaded later, the policy doesn't apply.
+ */
+static void
+check_boot(void)
+{
+	struct est_cpu *ec;
+	int slow, start;
+
+	kshim_setenv("hw.est.boot_policy", "2");
+	check_load(4, 2, 0);
+	start = check_cpu_mhz(0);
+	CHECK(check_val("hw.est.boot_pending") == 0);
+	kshim_unload();
+
+	cold = 1;
+	check_load(4, 2, 0);
+	ec = EST_CPU(0);
+	slow = ec->freq_list[ec->nstates - 1].MHz;
+	CHECK(check_val("hw.est.boot_pending") == 1);
+	CHECK(check_cpu_mhz(0) == slow && check_cpu_mhz(2) == slow);
+	CHECK(check_set("dev.cpu.2.est_freq", ec->freq_list[1].MHz) == 0);
+
+	cold = 0;
+	kshim_eventhandler_invoke("mountroot");
+	CHECK(check_val("hw.est.boot_pending") == 0);
+	CHECK(check_cpu_mhz(0) == start && check_cpu_mhz(1) == start);
+	CHECK(check_cpu_mhz(2) == ec->freq_list[1].MHz);
+}
+
+/*
+ * Going onto battery switches to the economy profile, whose range
+ * bounds every domain and whose thresholds the governor takes up;
+ * hw.est.profile.override pins a profile whatever the power source.
+ */
+static void
+check_profile(void)
+{
+	struct est_qos_request eq;
+	struct kshim_file *fp;
+	int top;
+
+	kshim_setenv("hw.est.profile.economy.max_mhz", "1000");
+	check_load(4, 2, 10);
+	top = EST_CPU(0)->freq_list[0].MHz;
+	CHECK(strcmp(check_str("hw.est.profile.active"), "performance") == 0);
+	CHECK(check_cpu_mhz(0) == top && check_cpu_mhz(2) == top);
+
+	power_profile_set_state(POWER_PROFILE_ECONOMY);
+	CHECK(strcmp(check_str("hw.est.profile.active"), "economy") == 0);
+	CHECK(check_val("hw.est.profile.switches") == 1);
+	CHECK(check_cpu_mhz(0) <= 1000 && check_cpu_mhz(2) <= 1000);
+	CHECK(check_val("hw.est.governor.up_threshold") == 95);
+	CHECK(check_set("hw.est.pstate", 0) == 0);
+	CHECK(check_cpu_mhz(0) <= 1000 && check_cpu_mhz(2) <= 1000);
+
+	/* Minimum frequency requests may go above the range. */
+	if ((fp = kshim_open("est", FREAD | FWRITE)) != NULL) {
+		eq.eq_mhz = top;
+		eq.eq_ms = 0;
+		CHECK(kshim_ioctl(fp, EST_QOS_SET, &eq) == 0);
+		CHECK(check_cpu_mhz(0) == top);
+		kshim_close(fp);
+	}
+	CHECK(check_cpu_mhz(0) <= 1000);
+
+	CHECK(check_set_str("hw.est.profile.override", "bogus") == EINVAL);
+	CHECK(check_set_str("hw.est.profile.override", "performance") == 0);
+	CHECK(check_val("hw.est.governor.up_threshold") == 80);
+	CHECK(check_set("hw.est.pstate", 0) == 0);
+	CHECK(check_cpu_mhz(0) == top && check_cpu_mhz(2) == top);
+	power_profile_set_state(POWER_PROFILE_PERFORMANCE);
+	power_profile_set_state(POWER_PROFILE_ECONOMY);
+	CHECK(strcmp(check_str("hw.est.profile.active"), "performance") == 0);
+	CHECK(check_set_str("hw.est.profile.override", "") == 0);
+	CHECK(strcmp(check_str("hw.est.profile.active"), "economy") == 0);
+	CHECK(check_cpu_mhz(0) <= 1000 && check_cpu_mhz(2) <= 1000);
+
+	power_profile_set_state(POWER_PROFILE_PERFORMANCE);
+	CHECK(check_set("hw.est.pstate", 0) == 0);
+	CHECK(check_cpu_mhz(0) == top && check_cpu_mhz(2) == top);
+}
+
+/*
+ * The governor jumps to full speed above the up threshold, holds
+ * between the thresholds, and only slows down after hysteresis quiet
+ * samples, to the slowest setpoint which keeps the load under the up
+ * threshold.  Bad thresholds are refused.
+ */
+static void
+check_gov(void)
+{
+	struct est_gov_params gp = { 100, 80, 30, 3 };
+	struct est_cpu *ec;
+	freq_info *tab;
+	int i, n, quiet;
+
+	check_load(2, 2, 0);
+	ec = EST_CPU(0);
+	tab = ec->freq_list;
+	n = ec->nstates;
+
+	quiet = 2;
+	CHECK(est_gov_select(&gp, tab, n - 1, 90, &quiet) == 0 && quiet == 0);
+	quiet = 2;
+	CHECK(est_gov_select(&gp, tab, 2, 50, &quiet) == 2 && quiet == 0);
+	for (i = 1; i < gp.hysteresis; i++)
+		CHECK(est_gov_select(&gp, tab, 0, 20, &quiet) == 0 &&
+		    quiet == i);
+	CHECK(est_gov_select(&gp, tab, 0, 20, &quiet) == n - 1 && quiet == 0);
+	/* 1700 MHz at 29% is 493 MHz of work, 616 MHz's worth at 80%. */
+	gp.hysteresis = 1;
+	i = est_gov_select(&gp, tab, 0, 29, &quiet);
+	CHECK(tab[i].MHz >= tab[0].MHz * 29 / gp.up &&
+	    tab[i + 1].MHz < tab[0].MHz * 29 / gp.up);
+	CHECK(est_gov_select(&gp, tab, n - 1, 0, &quiet) == n - 1);
+
+	CHECK(check_set("hw.est.governor.period", 9) == EINVAL);
+	CHECK(check_set("hw.est.governor.up_threshold", 101) == EINVAL);
+	CHECK(check_set("hw.est.governor.down_threshold", -1) == EINVAL);
+	CHECK(check_set("hw.est.governor.down_threshold", 80) == EINVAL);
+	CHECK(check_set("hw.est.governor.hysteresis", 0) == EINVAL);
+	CHECK(check_val("hw.est.governor.period") == 100 &&
+	    check_val("hw.est.governor.down_threshold") == 30);
+
+	/* 1600 MHz of work swamps 600 MHz: one period to full speed. */
+	CHECK(check_set("hw.est.pstate", n - 1) == 0);
+	CHECK(check_set("hw.est.sim.demand", 1600) == 0);
+	CHECK(check_set("hw.est.governor.enable", 1) == 0);
+	kshim_advance(100);
+	CHECK(check_cpu_mhz(0) == tab[0].MHz && check_cpu_mhz(1) ==
+	    tab[0].MHz);
+	/* Each core keeps its own sample. */
+	CHECK(EST_CPU(1)->gov_cp_time[CP_USER] != 0 &&
+	    EST_CPU(1)->gov_cp_time[CP_USER] == est_sim_cp[1][CP_USER]);
+
+	/* 100 MHz of work: three quiet periods, then the slowest. */
+	CHECK(check_set("hw.est.sim.demand", 100) == 0);
+	kshim_advance(200);
+	CHECK(check_cpu_mhz(0) == tab[0].MHz);
+	kshim_advance(100);
+	CHECK(check_cpu_mhz(0) == tab[n - 1].MHz);
+	CHECK(check_cpu_mhz(1) == tab[n - 1].MHz);
+}
+
+/*
+ * Check that hw.est.stats.residency reads ms[i] ms for each setpoint i
+ * of ec, give or take the 1 ms lost to rounding uptime.
+ */
+static int
+check_residency(struct est_cpu *ec, const int *ms)
+{
+	const char *p;
+	int i, MHz, n, val;
+
+	p = check_str("hw.est.stats.residency");
+	for (i = ec->nstates - 1; i >= 0; i--) {
+		if (sscanf(p, "%d:%d%n", &MHz, &val, &n) != 2 ||
+		    MHz != ec->freq_list[i].MHz || val < ms[i] - 1 ||
+		    val > ms[i])
+			return (0);
+		p += n;
+	}
+	return (*p == '\0');
+}
+
+/* The transition matrix hw.est.stats.transitions should read. */
+static const char *
+check_transitions(struct est_cpu *ec, int from, int to)
+{
+	static char want[256];
+	size_t len;
+	int i, j;
+
+	want[0] = '\0';
+	for (i = ec->nstates - 1; i >= 0; i--) {
+		len = strlen(want);
+		snprintf(want + len, sizeof(want) - len, "\n%5d:",
+		    ec->freq_list[i].MHz);
+		for (j = ec->nstates - 1; j >= 0; j--) {
+			len = strlen(want);
+			snprintf(want + len, sizeof(want) - len, " %d",
+			    (i == from && j == to) || (i == to && j == from));
+		}
+	}
+	return (want);
+}
+
+/*
+ * hw.est.stats.* account for the time spent at each setpoint and for
+ * every transition, and hw.est.stats.reset clears them all.
+ */
+static void
+check_stats(void)
+{
+	struct est_cpu *ec;
+	int ms[EST_MAX_STATES];
+	int n;
+
+	check_load(1, 1, 0);
+	ec = EST_CPU(0);
+	n = ec->nstates;
+
+	/* 1 s at the top, 0.5 s at the bottom, and back. */
+	kshim_advance(1000);
+	CHECK(check_set("hw.est.pstate", n - 1) == 0);
+	kshim_advance(500);
+	CHECK(check_set("hw.est.pstate", 0) == 0);
+	CHECK(check_val("hw.est.stats.count") == 2);
+	memset(ms, 0, sizeof(ms));
+	ms[0] = 1000;
+	ms[n - 1] = 500;
+	CHECK(check_residency(ec, ms));
+	CHECK(strcmp(check_str("hw.est.stats.transitions"),
+	    check_transitions(ec, 0, n - 1)) == 0);
+	/* The sim settles at once. */
+	CHECK(strncmp(check_str("hw.est.stats.latency"), "<1:2 <2:0 ", 10) ==
+	    0);
+
+	CHECK(check_set("hw.est.stats.reset", 1) == 0);
+	CHECK(check_val("hw.est.stats.count") == 0);
+	kshim_advance(300);
+	memset(ms, 0, sizeof(ms));
+	ms[0] = 300;
+	CHECK(check_residency(ec, ms));
+	CHECK(strcmp(check_str("hw.est.stats.transitions"),
+	    check_transitions(ec, -1, -1)) == 0);
+	CHECK(strncmp(check_str("hw.est.stats.latency"), "<1:0 ", 5) == 0);
+}
+
+/*
+ * hw.est.table and the snapshots keep the layout est_PM.h promises,
+ * and describe the table, the current setpoint and the statistics of
+ * the CPU asked about.
+ */
+static void
+check_abi(void)
+{
+	struct est_pstate ep[EST_ABI_MAXSTATES];
+	struct est_snapshot es;
+	struct est_cpu *ec;
+	size_t len;
+	int i, n;
+
+	/* Appending is all that may ever happen to these. */
+	CHECK(sizeof(struct est_pstate) == 8 &&
+	    offsetof(struct est_pstate, ep_id) == 4 &&
+	    offsetof(struct est_pstate, ep_flags) == 6);
+	CHECK(offsetof(struct est_snapshot, es_size) == 4 &&
+	    offsetof(struct est_snapshot, es_nstates) == 16 &&
+	    offsetof(struct est_snapshot, es_failed) == 36 &&
+	    offsetof(struct est_snapshot, es_uptime) == 40 &&
+	    offsetof(struct est_snapshot, es_residency) == 48 &&
+	    offsetof(struct est_snapshot, es_table) == 304 &&
+	    offsetof(struct est_snapshot, es_power) == 560 &&
+	    offsetof(struct est_snapshot, es_energy) == 688 &&
+	    sizeof(struct est_snapshot) == 944);
+
+	check_load(4, 2, 0);
+	ec = EST_CPU(0);
+	n = ec->nstates;
+	CHECK(check_set("dev.cpu.2.est_freq", ec->freq_list[n - 1].MHz) == 0);
+	kshim_advance(100);
+
+	len = sizeof(ep);
+	CHECK(kshim_sysctlbyname("hw.est.table", ep, &len, NULL, 0) == 0);
+	CHECK(len == n * sizeof(ep[0]));
+	for (i = 0; i < n; i++) {
+		CHECK(ep[i].ep_mhz == ec->freq_list[i].MHz &&
+		    ep[i].ep_id == ec->freq_list[i].ID &&
+		    ep[i].ep_mv == EST_VID_MV(ec->freq_list[i].ID));
+		CHECK(ep[i].ep_flags == (i == 0 ? EST_PS_CURRENT : 0));
+	}
+
+	len = sizeof(es);
+	CHECK(kshim_sysctlbyname("hw.est.snapshot", &es, &len, NULL, 0) == 0);
+	CHECK(len == sizeof(es) && es.es_version == EST_ABI_VERSION &&
+	    es.es_size == sizeof(es));
+	CHECK(es.es_cpu == 0 && es.es_domain == 0 && es.es_nstates == n &&
+	    es.es_cur == 0 && es.es_count == 0);
+	CHECK(es.es_residency[0] >= 99000 && es.es_residency[n - 1] == 0);
+	CHECK(es.es_table[0].ep_flags == EST_PS_CURRENT &&
+	    es.es_power[0] == check_val("hw.est.tdp_mw") &&
+	    es.es_energy[0] == es.es_residency[0] * es.es_power[0] / 1000);
+
+	len = sizeof(es);
+	CHECK(kshim_sysctlbyname("dev.cpu.3.est_snapshot", &es, &len, NULL,
+	    0) == 0);
+	CHECK(es.es_cpu == 3 && es.es_domain == 2 && es.es_cur == n - 1 &&
+	    es.es_count == 1);
+	CHECK(es.es_table[n - 1].ep_flags == EST_PS_CURRENT &&
+	    es.es_table[0].ep_flags == 0);
+	CHECK(es.es_residency[n - 1] >= 99000 && es.es_power[n - 1] > 0 &&
+	    es.es_power[n - 1] < es.es_power[0]);
+}
+
+/*
+ * The cpufreq(4) methods offer the table as absolute settings of the
+ * CPU's domain, and set and get them through the same paths as the
+ * sysctls; hw.est.cpufreq=0 keeps the driver out of cpufreq(4).
+ */
+static void
+check_cpufreq(void)
+{
+	static struct timecounter tsc_tc = { "TSC", 2100000000 };
+	struct cf_setting sets[MAX_SETTINGS], cf;
+	struct est_cpu *ec;
+	device_t dev;
+	char want[128];
+	size_t len;
+	int i, n, count, type;
+
+	check_load(4, 2, 0);
+	ec = EST_CPU(0);
+	n = ec->nstates;
+	dev = device_find_child(devclass_get_device(devclass_find("cpu"), 2),
+	    "est_pm", -1);
+	CHECK(dev != NULL);
+	if (dev == NULL)
+		return;
+
+	CHECK(est_pm_type(dev, &type) == 0 && type == CPUFREQ_TYPE_ABSOLUTE);
+	count = n - 1;
+	CHECK(est_pm_settings(dev, sets, &count) == E2BIG);
+	count = MAX_SETTINGS;
+	CHECK(est_pm_settings(dev, sets, &count) == 0 && count == n);
+	want[0] = '\0';
+	for (i = 0; i < count; i++) {
+		CHECK(sets[i].freq == ec->freq_list[i].MHz &&
+		    sets[i].volts == EST_VID_MV(ec->freq_list[i].ID) &&
+		    sets[i].power == est_power_mw(ec->freq_list, i) &&
+		    sets[i].lat == EST_TRANS_LAT && sets[i].dev == dev);
+		len = strlen(want);
+		snprintf(want + len, sizeof(want) - len, "%s%d/%d",
+		    i ? " " : "", sets[i].freq, sets[i].power);
+	}
+	CHECK(strcmp(check_str("dev.cpu.2.freq_levels"), want) == 0);
+
+	/* Only dev's domain moves, and only to a setting on the table. */
+	CHECK(check_set("dev.cpu.2.freq", ec->freq_list[n - 1].MHz + 1) ==
+	    EINVAL);
+	CHECK(check_set("dev.cpu.2.freq", ec->freq_list[n - 1].MHz) == 0);
+	CHECK(check_val("dev.cpu.3.freq") == ec->freq_list[n - 1].MHz);
+	CHECK(check_val("dev.cpu.0.freq") == ec->freq_list[0].MHz);
+	CHECK(check_cpu_mhz(3) == ec->freq_list[n - 1].MHz);
+	CHECK(est_pm_get(dev, &cf) == 0 && cf.freq ==
+	    ec->freq_list[n - 1].MHz && cf.dev == dev && cf.lat == 1);
+	CHECK(check_set("dev.cpu.2.freq", ec->freq_list[0].MHz) == 0);
+	CHECK(check_cpu_mhz(2) == ec->freq_list[0].MHz);
+
+	/* Two domains, so the TSC timecounter forbids changes. */
+	tsc_tc.tc_next = timecounter;
+	timecounter = &tsc_tc;
+	CHECK(check_set("dev.cpu.2.freq", ec->freq_list[1].MHz) == EBUSY);
+	timecounter = tsc_tc.tc_next;
+	kshim_unload();
+
+	kshim_setenv("hw.est.cpufreq", "0");
+	check_load(4, 2, 0);
+	CHECK(check_get("dev.cpu.2.freq", &i) == ENOENT);
+	CHECK(check_cpu_mhz(2) == EST_CPU(0)->freq_list[0].MHz);
+}
+
+/* Read a 64-bit sysctl, or UINT64_MAX if it can't be read. */
+static uint64_t
+check_val64(const char *name)
+{
+	uint64_t val;
+	size_t len;
+
+	len = sizeof(val);
+	return (kshim_sysctlbyname(name, &val, &len, NULL, 0) == 0 ?
+	    val : UINT64_MAX);
+}
+
+/*
+ * Check that the "MHz:value" list in sysctl name has val[i] for each
+ * setpoint i of ec, give or take slack.
+ */
+static int
+check_levels(struct est_cpu *ec, const char *name, const int *val,
+    int slack)
+{
+	const char *p;
+	int i, MHz, n, v;
+
+	p = check_str(name);
+	for (i = ec->nstates - 1; i >= 0; i--) {
+		if (sscanf(p, "%d:%d%n", &MHz, &v, &n) != 2 ||
+		    MHz != ec->freq_list[i].MHz || v < val[i] - slack ||
+		    v > val[i] + slack)
+			return (0);
+		p += n;
+	}
+	return (*p == '\0');
+}
+
+/*
+ * The energy counters charge each setpoint its V^2 f power, scaled to
+ * hw.est.tdp_mw at the top, for the time spent there, and are
+ * cleared with the rest of the statistics.
+ */
+static void
+check_energy(void)
+{
+	struct est_cpu *ec;
+	int mj[EST_MAX_STATES], mw[EST_MAX_STATES], eff[EST_MAX_STATES];
+	int64_t mV, mV0;
+	int i, n, tdp;
+
+	check_load(2, 1, 0);
+	ec = EST_CPU(0);
+	n = ec->nstates;
+	tdp = check_val("hw.est.tdp_mw");
+	mV0 = EST_VID_MV(ec->freq_list[0].ID);
+	for (i = 0; i < n; i++) {
+		mV = EST_VID_MV(ec->freq_list[i].ID);
+		mw[i] = (int)(tdp * mV * mV * ec->freq_list[i].MHz /
+		    (mV0 * mV0 * ec->freq_list[0].MHz));
+		eff[i] = ec->freq_list[i].MHz * 1000 / mw[i];
+		mj[i] = 0;
+	}
+	CHECK(mw[0] == tdp && mw[n - 1] < mw[0]);
+	CHECK(check_levels(ec, "hw.est.stats.power_levels", mw, 0));
+	CHECK(check_levels(ec, "hw.est.stats.efficiency", eff, 0));
+	CHECK(eff[n - 1] > eff[0]);
+
+	/* 1 s at the top and 1 s at the bottom, for CPU 0 only. */
+	kshim_advance(1000);
+	CHECK(check_set("dev.cpu.0.est_freq", ec->freq_list[n - 1].MHz) == 0);
+	kshim_advance(1000);
+	mj[0] = mw[0];
+	mj[n - 1] = mw[n - 1];
+	CHECK(check_levels(ec, "hw.est.stats.energy_levels", mj, 1));
+	CHECK(check_levels(ec, "dev.cpu.0.est_energy", mj, 1));
+	CHECK(check_val64("hw.est.stats.energy") + 1 >=
+	    (uint64_t)(mw[0] + mw[n - 1]) &&
+	    check_val64("hw.est.stats.energy") <=
+	    (uint64_t)(mw[0] + mw[n - 1]));
+	CHECK(check_val64("hw.est.stats.power") + 1 >=
+	    (uint64_t)(mw[0] + mw[n - 1]) / 2 &&
+	    check_val64("hw.est.stats.power") <=
+	    (uint64_t)(mw[0] + mw[n - 1]) / 2);
+	/* CPU 1's domain stayed at the top. */
+	mj[n - 1] = 0;
+	mj[0] = mw[0] * 2;
+	CHECK(check_levels(ec, "dev.cpu.1.est_energy", mj, 1));
+
+	/* The estimate follows hw.est.tdp_mw, for the past too. */
+	CHECK(check_set("hw.est.tdp_mw", tdp * 2) == 0);
+	CHECK(check_val64("hw.est.stats.energy") + 2 >=
+	    (uint64_t)(mw[0] + mw[n - 1]) * 2);
+
+	CHECK(check_set("hw.est.stats.reset", 1) == 0);
+	CHECK(check_val64("hw.est.stats.energy") == 0 &&
+	    check_val64("hw.est.stats.power") == 0);
+	memset(mj, 0, sizeof(mj));
+	CHECK(check_levels(ec, "hw.est.stats.energy_levels", mj, 0));
+}
+
+static const struct {
+	const char	*name;
+	void		(*fn)(void);
+} checks[] = {
+	{ "round",	check_round },
+	{ "synth",	check_synth },
+	{ "busclk",	check_busclk },
+	{ "qos",		check_qos },
+	{ "thermal",	check_thermal },
+	{ "async",	check_async },
+	{ "calib",	check_calib },
+	{ "profile",	check_profile },
+	{ "disabled",	check_disabled },
+	{ "trace",	check_trace },
+	{ "shared",	check_shared_page },
+	{ "suspend",	check_suspend },
+	{ "boot",		check_boot },
+	{ "tsc",		check_tsc },
+	{ "table",	check_table },
+	{ "fine",		check_fine },
+	{ "gov",		check_gov },
+	{ "stats",	check_stats },
+	{ "abi",		check_abi },
+	{ "cpufreq",	check_cpufreq },
+	{ "energy",	check_energy },
+};
+
+static int
+check_run(int i, int verbose)
+{
+	pid_t pid;
+	int status;
+
+	fflush(stdout);
+	if ((pid = fork()) == -1) {
+		perror("est_check: fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		kshim_quiet = !verbose;
+		checks[i].fn();
+		fflush(stdout);
+		_exit(check_failed);
+	}
+	waitpid(pid, &status, 0);
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		printf("ok   %s\n", checks[i].name);
+		return (0);
+	}
+	printf("FAIL %s\n", checks[i].name);
+	return (1);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: est_check [-v] [check ...]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch, i, j, nfailed, verbose;
+
+	verbose = 0;
+	while ((ch = getopt(argc, argv, "v")) != -1) {
+		switch (ch) {
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	nfailed = 0;
+	if (argc == 0)
+		for (i = 0; i < (int)nitems(checks); i++)
+			nfailed += check_run(i, verbose);
+	for (j = 0; j < argc; j++) {
+		for (i = 0; i < (int)nitems(checks); i++)
+			if (strcmp(argv[j], checks[i].name) == 0)
+				break;
+		if (i == (int)nitems(checks)) {
+			fprintf(stderr, "est_check: unknown check %s\n",
+			    argv[j]);
+			return (1);
+		}
+		nfailed += check_run(i, verbose);
+	}
+	return (nfailed);
+}
@@ -0,0 +1,374 @@
+/*-
+ * Offline replay of utilization traces through the governor of
+ * est_PM.c, for comparing policies without trying them on a machine.
+ *
+ * Usage: est_replay [-f] [-d seconds] [-i interval] [-m model]
+ *            [-p name=period,up,down,hysteresis] [-s settle] [-S seed]
+ *            [workload ...]
+ *
+ * A workload is a trace file or one of the canned ones (steady,
+ * bursty, interactive; all three if none is given).  A trace file has
+ * one sample per line, every -i ms (10): the percentage of the
+ * interval the CPU was busy, optionally followed by the frequency in
+ * MHz it was running at (the model's fastest if omitted); '#' starts
+ * a comment.  The CPU is an est_procs model (-m, as for est_bench),
+ * with every intermediate ratio added if -f is given.
+ *
+ * Each sample's work is offered to the simulated CPU, and whatever it
+ * can't finish at its current clock is carried over.  Every governor
+ * period, est_gov_select() picks the next setpoint from the busy time
+ * seen, exactly as est_gov_tick() would, and a transition stalls the
+ * CPU for -s us (10).  For each policy we report the energy, with the
+ * same per-setpoint power estimate as hw.est.stats.energy, the share
+ * of time work was waiting, the number of transitions and percentiles
+ * of the delay: how long the work still waiting at the end of a
+ * sample would take to finish.  Besides the -p ones, the policies are
+ * the driver's defaults, two variations on them, and the fastest and
+ * slowest setpoints held throughout.
+ *
+ * Like hw.est.stats.energy, the energy charges idle time the full
+ * dynamic power of the setpoint it is spent at, so a policy which
+ * races to idle gets no credit for it.
+ */
+
+#include "../est_PM.c"
+
+#include <unistd.h>
+
+struct replay_policy {
+	char		name[32];
+	struct est_gov_params gp;
+	int		fixed;		/* -1, or the index to stay at */
+};
+
+struct replay_load {
+	const char	*name;
+	int		*demand;	/* MHz worth of work, per sample */
+	int		n;
+};
+
+#define	REPLAY_MAXPOLICIES	16
+
+static struct replay_policy replay_policies[REPLAY_MAXPOLICIES] = {
+	{ "default",	{ 100, 80, 30, 3 },	-1 },
+	{ "responsive",	{ 50, 60, 20, 5 },	-1 },
+	{ "economy",	{ 200, 95, 50, 2 },	-1 },
+	{ "max",	{ 100, 80, 30, 3 },	0 },
+	{ "min",	{ 100, 80, 30, 3 },	EST_MAX_STATES },
+};
+static int replay_npolicies = 5;
+
+static freq_info replay_tab[EST_MAX_STATES + 1];
+static int replay_nstates;
+static int replay_interval = 10;	/* ms */
+static int replay_settle = 10;		/* us */
+static int replay_seconds = 60;
+static uint32_t replay_seed = 1;
+
+/* A small xorshift generator, so that runs can be repeated. */
+static uint32_t
+replay_random(void)
+{
+
+	replay_seed ^= replay_seed << 13;
+	replay_seed ^= replay_seed >> 17;
+	replay_seed ^= replay_seed << 5;
+	return (replay_seed);
+}
+
+static int
+replay_uniform(int lo, int hi)
+{
+
+	return (lo + (int)(replay_random() % (uint32_t)(hi - lo + 1)));
+}
+
+/*
+ * The canned workloads, in percent of the fastest setpoint: a steady
+ * 40% with a little noise; bursts of 1-3 s near full load between
+ * 1-5 s lulls; and an interactive session, nearly idle but for 20-150
+ * ms of full load every 0.2-2 s.
+ */
+static void
+replay_canned(struct replay_load *rl, const char *name)
+{
+	int i, left, level, top;
+
+	rl->name = name;
+	rl->n = replay_seconds * 1000 / replay_interval;
+	rl->demand = calloc(rl->n, sizeof(int));
+	top = replay_tab[0].MHz;
+	left = 0;
+	level = 0;
+	for (i = 0; i < rl->n; i++) {
+		if (strcmp(name, "steady") == 0)
+			level = replay_uniform(35, 45);
+		else if (strcmp(name, "bursty") == 0) {
+			if (left-- <= 0) {
+				if (level < 50) {
+					level = replay_uniform(90, 100);
+					left = replay_uniform(1000, 3000);
+				} else {
+					level = replay_uniform(5, 15);
+					left = replay_uniform(1000, 5000);
+				}
+				left /= replay_interval;
+			}
+		} else {
+			if (left-- <= 0) {
+				if (level < 50) {
+					level = 100;
+					left = replay_uniform(20, 150);
+				} else {
+					level = replay_uniform(2, 4);
+					left = replay_uniform(200, 2000);
+				}
+				left = MAX(left / replay_interval, 1);
+			}
+		}
+		rl->demand[i] = top * level / 100;
+	}
+}
+
+static int
+replay_read(struct replay_load *rl, const char *path)
+{
+	char line[256], *p, *ep;
+	FILE *fp;
+	long util, MHz;
+	int size;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return (-1);
+	rl->name = path;
+	rl->n = 0;
+	size = 1024;
+	rl->demand = (malloc)(size * sizeof(int));
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		util = strtol(line, &ep, 10);
+		if (ep == line)
+			continue;
+		MHz = strtol(ep, &p, 10);
+		if (p == ep)
+			MHz = replay_tab[0].MHz;
+		if (util < 0 || util > 100 || MHz <= 0) {
+			fprintf(stderr, "est_replay: %s: bad sample: %s",
+			    path, line);
+			exit(1);
+		}
+		if (rl->n == size) {
+			size *= 2;
+			rl->demand = realloc(rl->demand, size * sizeof(int));
+		}
+		rl->demand[rl->n++] = (int)(MHz * util / 100);
+	}
+	fclose(fp);
+	return (rl->n > 0 ? 0 : -1);
+}
+
+static int
+replay_cmp(const void *a, const void *b)
+{
+	uint32_t x, y;
+
+	x = *(const uint32_t *)a;
+	y = *(const uint32_t *)b;
+	return (x < y ? -1 : x > y);
+}
+
+/* Run rl through policy rp and print a line of results. */
+static void
+replay_run(const struct replay_load *rl, const struct replay_policy *rp)
+{
+	uint32_t *delay;
+	uint64_t energy, ms;
+	double backlog, avail, done, busy, want;
+	int cur, next, quiet, elapsed, i, under, ntrans, stall, MHz, util;
+
+	delay = calloc(rl->n, sizeof(*delay));
+	cur = rp->fixed >= 0 ? MIN(rp->fixed, replay_nstates - 1) : 0;
+	backlog = busy = 0;
+	energy = 0;
+	quiet = elapsed = under = ntrans = stall = 0;
+	for (i = 0; i < rl->n; i++) {
+		MHz = replay_tab[cur].MHz;
+
+		/* Work in MHz*ms; a transition costs settle us of it. */
+		avail = (double)MHz * replay_interval -
+		    (double)MHz * stall / 1000;
+		stall = 0;
+		want = backlog + (double)rl->demand[i] * replay_interval;
+		done = MIN(want, avail);
+		backlog = want - done;
+		if (backlog > 0.5)
+			under++;
+		else
+			backlog = 0;
+		busy += done / MHz;
+		delay[i] = (uint32_t)(backlog / MHz * 1000);	/* us */
+		/* Busy or not: see above. */
+		energy += (uint64_t)est_power_mw(replay_tab, cur) *
+		    replay_interval;
+
+		elapsed += replay_interval;
+		if (rp->fixed >= 0 || elapsed < rp->gp.period)
+			continue;
+		util = (int)(100 * busy / elapsed);
+		next = est_gov_select(&rp->gp, replay_tab, cur, util, &quiet);
+		if (next != cur) {
+			ntrans++;
+			stall = replay_settle;
+			cur = next;
+		}
+		busy = 0;
+		elapsed = 0;
+	}
+
+	qsort(delay, rl->n, sizeof(*delay), replay_cmp);
+	ms = (uint64_t)rl->n * replay_interval;
+	printf("%-12s %9.2f %8.0f %7.2f %7d %8.2f %8.2f %8.2f %8.2f\n",
+	    rp->name, energy / 1e6, (double)energy / ms,
+	    100.0 * under / rl->n, ntrans,
+	    delay[rl->n / 2] / 1000.0, delay[rl->n * 90 / 100] / 1000.0,
+	    delay[rl->n * 99 / 100] / 1000.0, delay[rl->n - 1] / 1000.0);
+	(free)(delay);
+}
+
+static void
+replay_policy(const char *arg)
+{
+	struct replay_policy *rp;
+	const char *eq;
+	size_t len;
+
+	if (replay_npolicies == REPLAY_MAXPOLICIES) {
+		fprintf(stderr, "est_replay: too many policies\n");
+		exit(1);
+	}
+	rp = &replay_policies[replay_npolicies];
+	if ((eq = strchr(arg, '=')) == NULL ||
+	    sscanf(eq + 1, "%d,%d,%d,%d", &rp->gp.period, &rp->gp.up,
+	    &rp->gp.down, &rp->gp.hysteresis) != 4 ||
+	    !est_gov_valid(&rp->gp)) {
+		fprintf(stderr, "est_replay: bad policy %s\n", arg);
+		exit(1);
+	}
+	len = MIN((size_t)(eq - arg), sizeof(rp->name) - 1);
+	memcpy(rp->name, arg, len);
+	rp->name[len] = '\0';
+	rp->fixed = -1;
+	replay_npolicies++;
+}
+
+static int
+replay_model(const char *arg)
+{
+	char *end;
+	int i;
+
+	i = (int)strtol(arg, &end, 0);
+	if (*end == '\0' && i >= 0 && i < EST_NPROCS)
+		return (i);
+	for (i = 0; i < EST_NPROCS; i++)
+		if (strcmp(est_procs[i].name, arg) == 0)
+			return (i);
+	fprintf(stderr, "est_replay: unknown model %s\n", arg);
+	exit(1);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: est_replay [-f] [-d seconds] [-i interval] "
+	    "[-m model]\n"
+	    "           [-p name=period,up,down,hysteresis] [-s settle] "
+	    "[-S seed]\n"
+	    "           [workload ...]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const char *canned[] = { "steady", "bursty", "interactive" };
+	struct replay_load rl;
+	const est_proc *p;
+	int ch, fine, i, j, model, nloads;
+
+	fine = 0;
+	model = 0;
+	while ((ch = getopt(argc, argv, "d:fi:m:p:s:S:")) != -1) {
+		switch (ch) {
+		case 'd':
+			replay_seconds = atoi(optarg);
+			if (replay_seconds < 1)
+				usage();
+			break;
+		case 'f':
+			fine = 1;
+			break;
+		case 'i':
+			replay_interval = atoi(optarg);
+			if (replay_interval < 1)
+				usage();
+			break;
+		case 'm':
+			model = replay_model(optarg);
+			break;
+		case 'p':
+			replay_policy(optarg);
+			break;
+		case 's':
+			replay_settle = atoi(optarg);
+			if (replay_settle < 0)
+				usage();
+			break;
+		case 'S':
+			replay_seed = (uint32_t)strtoul(optarg, NULL, 0);
+			if (replay_seed == 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	p = &est_procs[model];
+	est_expand(p, replay_tab);
+	if (fine)
+		(void)est_fine_table(replay_tab, p->BUSCLK);
+	for (replay_nstates = 0; replay_tab[replay_nstates].ID != 0;
+	    replay_nstates++)
+		;
+
+	nloads = argc > 0 ? argc : (int)nitems(canned);
+	printf("model %s, %d setpoints (%d-%d MHz), %d ms samples\n",
+	    p->name, replay_nstates, replay_tab[replay_nstates - 1].MHz,
+	    replay_tab[0].MHz, replay_interval);
+	for (i = 0; i < nloads; i++) {
+		if (argc == 0)
+			replay_canned(&rl, canned[i]);
+		else if (strcmp(argv[i], "steady") == 0 ||
+		    strcmp(argv[i], "bursty") == 0 ||
+		    strcmp(argv[i], "interactive") == 0)
+			replay_canned(&rl, argv[i]);
+		else if (replay_read(&rl, argv[i]) != 0) {
+			fprintf(stderr, "est_replay: cannot read %s\n",
+			    argv[i]);
+			return (1);
+		}
+		printf("\n%s: %d samples\n", rl.name, rl.n);
+		printf("%-12s %9s %8s %7s %7s %8s %8s %8s %8s\n", "policy",
+		    "energy J", "mean mW", "under %", "trans", "p50 ms",
+		    "p90 ms", "p99 ms", "max ms");
+		for (j = 0; j < replay_npolicies; j++)
+			replay_run(&rl, &replay_policies[j]);
+		(free)(rl.demand);
+	}
+	return (0);
+}
@@ -0,0 +1,2 @@
+/* Hosted build: see kshim.h. */
+#include "kshim.h"
@@ -0,0 +1,1662 @@
+/*-
+ * Userland implementation of the kernel interfaces declared in kshim.h.
+ */
+
+#include "kshim.h"
+
+#include <sys/mman.h>
+
+int kshim_quiet = 0;
+int cold = 0;
+int hz = 1000;
+volatile int ticks = 0;
+char cpu_vendor[20] = "GenuineIntel";
+u_int cpu_high = 10;
+int mp_ncpus = 1;
+u_int mp_maxid = 0;
+int smp_started = 1;
+__thread int kshim_curcpu = 0;
+static __thread int kshim_bound = 0;
+
+static struct pcpu kshim_pcpu[MAXCPU];
+
+struct kshim_device {
+	const char	*devname;
+	int		unit;
+	char		name[12];	/* sysctl node */
+	char		nameunit[16];
+	struct sysctl_oid *tree;
+	struct kshim_device *parent;
+	struct kshim_device *children;
+	struct kshim_device *sibling;
+	driver_t	*driver;
+	void		*softc;
+	int		attached;
+	struct sysctl_ctx_list cf_ctx;	/* cpufreq(4) oids, if registered */
+	device_t	cf_dev;
+};
+
+struct kshim_driver {
+	driver_t	*driver;
+	const char	*busname;
+	struct kshim_driver *next;
+};
+static struct kshim_driver *kshim_drivers;
+struct mtx Giant = { PTHREAD_MUTEX_INITIALIZER, 0, 0, "Giant" };
+static struct kshim_device kshim_cpus[MAXCPU];
+static struct sysctl_oid *kshim_dev_cpu;
+static struct sysctl_ctx_list kshim_dev_ctx;
+
+static timecounter_get_t kshim_tc_get;
+static struct timecounter kshim_tc = { "ACPI-fast", 3579545, kshim_tc_get,
+    0xffffff, 1000, NULL };
+struct timecounter *timecounter = &kshim_tc;
+uint64_t tsc_freq = 0;
+int kshim_nwindups = 0;
+
+static struct mtx kshim_callout_mtx = { PTHREAD_MUTEX_INITIALIZER, 0, 0,
+    "callout" };
+static struct callout *kshim_callouts;
+static struct sysctl_oid *kshim_oids;
+static moduledata_t *kshim_module;
+
+struct sysctl_oid sysctl__hw = { NULL, "hw", CTLTYPE_NODE, NULL, 0, NULL,
+    "N", NULL, NULL };
+struct sysctl_oid sysctl__dev = { NULL, "dev", CTLTYPE_NODE, NULL, 0, NULL,
+    "N", NULL, NULL };
+struct sysctl_oid sysctl__kern = { NULL, "kern", CTLTYPE_NODE, NULL, 0,
+    NULL, "N", NULL, NULL };
+
+struct kshim_env {
+	char		*name;
+	char		*value;
+	struct kshim_env *next;
+};
+static struct kshim_env *kshim_envs;
+
+static void
+kshim_panic(const char *fmt, const char *arg, const char *file, int line)
+{
+
+	fprintf(stderr, "panic: ");
+	fprintf(stderr, fmt, arg);
+	fprintf(stderr, " at %s:%d\n", file, line);
+	abort();
+}
+
+size_t
+kshim_strlcpy(char *dst, const char *src, size_t size)
+{
+	size_t len, n;
+
+	len = strlen(src);
+	if (size != 0) {
+		n = len < size ? len : size - 1;
+		memcpy(dst, src, n);
+		dst[n] = '\0';
+	}
+	return (len);
+}
+
+int
+kshim_printf(const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (kshim_quiet)
+		return (0);
+	va_start(ap, fmt);
+	n = vprintf(fmt, ap);
+	va_end(ap);
+	return (n);
+}
+
+int
+tsleep(void *chan, int pri, const char *wmesg, int timo)
+{
+
+	(void)chan;
+	(void)pri;
+	(void)wmesg;
+	kshim_advance(timo > 0 ? timo : 1);
+	return (timo > 0 ? EWOULDBLOCK : 0);
+}
+
+void
+wakeup(void *chan)
+{
+
+	(void)chan;
+}
+
+/*
+ * Uptime follows the virtual tick counter, plus whatever DELAY() has
+ * spun for; getbinuptime(), like the kernel's, only sees the ticks.
+ */
+static uint64_t kshim_delay_us;
+
+void
+DELAY(int usec)
+{
+
+	if (usec > 0)
+		__atomic_fetch_add(&kshim_delay_us, usec, __ATOMIC_RELAXED);
+}
+
+static uint64_t
+kshim_uptime_us(void)
+{
+
+	return ((uint64_t)ticks * 1000000 / hz +
+	    __atomic_load_n(&kshim_delay_us, __ATOMIC_RELAXED));
+}
+
+void
+getbinuptime(struct bintime *bt)
+{
+	int t;
+
+	t = ticks;
+	bt->sec = t / hz;
+	bt->frac = (uint64_t)(t % hz) * (UINT64_MAX / hz);
+}
+
+void
+binuptime(struct bintime *bt)
+{
+	uint64_t us;
+
+	/*
+	 * Rounded up in the upper 32 bits, which are all the driver
+	 * converts, so that whole microseconds convert back exactly.
+	 */
+	us = kshim_uptime_us();
+	bt->sec = us / 1000000;
+	bt->frac = ((((us % 1000000) << 32) + 999999) / 1000000) << 32;
+}
+
+void
+nanotime(struct timespec *ts)
+{
+	int t;
+
+	t = ticks;
+	ts->tv_sec = t / hz;
+	ts->tv_nsec = (long)(t % hz) * (1000000000 / hz);
+}
+
+/* Only counts the windups; the time of day isn't kept. */
+void
+tc_setclock(struct timespec *ts)
+{
+
+	(void)ts;
+	kshim_nwindups++;
+}
+
+/* The ACPI timer keeps to binuptime(). */
+static u_int
+kshim_tc_get(struct timecounter *tc)
+{
+
+	return ((u_int)(kshim_uptime_us() * tc->tc_frequency / 1000000));
+}
+
+void *
+kshim_malloc(size_t size, int flags)
+{
+	void *p;
+
+	p = (malloc)(size);
+	if (p == NULL) {
+		if (flags & M_NOWAIT)
+			return (NULL);
+		abort();
+	}
+	if (flags & M_ZERO)
+		memset(p, 0, size);
+	return (p);
+}
+
+/*
+ * contigmalloc(9) may fail even with M_WAITOK, when there is no
+ * physically contiguous run of pages to be had.
+ */
+int kshim_contig_fail = 0;
+
+void *
+kshim_contigmalloc(size_t size, int flags, size_t alignment)
+{
+	void *p;
+
+	if (kshim_contig_fail)
+		return (NULL);
+	if ((p = aligned_alloc(alignment, round_page(size))) == NULL) {
+		if (flags & M_NOWAIT)
+			return (NULL);
+		abort();
+	}
+	if (flags & M_ZERO)
+		memset(p, 0, size);
+	return (p);
+}
+
+void
+do_cpuid(u_int ax, u_int *p)
+{
+
+	(void)ax;
+	p[0] = p[1] = p[3] = 0;
+	p[2] = 0x80;
+}
+
+uint64_t
+rdmsr(u_int msr)
+{
+
+	fprintf(stderr, "rdmsr(0x%x) without EST_SIM\n", msr);
+	abort();
+}
+
+void
+wrmsr(u_int msr, uint64_t val)
+{
+
+	(void)val;
+	fprintf(stderr, "wrmsr(0x%x) without EST_SIM\n", msr);
+	abort();
+}
+
+void
+read_cpu_time(long *cp_time)
+{
+
+	memset(cp_time, 0, sizeof(long) * CPUSTATES);
+	cp_time[CP_IDLE] = ticks;
+}
+
+struct pcpu *
+pcpu_find(u_int cpuid)
+{
+
+	if (cpuid >= MAXCPU)
+		return (NULL);
+	kshim_pcpu[cpuid].pc_cpuid = cpuid;
+	return (&kshim_pcpu[cpuid]);
+}
+
+void
+sched_bind(struct thread *td, int cpu)
+{
+
+	(void)td;
+	kshim_curcpu = cpu;
+	kshim_bound = 1;
+}
+
+void
+sched_unbind(struct thread *td)
+{
+
+	(void)td;
+	kshim_curcpu = 0;
+	kshim_bound = 0;
+}
+
+int
+sched_is_bound(struct thread *td)
+{
+
+	(void)td;
+	return (kshim_bound);
+}
+
+/* Run action on each CPU in map in turn, as if it were there. */
+void
+smp_rendezvous_cpus(cpuset_t map, void (*setup)(void *),
+    void (*action)(void *), void (*teardown)(void *), void *arg)
+{
+	int cpu, saved;
+
+	saved = kshim_curcpu;
+	for (cpu = 0; cpu < MAXCPU; cpu++) {
+		if (!CPU_ISSET(cpu, &map))
+			continue;
+		kshim_curcpu = cpu;
+		if (setup != NULL)
+			setup(arg);
+		if (action != NULL)
+			action(arg);
+		if (teardown != NULL)
+			teardown(arg);
+	}
+	kshim_curcpu = saved;
+}
+
+void
+mtx_init(struct mtx *m, const char *name, const char *type, int opts)
+{
+
+	(void)type;
+	(void)opts;
+	pthread_mutex_init(&m->mtx_lock, NULL);
+	m->mtx_owned = 0;
+	m->mtx_name = name;
+}
+
+void
+mtx_destroy(struct mtx *m)
+{
+
+	pthread_mutex_destroy(&m->mtx_lock);
+}
+
+void (*kshim_mtx_hook)(struct mtx *m) = NULL;
+
+void
+mtx_lock(struct mtx *m)
+{
+
+	if (mtx_owned(m))
+		kshim_panic("recursed on non-recursive mutex %s", m->mtx_name,
+		    __FILE__, __LINE__);
+	if (kshim_mtx_hook != NULL)
+		kshim_mtx_hook(m);
+	pthread_mutex_lock(&m->mtx_lock);
+	m->mtx_owner = pthread_self();
+	m->mtx_owned = 1;
+}
+
+void
+mtx_unlock(struct mtx *m)
+{
+
+	m->mtx_owned = 0;
+	pthread_mutex_unlock(&m->mtx_lock);
+}
+
+int
+mtx_owned(struct mtx *m)
+{
+
+	return (m->mtx_owned && pthread_equal(m->mtx_owner, pthread_self()));
+}
+
+void
+kshim_mtx_assert(struct mtx *m, int what, const char *file, int line)
+{
+
+	if (what == MA_OWNED && !mtx_owned(m))
+		kshim_panic("mutex %s not owned", m->mtx_name, file, line);
+	if (what == MA_NOTOWNED && mtx_owned(m))
+		kshim_panic("mutex %s owned", m->mtx_name, file, line);
+}
+
+void
+callout_init_mtx(struct callout *c, struct mtx *m, int flags)
+{
+
+	(void)flags;
+	memset(c, 0, sizeof(*c));
+	c->c_mtx = m;
+	mtx_lock(&kshim_callout_mtx);
+	c->c_next = kshim_callouts;
+	kshim_callouts = c;
+	mtx_unlock(&kshim_callout_mtx);
+}
+
+void
+callout_reset(struct callout *c, int t, void (*func)(void *), void *arg)
+{
+
+	c->c_func = func;
+	c->c_arg = arg;
+	c->c_cpu = 0;
+	c->c_time = ticks + (t > 0 ? t : 1);
+	c->c_pending = 1;
+}
+
+void
+callout_reset_on(struct callout *c, int t, void (*func)(void *), void *arg,
+    int cpu)
+{
+
+	callout_reset(c, t, func, arg);
+	c->c_cpu = cpu;
+}
+
+int
+callout_stop(struct callout *c)
+{
+	int was;
+
+	was = c->c_pending;
+	c->c_pending = 0;
+	return (was);
+}
+
+int
+callout_drain(struct callout *c)
+{
+	struct callout **cp;
+	int was;
+
+	was = callout_stop(c);
+	mtx_lock(&kshim_callout_mtx);
+	for (cp = &kshim_callouts; *cp != NULL; cp = &(*cp)->c_next)
+		if (*cp == c) {
+			*cp = c->c_next;
+			break;
+		}
+	mtx_unlock(&kshim_callout_mtx);
+	return (was);
+}
+
+/*
+ * Advance the virtual tick counter, running every callout that comes
+ * due, with its mutex held, just as softclock would.
+ */
+void
+kshim_advance(int nticks)
+{
+	struct callout *c;
+	int fired;
+
+	while (nticks-- > 0) {
+		ticks++;
+		kshim_taskqueue_run();
+		do {
+			fired = 0;
+			mtx_lock(&kshim_callout_mtx);
+			for (c = kshim_callouts; c != NULL; c = c->c_next)
+				if (c->c_pending && c->c_time - ticks <= 0)
+					break;
+			if (c != NULL)
+				c->c_pending = 0;
+			mtx_unlock(&kshim_callout_mtx);
+			if (c != NULL) {
+				kshim_curcpu = c->c_cpu;
+				if (c->c_mtx != NULL)
+					mtx_lock(c->c_mtx);
+				c->c_func(c->c_arg);
+				if (c->c_mtx != NULL)
+					mtx_unlock(c->c_mtx);
+				kshim_curcpu = 0;
+				fired = 1;
+			}
+		} while (fired);
+	}
+}
+
+struct kshim_eventhandler {
+	const char	*name;
+	void		(*func)(void *);
+	void		*arg;
+	int		pri;
+	struct kshim_eventhandler *next;
+};
+
+static struct kshim_eventhandler *kshim_eventhandlers;
+
+/* Kept sorted by priority, like the kernel's lists. */
+eventhandler_tag
+kshim_eventhandler_register(const char *name, void (*func)(void *),
+    void *arg, int pri)
+{
+	struct kshim_eventhandler *eh, **ehp;
+
+	eh = calloc(1, sizeof(*eh));
+	eh->name = name;
+	eh->func = func;
+	eh->arg = arg;
+	eh->pri = pri;
+	for (ehp = &kshim_eventhandlers; *ehp != NULL && (*ehp)->pri <= pri;
+	    ehp = &(*ehp)->next)
+		;
+	eh->next = *ehp;
+	*ehp = eh;
+	return (eh);
+}
+
+void
+kshim_eventhandler_deregister(eventhandler_tag tag)
+{
+	struct kshim_eventhandler **ehp;
+
+	for (ehp = &kshim_eventhandlers; *ehp != NULL; ehp = &(*ehp)->next)
+		if (*ehp == tag) {
+			*ehp = tag->next;
+			(free)(tag);
+			return;
+		}
+}
+
+void
+kshim_eventhandler_invoke(const char *name)
+{
+	struct kshim_eventhandler *eh, *next;
+
+	for (eh = kshim_eventhandlers; eh != NULL; eh = next) {
+		next = eh->next;
+		if (strcmp(eh->name, name) == 0)
+			eh->func(eh->arg);
+	}
+}
+
+static int kshim_power_profile = POWER_PROFILE_PERFORMANCE;
+
+int
+power_profile_get_state(void)
+{
+
+	return (kshim_power_profile);
+}
+
+void
+power_profile_set_state(int state)
+{
+
+	if (state == kshim_power_profile)
+		return;
+	kshim_power_profile = state;
+	kshim_eventhandler_invoke("power_profile_change");
+}
+
+struct taskqueue {
+	struct task	*tq_first;
+	struct task	**tq_last;
+	struct taskqueue *tq_next;
+};
+
+static struct mtx kshim_taskqueue_mtx;
+MTX_SYSINIT(kshim_taskqueue, &kshim_taskqueue_mtx, "taskqueues", MTX_DEF);
+static struct taskqueue *kshim_taskqueues;
+
+struct taskqueue *
+taskqueue_create(const char *name, int mflags, taskqueue_enqueue_fn *enqueue,
+    void *context)
+{
+	struct taskqueue *tq;
+
+	(void)name;
+	(void)mflags;
+	(void)enqueue;
+	(void)context;
+	tq = calloc(1, sizeof(*tq));
+	tq->tq_last = &tq->tq_first;
+	mtx_lock(&kshim_taskqueue_mtx);
+	tq->tq_next = kshim_taskqueues;
+	kshim_taskqueues = tq;
+	mtx_unlock(&kshim_taskqueue_mtx);
+	return (tq);
+}
+
+void
+taskqueue_thread_enqueue(void *context)
+{
+
+	(void)context;
+}
+
+int
+taskqueue_start_threads(struct taskqueue **tqp, int count, int pri,
+    const char *name, ...)
+{
+
+	(void)tqp;
+	(void)count;
+	(void)pri;
+	(void)name;
+	return (0);
+}
+
+/* As in the kernel, a task already queued only has ta_pending bumped. */
+int
+taskqueue_enqueue(struct taskqueue *tq, struct task *task)
+{
+
+	mtx_lock(&kshim_taskqueue_mtx);
+	if (task->ta_pending++ == 0) {
+		task->ta_next = NULL;
+		*tq->tq_last = task;
+		tq->tq_last = &task->ta_next;
+	}
+	mtx_unlock(&kshim_taskqueue_mtx);
+	return (0);
+}
+
+/* Run the first task queued on tq, if any, and say whether one ran. */
+static int
+kshim_taskqueue_run_one(struct taskqueue *tq)
+{
+	struct task *task;
+	int pending;
+
+	mtx_lock(&kshim_taskqueue_mtx);
+	if ((task = tq->tq_first) != NULL) {
+		if ((tq->tq_first = task->ta_next) == NULL)
+			tq->tq_last = &tq->tq_first;
+		pending = task->ta_pending;
+		task->ta_pending = 0;
+	}
+	mtx_unlock(&kshim_taskqueue_mtx);
+	if (task == NULL)
+		return (0);
+	task->ta_func(task->ta_context, pending);
+	return (1);
+}
+
+/* Run every queued task; returns the number run. */
+int
+kshim_taskqueue_run(void)
+{
+	struct taskqueue *tq;
+	int n, ran;
+
+	n = 0;
+	do {
+		ran = 0;
+		for (tq = kshim_taskqueues; tq != NULL; tq = tq->tq_next)
+			ran += kshim_taskqueue_run_one(tq);
+		n += ran;
+	} while (ran != 0);
+	return (n);
+}
+
+void
+taskqueue_drain(struct taskqueue *tq, struct task *task)
+{
+
+	while (task->ta_pending != 0)
+		kshim_taskqueue_run_one(tq);
+}
+
+void
+taskqueue_free(struct taskqueue *tq)
+{
+	struct taskqueue **tqp;
+
+	while (kshim_taskqueue_run_one(tq))
+		;
+	mtx_lock(&kshim_taskqueue_mtx);
+	for (tqp = &kshim_taskqueues; *tqp != NULL; tqp = &(*tqp)->tq_next)
+		if (*tqp == tq) {
+			*tqp = tq->tq_next;
+			break;
+		}
+	mtx_unlock(&kshim_taskqueue_mtx);
+	(free)(tq);
+}
+
+/*
+ * Let the queued tasks run, or failing that a tick go by, with m
+ * dropped.  Nothing else can wake us, so there are no spurious
+ * wakeups to worry about, but nothing stops a caller which waits for
+ * something that never happens from spinning either.
+ */
+int
+msleep(void *chan, struct mtx *m, int pri, const char *wmesg, int timo)
+{
+
+	(void)chan;
+	(void)pri;
+	(void)wmesg;
+	mtx_unlock(m);
+	if (kshim_taskqueue_run() == 0)
+		kshim_advance(1);
+	mtx_lock(m);
+	return (timo > 0 ? EWOULDBLOCK : 0);
+}
+
+void
+kshim_sysctl_register(struct sysctl_oid *oidp)
+{
+
+	oidp->oid_next = kshim_oids;
+	kshim_oids = oidp;
+}
+
+static void
+kshim_sysctl_unregister(struct sysctl_oid *oidp)
+{
+	struct sysctl_oid **op;
+
+	for (op = &kshim_oids; *op != NULL; op = &(*op)->oid_next)
+		if (*op == oidp) {
+			*op = oidp->oid_next;
+			break;
+		}
+}
+
+void
+sysctl_ctx_init(struct sysctl_ctx_list *clist)
+{
+
+	clist->first = NULL;
+}
+
+int
+sysctl_ctx_free(struct sysctl_ctx_list *clist)
+{
+	struct sysctl_oid *oidp, *next;
+
+	for (oidp = clist->first; oidp != NULL; oidp = next) {
+		next = oidp->oid_ctx_next;
+		kshim_sysctl_unregister(oidp);
+		(free)((char *)oidp->oid_name);
+		(free)(oidp);
+	}
+	clist->first = NULL;
+	return (0);
+}
+
+struct sysctl_oid *
+kshim_sysctl_add(struct sysctl_ctx_list *clist, struct sysctl_oid *parent,
+    const char *name, int kind, void *a1, intmax_t a2,
+    int (*handler)(SYSCTL_HANDLER_ARGS), const char *fmt)
+{
+	struct sysctl_oid *oidp;
+
+	oidp = kshim_malloc(sizeof(*oidp), M_WAITOK | M_ZERO);
+	oidp->oid_parent = parent;
+	oidp->oid_name = strdup(name);
+	oidp->oid_kind = kind;
+	oidp->oid_arg1 = a1;
+	oidp->oid_arg2 = a2;
+	oidp->oid_handler = handler;
+	oidp->oid_fmt = fmt;
+	if (clist != NULL) {
+		oidp->oid_ctx_next = clist->first;
+		clist->first = oidp;
+	}
+	kshim_sysctl_register(oidp);
+	return (oidp);
+}
+
+devclass_t
+devclass_find(const char *classname)
+{
+
+	return (strcmp(classname, "cpu") == 0 ?
+	    (devclass_t)kshim_cpus : NULL);
+}
+
+/* cpuN devices exist for every CPU, each with its dev.cpu.N node. */
+device_t
+devclass_get_device(devclass_t dc, int unit)
+{
+	struct kshim_device *dev;
+
+	if (dc == NULL || unit < 0 || (u_int)unit > mp_maxid)
+		return (NULL);
+	dev = &kshim_cpus[unit];
+	if (dev->tree == NULL) {
+		if (kshim_dev_cpu == NULL)
+			kshim_dev_cpu = kshim_sysctl_add(&kshim_dev_ctx,
+			    &sysctl__dev, "cpu", CTLTYPE_NODE | CTLFLAG_RD,
+			    NULL, 0, NULL, "N");
+		dev->devname = "cpu";
+		dev->unit = unit;
+		snprintf(dev->name, sizeof(dev->name), "%d", unit);
+		dev->tree = kshim_sysctl_add(&kshim_dev_ctx, kshim_dev_cpu,
+		    dev->name, CTLTYPE_NODE | CTLFLAG_RD, NULL, 0, NULL, "N");
+	}
+	return (dev);
+}
+
+struct sysctl_oid *
+device_get_sysctl_tree(device_t dev)
+{
+
+	return (dev->tree);
+}
+
+device_t
+device_get_parent(device_t dev)
+{
+
+	return (dev->parent);
+}
+
+const char *
+device_get_name(device_t dev)
+{
+
+	return (dev->devname);
+}
+
+const char *
+device_get_nameunit(device_t dev)
+{
+
+	snprintf(dev->nameunit, sizeof(dev->nameunit), "%s%d", dev->devname,
+	    dev->unit);
+	return (dev->nameunit);
+}
+
+int
+device_get_unit(device_t dev)
+{
+
+	return (dev->unit);
+}
+
+void *
+device_get_softc(device_t dev)
+{
+
+	return (dev->softc);
+}
+
+void
+device_set_desc(device_t dev, const char *desc)
+{
+
+	(void)dev;
+	(void)desc;
+}
+
+int
+device_printf(device_t dev, const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	return (printf("%s: %s", device_get_nameunit(dev), buf));
+}
+
+device_t
+device_find_child(device_t dev, const char *name, int unit)
+{
+	struct kshim_device *child;
+
+	for (child = dev->children; child != NULL; child = child->sibling)
+		if (strcmp(child->devname, name) == 0 &&
+		    (unit == -1 || child->unit == unit))
+			return (child);
+	return (NULL);
+}
+
+/* Children are numbered after their parent CPU. */
+device_t
+kshim_add_child(device_t dev, u_int order, const char *name, int unit)
+{
+	struct kshim_device *child;
+
+	(void)order;
+	child = calloc(1, sizeof(*child));
+	child->devname = name;
+	child->unit = unit != -1 ? unit : dev->unit;
+	child->parent = dev;
+	child->sibling = dev->children;
+	dev->children = child;
+	return (child);
+}
+
+kobjop_t
+kshim_method(device_t dev, const char *name)
+{
+	device_method_t *m;
+
+	if (dev->driver == NULL)
+		return (NULL);
+	for (m = dev->driver->methods; m->name != NULL; m++)
+		if (strcmp(m->name, name) == 0)
+			return (m->func);
+	return (NULL);
+}
+
+void
+kshim_driver_register(driver_t *driver, const char *busname)
+{
+	struct kshim_driver *d;
+
+	d = calloc(1, sizeof(*d));
+	d->driver = driver;
+	d->busname = busname;
+	d->next = kshim_drivers;
+	kshim_drivers = d;
+}
+
+int
+device_probe_and_attach(device_t dev)
+{
+	struct kshim_driver *d;
+	int (*fn)(device_t);
+	int err;
+
+	for (d = kshim_drivers; d != NULL; d = d->next)
+		if (strcmp(d->driver->name, dev->devname) == 0 &&
+		    strcmp(d->busname, dev->parent->devname) == 0)
+			break;
+	if (d == NULL)
+		return (ENXIO);
+	dev->driver = d->driver;
+	fn = (int (*)(device_t))kshim_method(dev, "device_probe");
+	if (fn != NULL && (err = fn(dev)) > 0) {
+		dev->driver = NULL;
+		return (err);
+	}
+	dev->softc = calloc(1, d->driver->size ? d->driver->size : 1);
+	fn = (int (*)(device_t))kshim_method(dev, "device_attach");
+	if (fn != NULL && (err = fn(dev)) != 0) {
+		(free)(dev->softc);
+		dev->softc = NULL;
+		dev->driver = NULL;
+		return (err);
+	}
+	dev->attached = 1;
+	return (0);
+}
+
+int
+device_delete_child(device_t dev, device_t child)
+{
+	struct kshim_device **pp;
+	int (*fn)(device_t);
+	int err;
+
+	if (child->attached) {
+		fn = (int (*)(device_t))kshim_method(child, "device_detach");
+		if (fn != NULL && (err = fn(child)) != 0)
+			return (err);
+	}
+	for (pp = &dev->children; *pp != NULL; pp = &(*pp)->sibling)
+		if (*pp == child) {
+			*pp = child->sibling;
+			break;
+		}
+	(free)(child->softc);
+	(free)(child);
+	return (0);
+}
+
+/*
+ * Suspend or resume the children of every CPU, as the root bus would.
+ * Suspending stops at the first failure, resuming does them all.
+ */
+static int
+kshim_power(const char *method, int stop)
+{
+	struct kshim_device *dev;
+	int (*fn)(device_t);
+	u_int cpu;
+	int err;
+
+	for (cpu = 0; cpu <= mp_maxid; cpu++)
+		for (dev = kshim_cpus[cpu].children; dev != NULL;
+		    dev = dev->sibling) {
+			if (!dev->attached || (fn = (int (*)(device_t))
+			    kshim_method(dev, method)) == NULL)
+				continue;
+			if ((err = fn(dev)) != 0 && stop)
+				return (err);
+		}
+	return (0);
+}
+
+int
+kshim_suspend(void)
+{
+
+	return (kshim_power("device_suspend", 1));
+}
+
+int
+kshim_resume(void)
+{
+
+	return (kshim_power("device_resume", 0));
+}
+
+struct pcpu *
+cpu_get_pcpu(device_t dev)
+{
+
+	while (dev->parent != NULL)
+		dev = dev->parent;
+	return (pcpu_find(dev->unit));
+}
+
+static int
+kshim_cpufreq_settings(device_t dev, struct cf_setting *sets, int *count)
+{
+	int (*fn)(device_t, struct cf_setting *, int *);
+
+	fn = (int (*)(device_t, struct cf_setting *, int *))
+	    kshim_method(dev, "cpufreq_drv_settings");
+	return (fn != NULL ? fn(dev, sets, count) : ENXIO);
+}
+
+/* dev.cpu.N.freq: arg1 is the cpufreq driver's device. */
+static int
+kshim_cpufreq_freq(SYSCTL_HANDLER_ARGS)
+{
+	int (*get)(device_t, struct cf_setting *);
+	int (*set)(device_t, const struct cf_setting *);
+	struct cf_setting cf;
+	int err, MHz;
+
+	get = (int (*)(device_t, struct cf_setting *))
+	    kshim_method(arg1, "cpufreq_drv_get");
+	set = (int (*)(device_t, const struct cf_setting *))
+	    kshim_method(arg1, "cpufreq_drv_set");
+	if (get == NULL || set == NULL)
+		return (ENXIO);
+	if ((err = get(arg1, &cf)) != 0)
+		return (err);
+	MHz = cf.freq;
+	err = sysctl_handle_int(oidp, &MHz, 0, req);
+	if (err != 0 || req->newptr == NULL)
+		return (err);
+	memset(&cf, 0xff, sizeof(cf));
+	cf.freq = MHz;
+	cf.dev = arg1;
+	return (set(arg1, &cf));
+}
+
+/* dev.cpu.N.freq_levels: "MHz/mW" pairs, fastest first. */
+static int
+kshim_cpufreq_levels(SYSCTL_HANDLER_ARGS)
+{
+	struct cf_setting sets[MAX_SETTINGS];
+	char buf[MAX_SETTINGS * 12];
+	size_t len;
+	int count, err, i;
+
+	count = MAX_SETTINGS;
+	if ((err = kshim_cpufreq_settings(arg1, sets, &count)) != 0)
+		return (err);
+	len = 0;
+	buf[0] = '\0';
+	for (i = 0; i < count; i++)
+		len += snprintf(buf + len, sizeof(buf) - len, "%s%d/%d",
+		    i ? " " : "", sets[i].freq, sets[i].power);
+	return (sysctl_handle_string(oidp, buf, sizeof(buf), req));
+}
+
+int
+cpufreq_register(device_t dev)
+{
+	device_t cpu;
+
+	cpu = device_get_parent(dev);
+	if (cpu->cf_dev != NULL)
+		return (EEXIST);
+	cpu->cf_dev = dev;
+	sysctl_ctx_init(&cpu->cf_ctx);
+	kshim_sysctl_add(&cpu->cf_ctx, cpu->tree, "freq",
+	    CTLTYPE_INT | CTLFLAG_RW, dev, 0, kshim_cpufreq_freq, "I");
+	kshim_sysctl_add(&cpu->cf_ctx, cpu->tree, "freq_levels",
+	    CTLTYPE_STRING | CTLFLAG_RD, dev, 0, kshim_cpufreq_levels, "A");
+	return (0);
+}
+
+int
+cpufreq_unregister(device_t dev)
+{
+	device_t cpu;
+
+	cpu = device_get_parent(dev);
+	if (cpu->cf_dev != dev)
+		return (ENXIO);
+	sysctl_ctx_free(&cpu->cf_ctx);
+	cpu->cf_dev = NULL;
+	return (0);
+}
+
+/* Character devices, and the open files on them. */
+struct cdev {
+	struct cdevsw	*si_devsw;
+	char		si_name[32];
+	struct cdev	*si_next;
+};
+
+struct kshim_file {
+	struct cdev	*f_dev;
+	int		f_flags;
+	void		*f_priv;
+	d_priv_dtor_t	*f_dtor;
+	struct kshim_file *f_next;
+};
+
+static struct cdev *kshim_cdevs;
+static struct kshim_file *kshim_files;
+static __thread struct kshim_file *kshim_curfile;
+
+struct cdev *
+make_dev(struct cdevsw *devsw, int unit, int uid, int gid, int perms,
+    const char *fmt, ...)
+{
+	struct cdev *dev;
+	va_list ap;
+
+	dev = calloc(1, sizeof(*dev));
+	dev->si_devsw = devsw;
+	va_start(ap, fmt);
+	vsnprintf(dev->si_name, sizeof(dev->si_name), fmt, ap);
+	va_end(ap);
+	dev->si_next = kshim_cdevs;
+	kshim_cdevs = dev;
+	return (dev);
+}
+
+static void
+kshim_file_release(struct kshim_file *fp)
+{
+	struct kshim_file **fpp;
+
+	for (fpp = &kshim_files; *fpp != NULL; fpp = &(*fpp)->f_next)
+		if (*fpp == fp) {
+			*fpp = fp->f_next;
+			break;
+		}
+	if (fp->f_dtor != NULL)
+		fp->f_dtor(fp->f_priv);
+	fp->f_dtor = NULL;
+	fp->f_dev = NULL;
+}
+
+/* Like the kernel's, this runs the cdevpriv destructors of open files. */
+void
+destroy_dev(struct cdev *dev)
+{
+	struct cdev **devp;
+	struct kshim_file *fp, *next;
+
+	for (fp = kshim_files; fp != NULL; fp = next) {
+		next = fp->f_next;
+		if (fp->f_dev == dev)
+			kshim_file_release(fp);
+	}
+	for (devp = &kshim_cdevs; *devp != NULL; devp = &(*devp)->si_next)
+		if (*devp == dev) {
+			*devp = dev->si_next;
+			break;
+		}
+	(free)(dev);
+}
+
+int
+devfs_set_cdevpriv(void *priv, d_priv_dtor_t *dtr)
+{
+
+	if (kshim_curfile == NULL || kshim_curfile->f_dtor != NULL)
+		return (EBUSY);
+	kshim_curfile->f_priv = priv;
+	kshim_curfile->f_dtor = dtr;
+	return (0);
+}
+
+int
+devfs_get_cdevpriv(void **datap)
+{
+
+	if (kshim_curfile == NULL || kshim_curfile->f_dtor == NULL)
+		return (EBADF);
+	*datap = kshim_curfile->f_priv;
+	return (0);
+}
+
+/* Open /dev/name; flags are FREAD and FWRITE.  NULL with errno set. */
+struct kshim_file *
+kshim_open(const char *name, int flags)
+{
+	struct kshim_file *fp;
+	struct cdev *dev;
+	int err;
+
+	for (dev = kshim_cdevs; dev != NULL; dev = dev->si_next)
+		if (strcmp(dev->si_name, name) == 0)
+			break;
+	if (dev == NULL) {
+		errno = ENOENT;
+		return (NULL);
+	}
+	fp = calloc(1, sizeof(*fp));
+	fp->f_dev = dev;
+	fp->f_flags = flags;
+	err = 0;
+	if (dev->si_devsw->d_open != NULL) {
+		kshim_curfile = fp;
+		err = dev->si_devsw->d_open(dev, flags, 0, curthread);
+		kshim_curfile = NULL;
+	}
+	if (err != 0) {
+		(free)(fp);
+		errno = err;
+		return (NULL);
+	}
+	fp->f_next = kshim_files;
+	kshim_files = fp;
+	return (fp);
+}
+
+int
+kshim_ioctl(struct kshim_file *fp, u_long cmd, void *data)
+{
+	struct cdev *dev;
+	int err;
+
+	if ((dev = fp->f_dev) == NULL)
+		return (ENXIO);
+	if (dev->si_devsw->d_ioctl == NULL)
+		return (ENODEV);
+	kshim_curfile = fp;
+	err = dev->si_devsw->d_ioctl(dev, cmd, data, fp->f_flags, curthread);
+	kshim_curfile = NULL;
+	return (err);
+}
+
+/*
+ * Map len bytes of fp read-only, asking d_mmap for every page as
+ * the VM system would.  NULL with errno set.
+ */
+const void *
+kshim_mmap(struct kshim_file *fp, size_t len)
+{
+	struct cdev *dev;
+	vm_paddr_t pa, base;
+	vm_memattr_t ma;
+	size_t off;
+	int err;
+
+	if ((dev = fp->f_dev) == NULL || dev->si_devsw->d_mmap == NULL) {
+		errno = ENODEV;
+		return (NULL);
+	}
+	base = 0;
+	ma = 0;
+	for (off = 0; off < len; off += PAGE_SIZE) {
+		kshim_curfile = fp;
+		err = dev->si_devsw->d_mmap(dev, off, &pa, PROT_READ, &ma);
+		kshim_curfile = NULL;
+		if (err != 0) {
+			errno = err;
+			return (NULL);
+		}
+		if (off == 0)
+			base = pa;
+		else if (pa != base + off)
+			abort();
+	}
+	return ((const void *)base);
+}
+
+void
+kshim_close(struct kshim_file *fp)
+{
+
+	kshim_file_release(fp);
+	(free)(fp);
+}
+
+static int
+kshim_oid_matches(struct sysctl_oid *oidp, const char *name, size_t len)
+{
+	const char *dot;
+	size_t n;
+
+	if (oidp == NULL)
+		return (len == 0);
+	n = strlen(oidp->oid_name);
+	if (n > len || strncmp(name + len - n, oidp->oid_name, n) != 0)
+		return (0);
+	if (oidp->oid_parent == NULL)
+		return (n == len);
+	if (n == len)
+		return (0);
+	dot = name + len - n - 1;
+	if (*dot != '.')
+		return (0);
+	return (kshim_oid_matches(oidp->oid_parent, name, len - n - 1));
+}
+
+static struct sysctl_oid *
+kshim_oid_find(const char *name)
+{
+	struct sysctl_oid *oidp;
+
+	for (oidp = kshim_oids; oidp != NULL; oidp = oidp->oid_next)
+		if (kshim_oid_matches(oidp, name, strlen(name)))
+			return (oidp);
+	return (NULL);
+}
+
+static int
+kshim_oid_fullname(struct sysctl_oid *oidp, char *buf, size_t len)
+{
+
+	if (oidp->oid_parent != NULL) {
+		kshim_oid_fullname(oidp->oid_parent, buf, len);
+		strncat(buf, ".", len - strlen(buf) - 1);
+	} else
+		buf[0] = '\0';
+	strncat(buf, oidp->oid_name, len - strlen(buf) - 1);
+	return (0);
+}
+
+int
+kshim_sysctlbyname(const char *name, void *oldp, size_t *oldlenp,
+    const void *newp, size_t newlen)
+{
+	struct sysctl_oid *oidp;
+	struct sysctl_req req;
+	int err;
+
+	oidp = kshim_oid_find(name);
+	if (oidp == NULL || oidp->oid_handler == NULL)
+		return (ENOENT);
+	if (newp != NULL && !(oidp->oid_kind & CTLFLAG_WR))
+		return (EPERM);
+	memset(&req, 0, sizeof(req));
+	req.oldptr = oldp;
+	req.oldlen = oldlenp != NULL ? *oldlenp : 0;
+	req.newptr = newp;
+	req.newlen = newlen;
+	err = oidp->oid_handler(oidp, oidp->oid_arg1, oidp->oid_arg2, &req);
+	if (oldlenp != NULL)
+		*oldlenp = req.oldidx;
+	return (err);
+}
+
+int
+kshim_sysctl_out(struct sysctl_req *req, const void *p, size_t l)
+{
+	size_t i;
+
+	i = req->oldidx;
+	req->oldidx += l;
+	if (req->oldptr == NULL)
+		return (0);
+	if (i + l > req->oldlen)
+		return (ENOMEM);
+	memcpy((char *)req->oldptr + i, p, l);
+	return (0);
+}
+
+int
+kshim_sysctl_in(struct sysctl_req *req, void *p, size_t l)
+{
+
+	if (req->newptr == NULL)
+		return (0);
+	if (req->newlen - req->newidx < l)
+		return (EINVAL);
+	memcpy(p, (const char *)req->newptr + req->newidx, l);
+	req->newidx += l;
+	return (0);
+}
+
+int
+sysctl_handle_int(SYSCTL_HANDLER_ARGS)
+{
+	int tmp, err;
+
+	(void)oidp;
+	tmp = arg1 != NULL ? *(int *)arg1 : (int)arg2;
+	err = SYSCTL_OUT(req, &tmp, sizeof(tmp));
+	if (err || req->newptr == NULL)
+		return (err);
+	if (arg1 == NULL)
+		return (EPERM);
+	return (SYSCTL_IN(req, arg1, sizeof(int)));
+}
+
+int
+sysctl_handle_long(SYSCTL_HANDLER_ARGS)
+{
+	long tmp;
+	int err;
+
+	(void)oidp;
+	tmp = arg1 != NULL ? *(long *)arg1 : (long)arg2;
+	err = SYSCTL_OUT(req, &tmp, sizeof(tmp));
+	if (err || req->newptr == NULL)
+		return (err);
+	if (arg1 == NULL)
+		return (EPERM);
+	return (SYSCTL_IN(req, arg1, sizeof(long)));
+}
+
+int
+sysctl_handle_64(SYSCTL_HANDLER_ARGS)
+{
+	uint64_t tmp;
+	int err;
+
+	(void)oidp;
+	tmp = arg1 != NULL ? *(uint64_t *)arg1 : (uint64_t)arg2;
+	err = SYSCTL_OUT(req, &tmp, sizeof(tmp));
+	if (err || req->newptr == NULL)
+		return (err);
+	if (arg1 == NULL)
+		return (EPERM);
+	return (SYSCTL_IN(req, arg1, sizeof(uint64_t)));
+}
+
+int
+sysctl_handle_string(SYSCTL_HANDLER_ARGS)
+{
+	size_t len;
+	int err;
+
+	(void)oidp;
+	len = strlen((char *)arg1) + 1;
+	err = SYSCTL_OUT(req, arg1, len);
+	if (err || req->newptr == NULL)
+		return (err);
+	len = req->newlen - req->newidx;
+	if (arg2 == 0 || len >= (size_t)arg2)
+		return (EINVAL);
+	err = SYSCTL_IN(req, arg1, len);
+	((char *)arg1)[len] = '\0';
+	return (err);
+}
+
+int
+sysctl_handle_opaque(SYSCTL_HANDLER_ARGS)
+{
+	int err;
+
+	(void)oidp;
+	err = SYSCTL_OUT(req, arg1, arg2);
+	if (err || req->newptr == NULL)
+		return (err);
+	return (SYSCTL_IN(req, arg1, arg2));
+}
+
+struct sbuf *
+sbuf_new_for_sysctl(struct sbuf *s, char *buf, int length,
+    struct sysctl_req *req)
+{
+
+	(void)buf;
+	if (s == NULL)
+		s = (malloc)(sizeof(*s));
+	memset(s, 0, sizeof(*s));
+	s->s_size = length > 0 ? length : 64;
+	s->s_buf = (malloc)(s->s_size);
+	s->s_buf[0] = '\0';
+	s->s_req = req;
+	return (s);
+}
+
+struct sbuf *
+sbuf_new_auto(void)
+{
+
+	return (sbuf_new_for_sysctl(NULL, NULL, 64, NULL));
+}
+
+int
+sbuf_printf(struct sbuf *s, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	while (s->s_len + n + 1 > s->s_size) {
+		s->s_size *= 2;
+		s->s_buf = realloc(s->s_buf, s->s_size);
+	}
+	va_start(ap, fmt);
+	vsnprintf(s->s_buf + s->s_len, n + 1, fmt, ap);
+	va_end(ap);
+	s->s_len += n;
+	return (0);
+}
+
+int
+sbuf_cat(struct sbuf *s, const char *str)
+{
+
+	return (sbuf_printf(s, "%s", str));
+}
+
+int
+sbuf_finish(struct sbuf *s)
+{
+
+	if (s->s_req != NULL)
+		s->s_error = SYSCTL_OUT(s->s_req, s->s_buf, s->s_len + 1);
+	return (s->s_error);
+}
+
+char *
+sbuf_data(struct sbuf *s)
+{
+
+	return (s->s_buf);
+}
+
+ssize_t
+sbuf_len(struct sbuf *s)
+{
+
+	return (s->s_len);
+}
+
+void
+sbuf_delete(struct sbuf *s)
+{
+
+	(free)(s->s_buf);
+	s->s_buf = NULL;
+}
+
+#define	KSHIM_NFIRMWARE	8
+static struct firmware kshim_firmware[KSHIM_NFIRMWARE];
+
+void
+kshim_firmware_register(const char *name, const void *data, size_t datasize)
+{
+	int i;
+
+	for (i = 0; i < KSHIM_NFIRMWARE; i++)
+		if (kshim_firmware[i].name == NULL ||
+		    strcmp(kshim_firmware[i].name, name) == 0)
+			break;
+	if (i == KSHIM_NFIRMWARE)
+		abort();
+	kshim_firmware[i].name = name;
+	kshim_firmware[i].data = data;
+	kshim_firmware[i].datasize = datasize;
+}
+
+const struct firmware *
+firmware_get(const char *name)
+{
+	int i;
+
+	for (i = 0; i < KSHIM_NFIRMWARE; i++)
+		if (kshim_firmware[i].name != NULL &&
+		    strcmp(kshim_firmware[i].name, name) == 0)
+			return (&kshim_firmware[i]);
+	return (NULL);
+}
+
+void
+firmware_put(const struct firmware *fw, int flags)
+{
+
+	(void)fw;
+	(void)flags;
+}
+
+void
+kshim_setenv(const char *name, const char *value)
+{
+	struct kshim_env *e;
+
+	e = (malloc)(sizeof(*e));
+	e->name = strdup(name);
+	e->value = strdup(value);
+	e->next = kshim_envs;
+	kshim_envs = e;
+}
+
+/* Feed loader tunables to CTLFLAG_TUN oids, as the kernel linker does. */
+static void
+kshim_tunables(void)
+{
+	struct sysctl_oid *oidp;
+	struct kshim_env *e;
+	char name[128];
+	size_t len;
+	int ival;
+
+	for (oidp = kshim_oids; oidp != NULL; oidp = oidp->oid_next) {
+		if (!(oidp->oid_kind & CTLFLAG_TUN))
+			continue;
+		kshim_oid_fullname(oidp, name, sizeof(name));
+		for (e = kshim_envs; e != NULL; e = e->next)
+			if (strcmp(e->name, name) == 0)
+				break;
+		if (e == NULL)
+			continue;
+		if ((oidp->oid_kind & CTLTYPE) == CTLTYPE_STRING) {
+			len = strlen(e->value) + 1;
+			if (oidp->oid_handler != sysctl_handle_string)
+				kshim_sysctlbyname(name, NULL, NULL, e->value,
+				    len);
+			else if (len <= (size_t)oidp->oid_arg2)
+				memcpy(oidp->oid_arg1, e->value, len);
+			continue;
+		}
+		ival = (int)strtol(e->value, NULL, 0);
+		if (oidp->oid_kind & CTLFLAG_WR)
+			kshim_sysctlbyname(name, NULL, NULL, &ival,
+			    sizeof(ival));
+		else if (oidp->oid_arg1 != NULL)
+			*(int *)oidp->oid_arg1 = ival;
+	}
+}
+
+void
+kshim_module_register(moduledata_t *mod)
+{
+
+	kshim_module = mod;
+}
+
+int
+kshim_load(void)
+{
+
+	kshim_tunables();
+	return (kshim_module->evhand(NULL, MOD_LOAD, kshim_module->priv));
+}
+
+int
+kshim_unload(void)
+{
+
+	return (kshim_module->evhand(NULL, MOD_UNLOAD, kshim_module->priv));
+}
@@ -0,0 +1,581 @@
+/*-
+ * Minimal userland stand-ins for the FreeBSD kernel interfaces used by
+ * est_PM.c, so the driver can be built and exercised on any POSIX host.
+ */
+
+#ifndef _KSHIM_H_
+#define	_KSHIM_H_
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/queue.h>
+#include <time.h>
+
+#ifndef __FreeBSD_version
+#define	__FreeBSD_version	1100000
+#endif
+
+#ifndef EOPNOTSUPP
+#define	EOPNOTSUPP	95
+#endif
+
+typedef unsigned int	u_int;
+typedef unsigned long	u_long;
+typedef unsigned char	u_char;
+
+#define	MAX(a, b)	((a) > (b) ? (a) : (b))
+#define	MIN(a, b)	((a) < (b) ? (a) : (b))
+#ifndef LIST_FOREACH_SAFE
+#define	LIST_FOREACH_SAFE(var, head, field, tvar)			\
+	for ((var) = LIST_FIRST((head));				\
+	    (var) && ((tvar) = LIST_NEXT((var), field), 1);		\
+	    (var) = (tvar))
+#endif
+#define	nitems(x)	(sizeof((x)) / sizeof((x)[0]))
+#define	CTASSERT(x)	_Static_assert((x), "compile-time assertion failed")
+
+/* Console output; kshim_quiet silences the driver's chatter. */
+extern int kshim_quiet;
+int	kshim_printf(const char *fmt, ...)
+	    __attribute__((format(__printf__, 1, 2)));
+#define	printf	kshim_printf
+
+/* Time.  cold is 0 unless a harness pretends to be booting. */
+extern int cold;
+extern int hz;
+extern volatile int ticks;
+#define	PUSER	0
+int	tsleep(void *chan, int pri, const char *wmesg, int timo);
+void	wakeup(void *chan);
+void	DELAY(int usec);
+
+struct bintime {
+	int64_t		sec;
+	uint64_t	frac;
+};
+void	getbinuptime(struct bintime *bt);
+void	binuptime(struct bintime *bt);
+
+/* Memory. */
+#define	M_TEMP		NULL
+#define	M_DEVBUF	NULL
+#define	M_WAITOK	0x0002
+#define	M_NOWAIT	0x0001
+#define	M_ZERO		0x0100
+#define	MALLOC_DEFINE(type, shortdesc, longdesc)			\
+	const int kshim_malloc_##type __attribute__((unused)) = 0
+void	*kshim_malloc(size_t size, int flags);
+#define	malloc(size, type, flags)	kshim_malloc((size), (flags))
+#define	free(addr, type)		(free)(addr)
+
+/*
+ * Physical memory is virtual memory here, so vtophys() is the
+ * identity and kshim_mmap() can hand the kernel address back.
+ */
+typedef uint64_t	vm_ooffset_t;
+typedef uintptr_t	vm_paddr_t;
+typedef int		vm_memattr_t;
+#ifndef PAGE_SIZE
+#define	PAGE_SIZE	4096
+#endif
+#define	round_page(x)	(((x) + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1))
+#define	vtophys(va)	((vm_paddr_t)(va))
+void	*kshim_contigmalloc(size_t size, int flags, size_t alignment);
+extern int kshim_contig_fail;	/* make contigmalloc() return NULL */
+#define	contigmalloc(size, type, flags, low, high, align, bound)	\
+	kshim_contigmalloc((size), (flags), (align))
+#define	contigfree(addr, size, type)	(free)(addr)
+
+#define	atomic_store_rel_32(p, v)					\
+	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define	atomic_load_acq_32(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define	atomic_subtract_int(p, v)					\
+	(void)__atomic_fetch_sub((p), (v), __ATOMIC_SEQ_CST)
+#define	atomic_thread_fence_acq()	__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define	atomic_thread_fence_rel()	__atomic_thread_fence(__ATOMIC_RELEASE)
+#define	cpu_spinwait()			sched_yield()
+#define	critical_enter()		do { } while (0)
+#define	critical_exit()			do { } while (0)
+#define	bzero(p, l)			memset((p), 0, (l))
+#define	bcopy(s, d, l)			memmove((d), (s), (l))
+size_t	kshim_strlcpy(char *dst, const char *src, size_t size);
+#define	strlcpy				kshim_strlcpy
+
+/* Processor identification. */
+#define	CPUID_HTT	0x10000000
+#define	CPUID_TM	0x20000000
+extern char cpu_vendor[20];
+extern u_int cpu_high;
+
+/*
+ * SMP.  Every thread has a notion of the CPU it runs on, which starts
+ * out as 0 and is changed by sched_bind(), callouts and rendezvous.
+ * Only sched_bind() and sched_unbind() count as binding the thread.
+ */
+#define	MAXCPU		32
+extern int mp_ncpus;
+extern u_int mp_maxid;
+extern int smp_started;
+#define	CPU_ABSENT(cpu)	((u_int)(cpu) > mp_maxid)
+extern __thread int kshim_curcpu;
+#define	curcpu		kshim_curcpu
+struct thread;
+#define	curthread	((struct thread *)NULL)
+#define	thread_lock(td)		((void)(td))
+#define	thread_unlock(td)	((void)(td))
+void	sched_bind(struct thread *td, int cpu);
+void	sched_unbind(struct thread *td);
+int	sched_is_bound(struct thread *td);
+
+typedef struct {
+	uint64_t	bits;
+} cpuset_t;
+#define	CPU_ZERO(s)		((s)->bits = 0)
+#define	CPU_SET(n, s)		((s)->bits |= (uint64_t)1 << (n))
+#define	CPU_ISSET(n, s)		(((s)->bits >> (n)) & 1)
+#define	smp_no_rendezvous_barrier	((void (*)(void *))NULL)
+void	smp_rendezvous_cpus(cpuset_t map, void (*setup)(void *),
+	    void (*action)(void *), void (*teardown)(void *), void *arg);
+void	do_cpuid(u_int ax, u_int *p);
+uint64_t rdmsr(u_int msr);
+void	wrmsr(u_int msr, uint64_t val);
+
+/* cp_time. */
+#define	CP_USER		0
+#define	CP_NICE		1
+#define	CP_SYS		2
+#define	CP_INTR		3
+#define	CP_IDLE		4
+#define	CPUSTATES	5
+void	read_cpu_time(long *cp_time);
+struct pcpu {
+	u_int		pc_cpuid;
+	long		pc_cp_time[CPUSTATES];
+};
+struct pcpu *pcpu_find(u_int cpuid);
+
+/* Timecounters. */
+struct timecounter;
+typedef u_int timecounter_get_t(struct timecounter *);
+struct timecounter {
+	const char	*tc_name;
+	uint64_t	tc_frequency;
+	timecounter_get_t *tc_get_timecount;
+	u_int		tc_counter_mask;
+	int		tc_quality;
+	struct timecounter *tc_next;
+};
+extern struct timecounter *timecounter;
+extern uint64_t tsc_freq;
+extern int kshim_nwindups;
+void	nanotime(struct timespec *ts);
+void	tc_setclock(struct timespec *ts);
+
+/* Mutexes. */
+struct mtx {
+	pthread_mutex_t	mtx_lock;
+	pthread_t	mtx_owner;
+	int		mtx_owned;
+	const char	*mtx_name;
+};
+#define	MTX_DEF		0
+#define	MA_OWNED	1
+#define	MA_NOTOWNED	2
+void	mtx_init(struct mtx *m, const char *name, const char *type, int opts);
+void	mtx_destroy(struct mtx *m);
+void	mtx_lock(struct mtx *m);
+void	mtx_unlock(struct mtx *m);
+int	mtx_owned(struct mtx *m);
+/* Called by mtx_lock() before it blocks, to let checks get in first. */
+extern void (*kshim_mtx_hook)(struct mtx *m);
+#define	mtx_assert(m, what)	kshim_mtx_assert((m), (what), __FILE__, __LINE__)
+void	kshim_mtx_assert(struct mtx *m, int what, const char *file, int line);
+#define	MTX_SYSINIT(name, m, desc, opts)				\
+static void __attribute__((constructor))				\
+kshim_mtx_sysinit_##name(void)						\
+{									\
+	mtx_init((m), (desc), NULL, (opts));				\
+}
+
+/* Callouts, run from kshim_advance() against a virtual tick counter. */
+struct callout {
+	void		(*c_func)(void *);
+	void		*c_arg;
+	struct mtx	*c_mtx;
+	int		c_time;
+	int		c_pending;
+	int		c_cpu;
+	struct callout	*c_next;
+};
+void	callout_init_mtx(struct callout *c, struct mtx *m, int flags);
+void	callout_reset(struct callout *c, int t, void (*func)(void *),
+	    void *arg);
+void	callout_reset_on(struct callout *c, int t, void (*func)(void *),
+	    void *arg, int cpu);
+int	callout_stop(struct callout *c);
+#define	callout_pending(c)	((c)->c_pending)
+int	callout_drain(struct callout *c);
+
+/*
+ * Taskqueues.  There are no taskqueue threads: queued tasks run from
+ * kshim_advance(), and from msleep(), as if the thread had had the
+ * CPU while the caller slept.
+ */
+#define	PWAIT		0
+#define	PCATCH		0x0100
+int	msleep(void *chan, struct mtx *m, int pri, const char *wmesg,
+	    int timo);
+
+typedef void task_fn_t(void *context, int pending);
+struct task {
+	struct task	*ta_next;
+	int		ta_pending;
+	task_fn_t	*ta_func;
+	void		*ta_context;
+};
+#define	TASK_INIT(task, prio, func, context) do {			\
+	(task)->ta_next = NULL;						\
+	(task)->ta_pending = 0;						\
+	(task)->ta_func = (func);					\
+	(task)->ta_context = (context);					\
+} while (0)
+struct taskqueue;
+typedef void taskqueue_enqueue_fn(void *context);
+struct taskqueue *taskqueue_create(const char *name, int mflags,
+	    taskqueue_enqueue_fn *enqueue, void *context);
+void	taskqueue_thread_enqueue(void *context);
+int	taskqueue_start_threads(struct taskqueue **tqp, int count, int pri,
+	    const char *name, ...);
+int	taskqueue_enqueue(struct taskqueue *tq, struct task *task);
+void	taskqueue_drain(struct taskqueue *tq, struct task *task);
+void	taskqueue_free(struct taskqueue *tq);
+int	kshim_taskqueue_run(void);
+
+/* Sysctls. */
+struct sysctl_req {
+	void		*oldptr;
+	size_t		oldlen;
+	size_t		oldidx;
+	const void	*newptr;
+	size_t		newlen;
+	size_t		newidx;
+};
+
+struct sysctl_oid;
+#define	SYSCTL_HANDLER_ARGS						\
+	struct sysctl_oid *oidp, void *arg1, intmax_t arg2,		\
+	struct sysctl_req *req
+
+struct sysctl_oid {
+	struct sysctl_oid *oid_parent;
+	const char	*oid_name;
+	int		oid_kind;
+	void		*oid_arg1;
+	intmax_t	oid_arg2;
+	int		(*oid_handler)(SYSCTL_HANDLER_ARGS);
+	const char	*oid_fmt;
+	struct sysctl_oid *oid_next;
+	struct sysctl_oid *oid_ctx_next;	/* dynamic oids only */
+};
+
+/* Dynamic oids, linked through oid_ctx_next. */
+struct sysctl_ctx_list {
+	struct sysctl_oid *first;
+};
+
+#define	CTLTYPE		0xf
+#define	CTLTYPE_NODE	1
+#define	CTLTYPE_INT	2
+#define	CTLTYPE_STRING	3
+#define	CTLTYPE_S64	4
+#define	CTLTYPE_OPAQUE	5
+#define	CTLTYPE_UINT	6
+#define	CTLTYPE_U64	9
+#define	CTLFLAG_RD	0x80000000
+#define	CTLFLAG_WR	0x40000000
+#define	CTLFLAG_RW	(CTLFLAG_RD | CTLFLAG_WR)
+#define	CTLFLAG_TUN	0x00080000
+#define	CTLFLAG_RDTUN	(CTLFLAG_RD | CTLFLAG_TUN)
+#define	CTLFLAG_RWTUN	(CTLFLAG_RW | CTLFLAG_TUN)
+#define	CTLFLAG_MPSAFE	0x00040000
+#define	OID_AUTO	(-1)
+
+void	kshim_sysctl_register(struct sysctl_oid *oidp);
+int	sysctl_handle_int(SYSCTL_HANDLER_ARGS);
+int	sysctl_handle_long(SYSCTL_HANDLER_ARGS);
+int	sysctl_handle_64(SYSCTL_HANDLER_ARGS);
+int	sysctl_handle_string(SYSCTL_HANDLER_ARGS);
+int	sysctl_handle_opaque(SYSCTL_HANDLER_ARGS);
+int	kshim_sysctl_out(struct sysctl_req *req, const void *p, size_t l);
+int	kshim_sysctl_in(struct sysctl_req *req, void *p, size_t l);
+#define	SYSCTL_OUT(req, p, l)	kshim_sysctl_out((req), (p), (l))
+#define	SYSCTL_IN(req, p, l)	kshim_sysctl_in((req), (p), (l))
+
+#define	SYSCTL_DECL(name)	extern struct sysctl_oid sysctl_##name
+
+#define	KSHIM_SYSCTL(parent, name, kind, a1, a2, handler, fmt)		\
+	struct sysctl_oid sysctl_##parent##_##name = {			\
+		&sysctl_##parent, #name, (kind), (void *)(a1), (a2),	\
+		(handler), (fmt), NULL, NULL				\
+	};								\
+	static void __attribute__((constructor))			\
+	kshim_sysctl_init_##parent##_##name(void)			\
+	{								\
+		kshim_sysctl_register(&sysctl_##parent##_##name);	\
+	}
+
+#define	SYSCTL_NODE(parent, nbr, name, access, handler, descr)		\
+	KSHIM_SYSCTL(parent, name, CTLTYPE_NODE | (access), NULL, 0,	\
+	    NULL, "N")
+#define	SYSCTL_PROC(parent, nbr, name, access, a1, a2, handler, fmt, d)	\
+	KSHIM_SYSCTL(parent, name, (access), a1, a2, handler, fmt)
+#define	SYSCTL_INT(parent, nbr, name, access, ptr, val, descr)		\
+	KSHIM_SYSCTL(parent, name, CTLTYPE_INT | (access), ptr, val,	\
+	    sysctl_handle_int, "I")
+#define	SYSCTL_UINT(parent, nbr, name, access, ptr, val, descr)		\
+	KSHIM_SYSCTL(parent, name, CTLTYPE_UINT | (access), ptr, val,	\
+	    sysctl_handle_int, "IU")
+#define	SYSCTL_U64(parent, nbr, name, access, ptr, val, descr)		\
+	KSHIM_SYSCTL(parent, name, CTLTYPE_U64 | (access), ptr, val,	\
+	    sysctl_handle_64, "QU")
+#define	SYSCTL_STRING(parent, nbr, name, access, arg, len, descr)	\
+	KSHIM_SYSCTL(parent, name, CTLTYPE_STRING | (access), arg, len,	\
+	    sysctl_handle_string, "A")
+#define	SYSCTL_OPAQUE(parent, nbr, name, access, ptr, len, fmt, descr)	\
+	KSHIM_SYSCTL(parent, name, CTLTYPE_OPAQUE | (access), ptr, len,	\
+	    sysctl_handle_opaque, fmt)
+
+void	sysctl_ctx_init(struct sysctl_ctx_list *clist);
+int	sysctl_ctx_free(struct sysctl_ctx_list *clist);
+struct sysctl_oid *kshim_sysctl_add(struct sysctl_ctx_list *clist,
+	    struct sysctl_oid *parent, const char *name, int kind, void *a1,
+	    intmax_t a2, int (*handler)(SYSCTL_HANDLER_ARGS),
+	    const char *fmt);
+#define	SYSCTL_CHILDREN(oidp)		(oidp)
+#define	SYSCTL_STATIC_CHILDREN(parent)	(&sysctl_##parent)
+#define	SYSCTL_ADD_NODE(ctx, parent, nbr, name, access, handler, descr)	\
+	kshim_sysctl_add((ctx), (parent), (name), CTLTYPE_NODE | (access), \
+	    NULL, 0, NULL, "N")
+#define	SYSCTL_ADD_PROC(ctx, parent, nbr, name, access, a1, a2, handler, \
+	    fmt, descr)							\
+	kshim_sysctl_add((ctx), (parent), (name), (access), (a1), (a2),	\
+	    (handler), (fmt))
+#define	SYSCTL_ADD_INT(ctx, parent, nbr, name, access, ptr, val, descr)	\
+	kshim_sysctl_add((ctx), (parent), (name), CTLTYPE_INT | (access),	\
+	    (ptr), (val), sysctl_handle_int, "I")
+#define	SYSCTL_ADD_UINT(ctx, parent, nbr, name, access, ptr, val, descr) \
+	kshim_sysctl_add((ctx), (parent), (name), CTLTYPE_UINT | (access), \
+	    (ptr), (val), sysctl_handle_int, "IU")
+
+SYSCTL_DECL(_hw);
+SYSCTL_DECL(_dev);
+SYSCTL_DECL(_kern);
+
+/*
+ * Devices: cpuN for every CPU, with its dev.cpu.N node, and the
+ * children drivers add to them.  Methods are looked up by name.
+ */
+typedef struct kshim_device *device_t;
+typedef struct kshim_devclass *devclass_t;
+typedef void (*kobjop_t)(void);
+typedef struct {
+	const char	*name;
+	kobjop_t	func;
+} device_method_t;
+#define	DEVMETHOD(name, func)	{ #name, (kobjop_t)(func) }
+#define	DEVMETHOD_END		{ NULL, NULL }
+typedef struct driver {
+	const char	*name;
+	device_method_t	*methods;
+	size_t		size;
+} driver_t;
+#define	BUS_PROBE_DEFAULT	(-20)
+extern struct mtx Giant;
+
+devclass_t devclass_find(const char *classname);
+device_t devclass_get_device(devclass_t dc, int unit);
+struct sysctl_oid *device_get_sysctl_tree(device_t dev);
+device_t device_get_parent(device_t dev);
+const char *device_get_name(device_t dev);
+const char *device_get_nameunit(device_t dev);
+int	device_get_unit(device_t dev);
+void	*device_get_softc(device_t dev);
+void	device_set_desc(device_t dev, const char *desc);
+int	device_printf(device_t dev, const char *fmt, ...)
+	    __attribute__((format(__printf__, 2, 3)));
+device_t device_find_child(device_t dev, const char *name, int unit);
+device_t kshim_add_child(device_t dev, u_int order, const char *name,
+	    int unit);
+#define	BUS_ADD_CHILD(dev, order, name, unit)				\
+	kshim_add_child((dev), (order), (name), (unit))
+int	device_probe_and_attach(device_t dev);
+int	device_delete_child(device_t dev, device_t child);
+struct pcpu *cpu_get_pcpu(device_t dev);
+kobjop_t kshim_method(device_t dev, const char *name);
+int	kshim_suspend(void);
+int	kshim_resume(void);
+void	kshim_driver_register(driver_t *driver, const char *busname);
+#define	DRIVER_MODULE(name, busname, driver, devclass, evh, arg)	\
+static void __attribute__((constructor))				\
+kshim_driver_init_##name(void)						\
+{									\
+	(void)&(devclass);						\
+	kshim_driver_register(&(driver), #busname);			\
+}
+
+/*
+ * Event handlers, which take nothing but their argument here;
+ * kshim_eventhandler_invoke() stands in for EVENTHANDLER_INVOKE().
+ */
+typedef struct kshim_eventhandler *eventhandler_tag;
+#define	EVENTHANDLER_PRI_FIRST	0
+#define	EVENTHANDLER_PRI_ANY	10000
+#define	EVENTHANDLER_PRI_LAST	20000
+eventhandler_tag kshim_eventhandler_register(const char *name,
+	    void (*func)(void *), void *arg, int pri);
+void	kshim_eventhandler_deregister(eventhandler_tag tag);
+void	kshim_eventhandler_invoke(const char *name);
+#define	EVENTHANDLER_REGISTER(name, func, arg, pri)			\
+	kshim_eventhandler_register(#name, (func), (arg), (pri))
+#define	EVENTHANDLER_DEREGISTER(name, tag)				\
+	kshim_eventhandler_deregister(tag)
+
+/*
+ * power_profile(9): setting the state runs the power_profile_change
+ * handlers if it changed, as acpi_acad(4) does on an AC line event.
+ */
+#define	POWER_PROFILE_PERFORMANCE	0
+#define	POWER_PROFILE_ECONOMY		1
+int	power_profile_get_state(void);
+void	power_profile_set_state(int state);
+
+/*
+ * cpufreq(4): registering a driver adds dev.cpu.N.freq and
+ * dev.cpu.N.freq_levels, which read and set its settings directly.
+ */
+struct cf_setting {
+	int		freq;		/* MHz */
+	int		volts;		/* mV */
+	int		power;		/* mW */
+	int		lat;		/* us */
+	device_t	dev;
+	int		spec[4];
+};
+#define	CPUFREQ_VAL_UNKNOWN	(-1)
+#define	CPUFREQ_TYPE_MASK	0xffff
+#define	CPUFREQ_TYPE_RELATIVE	(1<<0)
+#define	CPUFREQ_TYPE_ABSOLUTE	(1<<1)
+#define	CPUFREQ_FLAG_INFO_ONLY	(1<<16)
+#define	MAX_SETTINGS		256
+int	cpufreq_register(device_t dev);
+int	cpufreq_unregister(device_t dev);
+
+/*
+ * Character devices.  kshim_open() and friends stand in for the
+ * system calls; every open file gets its own cdevpriv, released by
+ * kshim_close() or destroy_dev().
+ */
+#define	FREAD		0x0001
+#define	FWRITE		0x0002
+#define	UID_ROOT	0
+#define	GID_WHEEL	0
+#define	D_VERSION	0x20011966
+struct cdev;
+typedef int d_open_t(struct cdev *dev, int oflags, int devtype,
+	    struct thread *td);
+typedef int d_ioctl_t(struct cdev *dev, u_long cmd, caddr_t data,
+	    int fflag, struct thread *td);
+typedef int d_mmap_t(struct cdev *dev, vm_ooffset_t offset,
+	    vm_paddr_t *paddr, int nprot, vm_memattr_t *memattr);
+typedef void d_priv_dtor_t(void *data);
+struct cdevsw {
+	int		d_version;
+	d_open_t	*d_open;
+	d_ioctl_t	*d_ioctl;
+	d_mmap_t	*d_mmap;
+	const char	*d_name;
+};
+struct cdev *make_dev(struct cdevsw *devsw, int unit, int uid, int gid,
+	    int perms, const char *fmt, ...)
+	    __attribute__((format(__printf__, 6, 7)));
+void	destroy_dev(struct cdev *dev);
+int	devfs_set_cdevpriv(void *priv, d_priv_dtor_t *dtr);
+int	devfs_get_cdevpriv(void **datap);
+
+struct kshim_file;
+struct kshim_file *kshim_open(const char *name, int flags);
+int	kshim_ioctl(struct kshim_file *fp, u_long cmd, void *data);
+const void *kshim_mmap(struct kshim_file *fp, size_t len);
+void	kshim_close(struct kshim_file *fp);
+
+/* sbufs, always backed by a sysctl request here. */
+struct sbuf {
+	char		*s_buf;
+	size_t		s_len;
+	size_t		s_size;
+	struct sysctl_req *s_req;
+	int		s_error;
+};
+struct sbuf *sbuf_new_for_sysctl(struct sbuf *s, char *buf, int length,
+	    struct sysctl_req *req);
+struct sbuf *sbuf_new_auto(void);
+int	sbuf_printf(struct sbuf *s, const char *fmt, ...)
+	    __attribute__((format(__printf__, 2, 3)));
+int	sbuf_cat(struct sbuf *s, const char *str);
+int	sbuf_finish(struct sbuf *s);
+char	*sbuf_data(struct sbuf *s);
+ssize_t	sbuf_len(struct sbuf *s);
+void	sbuf_delete(struct sbuf *s);
+
+/* firmware(9), from images registered with kshim_firmware_register(). */
+struct firmware {
+	const char	*name;
+	const void	*data;
+	size_t		datasize;
+	unsigned int	version;
+};
+#define	FIRMWARE_UNLOAD		0x0001
+const struct firmware *firmware_get(const char *name);
+void	firmware_put(const struct firmware *fw, int flags);
+void	kshim_firmware_register(const char *name, const void *data,
+	    size_t datasize);
+
+/* Modules. */
+typedef struct module *module_t;
+typedef int (*modeventhand_t)(module_t, int, void *);
+typedef struct moduledata {
+	const char	*name;
+	modeventhand_t	evhand;
+	void		*priv;
+} moduledata_t;
+#define	MOD_LOAD	0
+#define	MOD_UNLOAD	1
+#define	MOD_SHUTDOWN	2
+#define	MOD_QUIESCE	3
+void	kshim_module_register(moduledata_t *mod);
+#define	DECLARE_MODULE(name, data, sub, order)				\
+static void __attribute__((constructor))				\
+kshim_module_init_##name(void)						\
+{									\
+	kshim_module_register(&(data));					\
+}
+
+/* Hosted-side control: load/unload the driver and advance time. */
+int	kshim_load(void);
+int	kshim_unload(void);
+void	kshim_advance(int nticks);
+void	kshim_setenv(const char *name, const char *value);
+int	kshim_sysctlbyname(const char *name, void *oldp, size_t *oldlenp,
+	    const void *newp, size_t newlen);
+
+#endif /* !_KSHIM_H_ */